@@ -24,10 +24,17 @@ void state_at_end(
   FANSI_reset_pos(state);
 }
 
+/*
+ * @param x character vector, or a parsed string index (see index.c), in which
+ *   case end states are looked up from it instead of read where possible.
+ */
 SEXP FANSI_state_at_end_ext(
   SEXP x, SEXP warn, SEXP term_cap, SEXP ctl, SEXP norm, SEXP carry,
   SEXP arg, SEXP allowNA
 ) {
+  struct FANSI_index index;
+  struct FANSI_index * idx = FANSI_index_get(&index, x);
+  if(idx) x = idx->x;
   FANSI_val_args(x, norm, carry);
   if(TYPEOF(arg) != STRSXP || XLENGTH(arg) != 1)
     error("Internal Error: bad `arg` arg."); // nocov
@@ -56,6 +63,7 @@ SEXP FANSI_state_at_end_ext(
     carry_string, warn, term_cap, allowNA, keepNA, width,
     ctl, (R_xlen_t) 0
   );
+  PROTECT(state_prev.tab->mem); ++prt;
   state_at_end(&state_prev, 0, "carry");
 
   R_xlen_t len = XLENGTH(x);
@@ -71,15 +79,17 @@ SEXP FANSI_state_at_end_ext(
       state = FANSI_state_init_full(
         x, warn, term_cap, allowNA, keepNA, width, ctl, i
       );
+      PROTECT(state.tab->mem); ++prt;
     } else FANSI_state_reinit(&state, x, i);
     if(STRING_ELT(x, i) == NA_STRING || (any_na && do_carry)) {
       any_na = 1;
       SET_STRING_ELT(res, i, NA_STRING);
       continue;
     }
-    if(do_carry) state.fmt.sgr = state_prev.fmt.sgr;
+    if(do_carry) FANSI_state_set_sgr(&state, FANSI_state_fmt(&state_prev).sgr);
 
-    state_at_end(&state, i, arg_chr);
+    if(idx && FANSI_index_end(idx, i, &state)) FANSI_reset_pos(&state);
+    else state_at_end(&state, i, arg_chr);
     FANSI_state_as_chr(&buff, state, normalize, i);
 
     SEXP reschr = PROTECT(FANSI_mkChar(buff, CE_NATIVE, i));
@@ -114,7 +124,9 @@ struct FANSI_state FANSI_carry_init(
     carry_string, warn, term_cap, allowNA, keepNA,
     width, ctl, (R_xlen_t) 0
   );
+  PROTECT(state_carry.tab->mem); ++prt;
   state_at_end(&state_carry, (R_xlen_t) 0, "carry");
+  // Caller must PROTECT the format table (see FANSI_state_init_full)
   UNPROTECT(prt);
   return state_carry;
 }
@@ -132,12 +144,23 @@ int FANSI_W_bridge(
   R_xlen_t i,
   const char * err_msg
 ) {
+  struct FANSI_format end_fmt = FANSI_state_fmt(&end);
+  struct FANSI_format rst_fmt = FANSI_state_fmt(&restart);
+
+  // Same format in the same table needs no bridge, except for URLs without ids
+  // as those never compare equal (see FANSI_url_comp).
+  if(
+    end.tab == restart.tab && end.fmt_id == restart.fmt_id &&
+    !(URL_LEN(end_fmt.url) && !ID_LEN(end_fmt.url))
+  )
+    return buff->len;
+
   // Fairly different logic for normalize vs not because in normalize we can
   // rely on an e.g. color change to change a pre-existing color, whereas in
   // non-normalize we close explicitly and need to re-open.
   struct FANSI_sgr to_close, to_open;
-  to_close = FANSI_sgr_setdiff(end.fmt.sgr, restart.fmt.sgr, !normalize);
-  to_open = FANSI_sgr_setdiff(restart.fmt.sgr, end.fmt.sgr, !normalize);
+  to_close = FANSI_sgr_setdiff(end_fmt.sgr, rst_fmt.sgr, !normalize);
+  to_open = FANSI_sgr_setdiff(rst_fmt.sgr, end_fmt.sgr, !normalize);
 
   if(!normalize) {
     // We need to combine all the style tokens, which means we need to write the
@@ -146,7 +169,7 @@ int FANSI_W_bridge(
     // re-opened after an all-close.
     struct FANSI_sgr renew;
     // If we close everything, we need to re-open the stuff that was active
-    renew = FANSI_sgr_intersect(end.fmt.sgr, restart.fmt.sgr);
+    renew = FANSI_sgr_intersect(end_fmt.sgr, rst_fmt.sgr);
 
     int active_open = FANSI_sgr_active(to_open);
     int active_close = FANSI_sgr_active(to_close);
@@ -162,7 +185,7 @@ int FANSI_W_bridge(
       if(buff->buff) *((buff->buff) - 1) = 'm';
     } else {
       FANSI_W_sgr(
-        buff, FANSI_sgr_setdiff(restart.fmt.sgr, end.fmt.sgr, 0),
+        buff, FANSI_sgr_setdiff(rst_fmt.sgr, end_fmt.sgr, 0),
         normalize, 1, i
     );}
   } else {
@@ -171,10 +194,10 @@ int FANSI_W_bridge(
   }
   // Any changed URLs will need to be written (empty URL acts as a closer
   // so simpler than with SGR).
-  if(FANSI_url_comp(end.fmt.url, restart.fmt.url)) {
-    if(!FANSI_url_active(restart.fmt.url))
-      FANSI_W_url_close(buff, end.fmt.url, i);
-    FANSI_W_url(buff, restart.fmt.url, i);
+  if(FANSI_url_comp(end_fmt.url, rst_fmt.url)) {
+    if(!FANSI_url_active(rst_fmt.url))
+      FANSI_W_url_close(buff, end_fmt.url, i);
+    FANSI_W_url(buff, rst_fmt.url, i);
   }
   return buff->len;
 }
@@ -194,11 +217,14 @@ SEXP FANSI_bridge_state_ext(SEXP end, SEXP restart, SEXP term_cap, SEXP norm) {
   FANSI_INIT_BUFF(&buff);
 
   R_xlen_t x_len = XLENGTH(end);
-  SEXP res = PROTECT(allocVector(STRSXP, x_len)); // WRE docs this is init'ed
+  int prt = 0;
+  // WRE docs this is init'ed
+  SEXP res = PROTECT(allocVector(STRSXP, x_len)); ++prt;
 
   // We'll already have warned about these at some point
-  SEXP warn =  PROTECT(ScalarInteger(0));
+  SEXP warn =  PROTECT(ScalarInteger(0)); ++prt;
   struct FANSI_state st_end, st_rst;
+  int st_init = 0;
 
   for(R_xlen_t i = 0; i < x_len; ++i) {
     FANSI_interrupt(i);
@@ -215,11 +241,15 @@ SEXP FANSI_bridge_state_ext(SEXP end, SEXP restart, SEXP term_cap, SEXP norm) {
       );
       // nocov end
     }
-    // Do not warn here, so arg does not matter
-    if(!i) {
+    // Do not warn here, so arg does not matter.  States are initialized with
+    // the first element that is not NA.
+    if(!st_init) {
+      st_init = 1;
       st_end = FANSI_state_init(end, warn, term_cap, i);
+      PROTECT(st_end.tab->mem); ++prt;
       state_at_end(&st_end, i, NULL);
       st_rst = FANSI_state_init(restart, warn, term_cap, i);
+      PROTECT(st_rst.tab->mem); ++prt;
       state_at_end(&st_rst, i, NULL);
     } else {
       FANSI_state_reinit(&st_end, end, i);
@@ -243,7 +273,7 @@ SEXP FANSI_bridge_state_ext(SEXP end, SEXP restart, SEXP term_cap, SEXP norm) {
     UNPROTECT(1);
   }
   FANSI_release_buff(&buff, 1);
-  UNPROTECT(2);
+  UNPROTECT(prt);
   return res;
 }
 
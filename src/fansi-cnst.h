@@ -193,4 +193,22 @@
 #define RND_BOTH      3
 #define RND_NEITHER   4
 
+// Byte scanner implementations, see scan.c.  Ordered by preference.
+#define SCAN_SCALAR   0
+#define SCAN_SSE2     1
+#define SCAN_AVX2     2
+
+// Parsed escape sequence cache modes, see read.c
+#define ESC_CACHE_OFF     0
+#define ESC_CACHE_CALL    1
+#define ESC_CACHE_SESSION 2
+
+// Seek checkpoint cache modes, see seek.c
+#define SEEK_CACHE_OFF     0
+#define SEEK_CACHE_CALL    1
+#define SEEK_CACHE_SESSION 2
+
+// Format id not known, see state.c
+#define FMT_ID_NA 4294967295U
+
 #endif  /* _FANSI_CNST_H */
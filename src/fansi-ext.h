@@ -40,8 +40,48 @@ SEXP FANSI_strwrap_ext(
   SEXP warn, SEXP term_cap,
   SEXP first_only,
   SEXP ctl, SEXP norm, SEXP carry,
+  SEXP terminate, SEXP threads, SEXP balance, SEXP carry_out
+);
+SEXP FANSI_strtrim_ext(
+  SEXP x, SEXP width,
+  SEXP tabs_as_spaces, SEXP tab_stops,
+  SEXP warn, SEXP term_cap,
+  SEXP ctl, SEXP norm, SEXP carry,
   SEXP terminate
 );
+SEXP FANSI_substr_multi_ext(
+  SEXP x, SEXP start, SEXP stop,
+  SEXP type, SEXP rnd,
+  SEXP warn, SEXP term_cap,
+  SEXP ctl, SEXP norm,
+  SEXP carry, SEXP terminate
+);
+SEXP FANSI_substr_multi_replace_ext(
+  SEXP x, SEXP start, SEXP stop, SEXP value,
+  SEXP type, SEXP rnd,
+  SEXP warn, SEXP term_cap,
+  SEXP ctl, SEXP norm,
+  SEXP carry, SEXP terminate
+);
+SEXP FANSI_style_ranges_ext(
+  SEXP x, SEXP start, SEXP stop, SEXP sgr,
+  SEXP type, SEXP rnd,
+  SEXP warn, SEXP term_cap,
+  SEXP ctl, SEXP norm, SEXP carry
+);
+SEXP FANSI_strsplit_ext(
+  SEXP x, SEXP split, SEXP matches,
+  SEXP warn, SEXP term_cap, SEXP ctl, SEXP norm,
+  SEXP carry, SEXP terminate
+);
+SEXP FANSI_wrap_breaks_ext(
+  SEXP x, SEXP width,
+  SEXP indent, SEXP exdent,
+  SEXP prefix, SEXP initial,
+  SEXP wrap_always,
+  SEXP warn, SEXP term_cap,
+  SEXP ctl, SEXP carry
+);
 SEXP FANSI_process_ext(SEXP input, SEXP term_cap, SEXP ctl);
 SEXP FANSI_tabs_as_spaces_ext(
   SEXP vec, SEXP tab_stops, SEXP warn, SEXP term_cap, SEXP ctl
@@ -57,6 +97,7 @@ SEXP FANSI_nchar(
   SEXP x, SEXP type, SEXP keepNA, SEXP allowNA,
   SEXP warn, SEXP term_cap, SEXP ctl, SEXP z
 );
+SEXP FANSI_ctl_index(SEXP x, SEXP term_cap, SEXP ctl, SEXP words);
 SEXP FANSI_trimws(
   SEXP x, SEXP which, SEXP warn, SEXP term_cap, SEXP ctl, SEXP norm
 );
@@ -105,5 +146,15 @@ SEXP FANSI_reset_limits(void);
 SEXP FANSI_read_all_ext(SEXP x, SEXP warn, SEXP term_cap);
 
 SEXP FANSI_unicode_version(void);
+SEXP FANSI_width_table_check(void);
+
+SEXP FANSI_set_scan_mode(SEXP x);
+SEXP FANSI_esc_cache(SEXP mode, SEXP reset);
+SEXP FANSI_seek_cache(SEXP mode, SEXP reset);
+SEXP FANSI_index_words_stats(SEXP reset);
+
+// Run at load time, not .Call
+void FANSI_scan_init(void);
+void FANSI_width_init(void);
 
 #endif  /* _FANSI_EXT_H */
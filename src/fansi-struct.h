@@ -138,6 +138,29 @@ struct FANSI_position {
   int x;   // Next byte to read
   int w;   // pos_width
 };
+/*
+ * Table of the distinct formats seen in a call.
+ *
+ * States record their format as an id into this table so that they are small
+ * to copy and can be compared for equality by id (see state.c).  Id 0 is
+ * always the empty format, and needs no table.
+ */
+struct FANSI_fmt_step {
+  unsigned int from;          // id before the step
+  unsigned int key;           // identifies the step, 0 for unused
+  unsigned int to;            // id after the step
+};
+struct FANSI_fmt_tab {
+  struct FANSI_format * fmt;  // formats, by id
+  unsigned int * slot;        // open addressing hash of ids, 0 for empty
+  unsigned int n;             // formats in table, including the empty one
+  unsigned int alloc;         // capacity of `fmt`, `slot` has twice that
+  struct FANSI_fmt_step * step;  // memo of recent steps, NULL until used
+  char * url;                 // free memory for URL copies
+  int url_left;               // bytes free at `url`
+  int url_n;                  // chunks of URL memory used
+  SEXP mem;                   // holds the memory for all of the above
+};
 /*
  * Captures the SGR and OSC URL state at any particular position in a string.
  *
@@ -146,10 +169,19 @@ struct FANSI_position {
  * Keep in-sync with e.g. `FANSI_reset_state`.
  */
 struct FANSI_state {
-  struct FANSI_format   fmt;
+  const char * string;
+
+  // Bytes in `string`, excluding the terminator.  Bounds the vector scans (see
+  // scan.c), so it must be updated whenever `string` is.
+  int len;
+
+  // Format table shared by all states derived from the same initialization.
+  struct FANSI_fmt_tab * tab;
+
   struct FANSI_position pos;
 
-  const char * string;
+  // Id of the format in `tab`, use `FANSI_state_fmt` et al. to access.
+  unsigned int fmt_id;
 
   // R level settings, see SET_*
   unsigned int settings;
@@ -172,6 +204,52 @@ struct FANSI_state_pair {
   struct FANSI_state cur;
   struct FANSI_state restart;
 };
+/*
+ * Format as recorded in a parsed string index (see index.c).  URL and id
+ * offsets are relative to the indexed string.
+ */
+struct FANSI_index_fmt {
+  struct FANSI_sgr sgr;
+  struct FANSI_offset url;
+  struct FANSI_offset id;
+  int has_url;
+};
+/*
+ * Word as recorded in a parsed string index, for wrapping (see index.c).
+ * Widths are in COUNT_WIDTH mode, and the `last_*` members are the state
+ * before reading the last element of the word.
+ */
+struct FANSI_index_word {
+  int x;            // byte position of the start of the word
+  int w;            // width position of the start of the word
+  int last_x;
+  int last_w;
+  int last_utf8;
+  int last_status;  // without STAT_WARNED
+  int last_fmt;     // index into `fmt`, -1 if same as at start of word
+};
+/*
+ * Parsed string index contents (see index.c).
+ *
+ * Checkpoints for element `i` are `elt[i]` through `elt[i + 1] - 1`, in order.
+ * Widths for COUNT_* mode `m` are `cp_w[m * n_cp + k]`.  Words for element
+ * `i`, if recorded, are `wd_elt[i]` through `wd_elt[i + 1] - 1`.
+ */
+struct FANSI_index {
+  SEXP x;                 // the indexed strings
+  unsigned int settings;  // SET_* used to build index, see IDX_SET_MASK
+  const int * elt;
+  const int * cp_x;       // byte position
+  const int * cp_w;       // width position
+  const int * cp_utf8;
+  const int * cp_fmt;     // index into `fmt`
+  const int * ctl;        // for each element, CTL_* seen
+  const int * err;        // for each element, bit `n - 1` set if ERR_* n seen
+  const struct FANSI_index_fmt * fmt;
+  int n_cp;
+  const int * wd_elt;     // NULL if words not recorded
+  const struct FANSI_index_word * wd;
+};
 /*
  * Sometimes need to keep track of a string and the encoding that it is in
  * outside of a CHARSXP
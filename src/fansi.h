@@ -65,10 +65,18 @@
 SEXP FANSI_process(
   SEXP input, SEXP term_cap, SEXP ctl, struct FANSI_buff *buff
 );
+int FANSI_process_one(
+  struct FANSI_state state, int len_j, struct FANSI_buff * buff, R_xlen_t i
+);
 SEXP FANSI_tabs_as_spaces(
   SEXP vec, SEXP tab_stops, struct FANSI_buff * buff, SEXP warn,
   SEXP term_cap, SEXP ctl
 );
+int FANSI_tabs_as_spaces_one(
+  struct FANSI_state * state, int len, SEXP tab_stops,
+  struct FANSI_buff * buff, R_xlen_t i
+);
+int FANSI_tabs_size(const char * string, int len, SEXP tab_stops);
 
 int FANSI_find_ctl(
   struct FANSI_state * state, R_xlen_t i, const char * arg
@@ -76,6 +84,15 @@ int FANSI_find_ctl(
 void FANSI_reset_pos(struct FANSI_state * state);
 void FANSI_reset_width(struct FANSI_state * state);
 void FANSI_reset_state(struct FANSI_state * state);
+struct FANSI_fmt_tab * FANSI_fmt_tab_new(void);
+unsigned int FANSI_fmt_tab_step(
+  struct FANSI_fmt_tab * tab, unsigned int from, unsigned int key,
+  struct FANSI_format * fmt
+);
+struct FANSI_format FANSI_state_fmt(struct FANSI_state * state);
+void FANSI_state_set_fmt(struct FANSI_state * state, struct FANSI_format fmt);
+void FANSI_state_set_sgr(struct FANSI_state * state, struct FANSI_sgr sgr);
+void FANSI_state_copy_fmt(struct FANSI_state * to, struct FANSI_state * from);
 
 void FANSI_check_chrsxp(SEXP x, R_xlen_t i);
 
@@ -124,6 +141,40 @@ void FANSI_read_until(
 void FANSI_read_all(
   struct FANSI_state * state, R_xlen_t i, const char * arg
 );
+void FANSI_read_chunk(struct FANSI_state * state, int until);
+int FANSI_read_plain(const char * x, int len);
+void FANSI_url_rebase(
+  struct FANSI_url * url, struct FANSI_state * state, struct FANSI_url * last
+);
+
+struct FANSI_index * FANSI_index_get(struct FANSI_index * idx, SEXP x);
+int FANSI_index_ok(
+  struct FANSI_index * idx, R_xlen_t i, unsigned int settings
+);
+int FANSI_index_bad_utf8(struct FANSI_index * idx, R_xlen_t i);
+int FANSI_index_width(struct FANSI_index * idx, R_xlen_t i, int mode);
+int FANSI_index_seek(
+  struct FANSI_index * idx, R_xlen_t i, struct FANSI_state * state, int until
+);
+int FANSI_index_end(
+  struct FANSI_index * idx, R_xlen_t i, struct FANSI_state * state
+);
+const struct FANSI_index_word * FANSI_index_words(
+  struct FANSI_index * idx, R_xlen_t i, struct FANSI_state * state, int * n
+);
+void FANSI_index_word(
+  struct FANSI_index * idx, const struct FANSI_index_word * wd,
+  struct FANSI_state * state
+);
+int FANSI_seek(struct FANSI_state * state, SEXP chr, int until);
+void FANSI_seek_cache_next(void);
+void FANSI_substr_multi(
+  struct FANSI_state * state, struct FANSI_state * ref,
+  struct FANSI_buff * buff, R_xlen_t i,
+  const int * start, const int * stop, int n,
+  int rnd_i, int norm_i, int term_i, int carry_i,
+  SEXP res, R_xlen_t off, const int * at, int by_pos
+);
 
 int FANSI_add_int(int x, int y, const char * file, int line);
 
@@ -177,7 +228,12 @@ int FANSI_W_normalize_or_copy(
   (A), (B), (C), i, err_msg)
 
 // Utilities
-int FANSI_seek_ctl(const char * x);
+int FANSI_seek_ctl(const char * x, int len);
+int FANSI_scan_print(const char * x, int max);
+int FANSI_scan_print_state(const struct FANSI_state * state, int max);
+intmax_t FANSI_scan_noctl(const char * x, intmax_t max);
+int FANSI_scan_utf8(const char * x, int max);
+void FANSI_esc_cache_next(void);
 void FANSI_print(const char * x);
 void FANSI_print_len(const char * x, int len);
 void FANSI_print_state(struct FANSI_state x);
@@ -28,20 +28,23 @@ SEXP FANSI_has(SEXP x, SEXP ctl, SEXP warn) {
   if(TYPEOF(ctl) != INTSXP) error("Internal Error: `ctl` must be INTSXP.");
   R_xlen_t len = XLENGTH(x);
 
-  SEXP res = PROTECT(allocVector(LGLSXP, len));
+  int prt = 0;
+  SEXP res = PROTECT(allocVector(LGLSXP, len)); ++prt;
   int * res_int = LOGICAL(res);
   struct FANSI_state state;
   const char * arg = "x";
 
   for(R_xlen_t i = 0; i < len; ++i) {
-    if(!i) state = FANSI_state_init_ctl(x, warn, ctl, i);
-    else FANSI_state_reinit(&state, x, i);
+    if(!i) {
+      state = FANSI_state_init_ctl(x, warn, ctl, i);
+      PROTECT(state.tab->mem); ++prt;
+    } else FANSI_state_reinit(&state, x, i);
     FANSI_interrupt(i);
     SEXP chrsxp = STRING_ELT(x, i);
     if(chrsxp != NA_STRING) {
       int res = 0;
       const char * xc = CHAR(chrsxp);
-      int off_init = FANSI_seek_ctl(xc);
+      int off_init = FANSI_seek_ctl(xc, LENGTH(chrsxp));
       if(*(xc + off_init)) {
         state.pos.x = off_init;
         FANSI_find_ctl(&state, i, arg);
@@ -52,7 +55,7 @@ SEXP FANSI_has(SEXP x, SEXP ctl, SEXP warn) {
       res_int[i] = NA_LOGICAL;
     }
   }
-  UNPROTECT(1);
+  UNPROTECT(prt);
   return res;
 }
 
@@ -0,0 +1,735 @@
+/*
+ * Copyright (C) Brodie Gaslam
+ *
+ * This file is part of "fansi - ANSI Control Sequence Aware String Functions"
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Go to <https://www.r-project.org/Licenses> for a copies of the licenses.
+ */
+
+#include "fansi.h"
+
+/*
+ * Parsed String Index
+ *
+ * Records the state of each string at the end of every uninterrupted read
+ * (i.e. every iteration of the basic loop in `FANSI_read_until`, such as a run
+ * of ASCII, or of UTF-8, or a set of contiguous escape sequences) so that
+ * repeated queries on the same strings need not re-parse them:
+ *
+ * * Widths of the whole string in every COUNT_* mode are those at the last
+ *   checkpoint.
+ * * The format at the end of the string is that of the last checkpoint.
+ * * A read up to a given width can resume from the last checkpoint below it.
+ *
+ * Data is stored as a struct of arrays in the protected slot of an external
+ * pointer.  Formats are interned into a table, so checkpoints only record an
+ * id.  Formats and words are stored as raw structs, stamped with `IDX_VERSION`
+ * and their sizes.  The address of the pointer is only set once the contents
+ * are known to be valid, which they are when just built.  It is NULL for an
+ * index that was serialized and re-loaded, in which case the contents are
+ * checked before first use (see `index_valid`).
+ *
+ * The index can only stand in for a read if the result would be identical,
+ * which `FANSI_index_ok` checks.  Otherwise callers read the string as usual.
+ *
+ * Optionally the index also records the words of each string as `strwrap`
+ * reads them, i.e. element by element with `FANSI_read_next`, so that wrapping
+ * can step over whole words (see `FANSI_index_words`).
+ */
+
+// Slots of the protected VECSXP
+#define IDX_X        0
+#define IDX_SET      1
+#define IDX_ELT      2
+#define IDX_CP_X     3
+#define IDX_CP_W     4
+#define IDX_CP_UTF8  5
+#define IDX_CP_FMT   6
+#define IDX_CTL      7
+#define IDX_ERR      8
+#define IDX_FMT      9
+#define IDX_WD_ELT  10
+#define IDX_WD      11
+#define IDX_STAMP   12
+#define IDX_SIZE    13
+
+// Change whenever the layout of the index changes
+#define IDX_VERSION  1
+
+// Settings that must be compatible between index and query
+#define IDX_SET_MASK (CTL_MASK | TERM_MASK | SET_TERMOLD | SET_ESCONE)
+
+static SEXP index_tag(void) {return install("fansi_ctl_index");}
+
+// Address of indices with valid contents
+static int index_checked;
+
+// Stamp to compare against that of a re-loaded index, in native byte order.
+static void index_stamp(int * stamp) {
+  stamp[0] = IDX_VERSION;
+  stamp[1] = (int) sizeof(struct FANSI_index_fmt);
+  stamp[2] = (int) sizeof(struct FANSI_index_word);
+  stamp[3] = COUNT_ALL;
+}
+
+// - Build ---------------------------------------------------------------------
+
+struct cp_build {
+  int x;
+  int utf8;
+  int fmt;
+  int w[COUNT_ALL + 1];
+};
+struct fmt_table {
+  struct FANSI_index_fmt * fmt;
+  int n;
+  int alloc;
+  int * slots;     // open addressing hash table of ids into `fmt`, -1 if empty
+  int n_slots;     // power of two
+};
+
+static unsigned int fmt_hash(struct FANSI_index_fmt * f) {
+  const unsigned char * b = (const unsigned char *) f;
+  unsigned int h = 2166136261U;
+  for(size_t k = 0; k < sizeof(*f); ++k) {
+    h ^= b[k];
+    h *= 16777619U;
+  }
+  return h;
+}
+static void fmt_table_grow(struct fmt_table * tab) {
+  if(tab->alloc > FANSI_lim.lim_int.max / 2)
+    error("Internal Error: too many formats to index.");  // nocov
+  int alloc = tab->alloc ? tab->alloc * 2 : 64;
+  struct FANSI_index_fmt * fmt =
+    (struct FANSI_index_fmt *) R_alloc(alloc, sizeof(*fmt));
+  if(tab->n) memcpy(fmt, tab->fmt, tab->n * sizeof(*fmt));
+  tab->fmt = fmt;
+  tab->alloc = alloc;
+
+  // Keep load under 50%
+  tab->n_slots = alloc * 2;
+  tab->slots = (int *) R_alloc(tab->n_slots, sizeof(int));
+  for(int k = 0; k < tab->n_slots; ++k) tab->slots[k] = -1;
+  for(int k = 0; k < tab->n; ++k) {
+    unsigned int h = fmt_hash(tab->fmt + k) & (tab->n_slots - 1);
+    while(tab->slots[h] >= 0) h = (h + 1) & (tab->n_slots - 1);
+    tab->slots[h] = k;
+  }
+}
+static int fmt_intern(struct fmt_table * tab, struct FANSI_format fmt) {
+  struct FANSI_index_fmt f;
+  memset(&f, 0, sizeof(f));   // hashed bytewise
+  f.sgr = fmt.sgr;
+  if(fmt.url.string) {
+    f.url = fmt.url.url;
+    f.id = fmt.url.id;
+    f.has_url = 1;
+  }
+  if(tab->n >= tab->alloc) fmt_table_grow(tab);
+  unsigned int h = fmt_hash(&f) & (tab->n_slots - 1);
+  while(tab->slots[h] >= 0) {
+    if(!memcmp(tab->fmt + tab->slots[h], &f, sizeof(f))) return tab->slots[h];
+    h = (h + 1) & (tab->n_slots - 1);
+  }
+  tab->fmt[tab->n] = f;
+  tab->slots[h] = tab->n;
+  return tab->n++;
+}
+/*
+ * Record the format of `state`, with its URL pointing into the element.
+ *
+ * @param last see `FANSI_url_rebase`, zeroed at the start of each element.
+ */
+static int fmt_intern_state(
+  struct fmt_table * tab, struct FANSI_state * state, struct FANSI_url * last
+) {
+  struct FANSI_format fmt = FANSI_state_fmt(state);
+  FANSI_url_rebase(&fmt.url, state, last);
+  return fmt_intern(tab, fmt);
+}
+struct wd_build {
+  struct FANSI_index_word * wd;
+  int n;
+  int alloc;
+};
+static int wd_boundary(char c) {return c == ' ' || c == '\t' || c == '\n';}
+/*
+ * Record the words of element `i`
+ *
+ * A word is a run of elements as read by `FANSI_read_next` that do not start
+ * with a space, tab, or newline, which is what `strwrap` treats as word
+ * boundaries.  Words of one element are not recorded as there is nothing to
+ * step over.
+ *
+ * @param state at the beginning of the element, in COUNT_WIDTH mode.
+ */
+static void index_words(
+  struct FANSI_state state, R_xlen_t i, struct wd_build * wds,
+  struct fmt_table * fmts
+) {
+  const char * arg = "x";
+  struct FANSI_url url_last = {0};
+  while(state.string[state.pos.x]) {
+    if(wd_boundary(state.string[state.pos.x])) {
+      FANSI_read_next(&state, i, arg);
+      continue;
+    }
+    struct FANSI_state last;
+    int x = state.pos.x, w = state.pos.w;
+    unsigned int fmt_id = state.fmt_id;
+    do {
+      // Runs of printable ASCII other than space are read one byte at a time
+      // by `FANSI_read_next` without side effects, so step over them at once.
+      const char * run_x = state.string + state.pos.x;
+      int run = FANSI_scan_print_state(&state, FANSI_lim.lim_int.max);
+      const char * space = memchr(run_x, ' ', run);
+      if(space) run = (int)(space - run_x);
+      if(run > 1) {
+        state.status &= STAT_WARNED;
+        state.pos.x += run - 1;
+        state.pos.w += run - 1;
+      }
+      last = state;
+      if(run) {
+        state.status &= STAT_WARNED;
+        ++state.pos.x;
+        ++state.pos.w;
+      } else FANSI_read_next(&state, i, arg);
+    } while(
+      state.string[state.pos.x] && !wd_boundary(state.string[state.pos.x])
+    );
+    if(last.pos.x == x) continue;
+
+    if(wds->n >= wds->alloc) {
+      if(wds->alloc > FANSI_lim.lim_int.max / 2)
+        error("Too many words to index.");
+      int alloc = wds->alloc ? wds->alloc * 2 : 256;
+      struct FANSI_index_word * tmp =
+        (struct FANSI_index_word *) R_alloc(alloc, sizeof(*tmp));
+      if(wds->n) memcpy(tmp, wds->wd, wds->n * sizeof(*tmp));
+      wds->wd = tmp;
+      wds->alloc = alloc;
+    }
+    wds->wd[wds->n++] = (struct FANSI_index_word) {
+      .x = x, .w = w,
+      .last_x = last.pos.x, .last_w = last.pos.w, .last_utf8 = last.utf8,
+      .last_status = (int) (last.status & ~STAT_WARNED),
+      .last_fmt = last.fmt_id == fmt_id ?
+        -1 : fmt_intern_state(fmts, &last, &url_last)
+    };
+  }
+}
+/*
+ * Index Strings
+ *
+ * Each string is read once per COUNT_* mode.  Chunk boundaries do not depend
+ * on the mode so the positions are only recorded in the first pass, and
+ * checked in the others.  Reads are silent, errors are recorded instead.
+ * One more read records the types of controls present, and if requested
+ * another the words of strings that read without errors.
+ *
+ * @param x character vector, assumed UTF-8 or ASCII (see VAL_IN_ENV).
+ * @param words TRUE or FALSE, whether to record words.
+ * @return an external pointer, see IDX_* for contents.
+ */
+SEXP FANSI_ctl_index(SEXP x, SEXP term_cap, SEXP ctl, SEXP words) {
+  if(TYPEOF(x) != STRSXP)
+    error("Internal Error: `x` must be character.");  // nocov
+  if(!FANSI_is_tf(words))
+    error("Internal Error: `words` must be TRUE or FALSE.");  // nocov
+
+  int prt = 0;
+  R_xlen_t len = XLENGTH(x);
+  SEXP elt = PROTECT(allocVector(INTSXP, len + 1)); ++prt;
+  SEXP ctl_seen = PROTECT(allocVector(INTSXP, len)); ++prt;
+  SEXP err_seen = PROTECT(allocVector(INTSXP, len)); ++prt;
+  int * elt_i = INTEGER(elt);
+  int * ctl_i = INTEGER(ctl_seen);
+  int * err_i = INTEGER(err_seen);
+
+  struct cp_build * cps = NULL;
+  int n_cp = 0, alloc_cp = 0;
+  struct fmt_table fmts = {0};
+  unsigned int settings = 0;
+  int words_int = asLogical(words);
+  SEXP wd_elt = R_NilValue;
+  int * wd_elt_i = NULL;
+  struct wd_build wds = {0};
+  if(words_int) {
+    wd_elt = PROTECT(allocVector(INTSXP, len + 1)); ++prt;
+    wd_elt_i = INTEGER(wd_elt);
+  }
+
+  if(len) {
+    SEXP R_zero = PROTECT(ScalarInteger(0)); ++prt;
+    SEXP R_true = PROTECT(ScalarLogical(1)); ++prt;
+    SEXP R_false = PROTECT(ScalarLogical(0)); ++prt;
+    struct FANSI_state state0 = FANSI_state_init_full(
+      x, R_zero, term_cap, R_true, R_false, R_zero, ctl, (R_xlen_t) 0
+    );
+    PROTECT(state0.tab->mem); ++prt;
+    settings = state0.settings & IDX_SET_MASK;
+
+    for(R_xlen_t i = 0; i < len; ++i) {
+      FANSI_interrupt(i);
+      elt_i[i] = n_cp;
+      ctl_i[i] = err_i[i] = 0;
+      if(words_int) wd_elt_i[i] = wds.n;
+      if(STRING_ELT(x, i) == NA_STRING) continue;
+
+      for(int mode = 0; mode <= COUNT_ALL; ++mode) {
+        struct FANSI_state state = state0;
+        state.settings =
+          FANSI_SET_RNG(state.settings, SET_WIDTH, COUNT_ALL, mode);
+        FANSI_state_reinit(&state, x, i);
+        int k = elt_i[i];
+        struct FANSI_url url_last = {0};
+
+        while(state.string[state.pos.x]) {
+          FANSI_read_chunk(&state, FANSI_lim.lim_int.max);
+          unsigned int err = FANSI_GET_ERR(state.status);
+          if(!mode) {
+            if(n_cp >= alloc_cp) {
+              if(alloc_cp > FANSI_lim.lim_int.max / 2)
+                error(
+                  "Too many control sequences and character runs to index."
+                );
+              int alloc = alloc_cp ? alloc_cp * 2 : 256;
+              struct cp_build * tmp =
+                (struct cp_build *) R_alloc(alloc, sizeof(*tmp));
+              if(n_cp) memcpy(tmp, cps, n_cp * sizeof(*tmp));
+              cps = tmp;
+              alloc_cp = alloc;
+            }
+            cps[n_cp].x = state.pos.x;
+            cps[n_cp].utf8 = state.utf8;
+            cps[n_cp].fmt = fmt_intern_state(&fmts, &state, &url_last);
+            if(err) err_i[i] |= 1 << (err - 1);
+            ++n_cp;
+          } else if (k >= n_cp || cps[k].x != state.pos.x) {
+            error("Internal Error: index checkpoint mismatch.");  // nocov
+          }
+          cps[k++].w[mode] = state.pos.w;
+          if(err == ERR_BAD_UTF8) break;
+        }
+        if(mode && k != n_cp)
+          error("Internal Error: index checkpoint count mismatch.");  // nocov
+      }
+      // Contiguous escapes are read together, but status only records the
+      // type of the last one, so read them one at a time to get all types.
+      struct FANSI_state state = state0;
+      state.settings |= SET_ESCONE;
+      FANSI_state_reinit(&state, x, i);
+      while(state.string[state.pos.x]) {
+        FANSI_read_chunk(&state, FANSI_lim.lim_int.max);
+        ctl_i[i] |= state.status & CTL_MASK;
+        if(FANSI_GET_ERR(state.status) == ERR_BAD_UTF8) break;
+      }
+      if(words_int && !err_i[i]) {
+        state = state0;
+        state.settings =
+          FANSI_SET_RNG(state.settings, SET_WIDTH, COUNT_ALL, COUNT_WIDTH);
+        FANSI_state_reinit(&state, x, i);
+        index_words(state, i, &wds, &fmts);
+  } } }
+  elt_i[len] = n_cp;
+  if(words_int) wd_elt_i[len] = wds.n;
+
+  SEXP prot = PROTECT(allocVector(VECSXP, IDX_SIZE)); ++prt;
+  SET_VECTOR_ELT(prot, IDX_X, x);
+  SET_VECTOR_ELT(prot, IDX_SET, ScalarInteger((int) settings));
+  SET_VECTOR_ELT(prot, IDX_ELT, elt);
+  SET_VECTOR_ELT(prot, IDX_CP_X, allocVector(INTSXP, n_cp));
+  SET_VECTOR_ELT(
+    prot, IDX_CP_W, allocVector(INTSXP, (R_xlen_t) n_cp * (COUNT_ALL + 1))
+  );
+  SET_VECTOR_ELT(prot, IDX_CP_UTF8, allocVector(INTSXP, n_cp));
+  SET_VECTOR_ELT(prot, IDX_CP_FMT, allocVector(INTSXP, n_cp));
+  SET_VECTOR_ELT(prot, IDX_CTL, ctl_seen);
+  SET_VECTOR_ELT(prot, IDX_ERR, err_seen);
+  SET_VECTOR_ELT(
+    prot, IDX_FMT,
+    allocVector(RAWSXP, (R_xlen_t) fmts.n * sizeof(struct FANSI_index_fmt))
+  );
+  SET_VECTOR_ELT(prot, IDX_WD_ELT, wd_elt);
+  if(words_int) {
+    SET_VECTOR_ELT(
+      prot, IDX_WD,
+      allocVector(RAWSXP, (R_xlen_t) wds.n * sizeof(struct FANSI_index_word))
+    );
+    if(wds.n)
+      memcpy(
+        RAW(VECTOR_ELT(prot, IDX_WD)), wds.wd,
+        wds.n * sizeof(struct FANSI_index_word)
+      );
+  }
+  int * cp_x = INTEGER(VECTOR_ELT(prot, IDX_CP_X));
+  int * cp_w = INTEGER(VECTOR_ELT(prot, IDX_CP_W));
+  int * cp_utf8 = INTEGER(VECTOR_ELT(prot, IDX_CP_UTF8));
+  int * cp_fmt = INTEGER(VECTOR_ELT(prot, IDX_CP_FMT));
+  for(int k = 0; k < n_cp; ++k) {
+    cp_x[k] = cps[k].x;
+    cp_utf8[k] = cps[k].utf8;
+    cp_fmt[k] = cps[k].fmt;
+    for(int mode = 0; mode <= COUNT_ALL; ++mode)
+      cp_w[(R_xlen_t) mode * n_cp + k] = cps[k].w[mode];
+  }
+  if(fmts.n)
+    memcpy(
+      RAW(VECTOR_ELT(prot, IDX_FMT)), fmts.fmt,
+      fmts.n * sizeof(struct FANSI_index_fmt)
+    );
+  SET_VECTOR_ELT(prot, IDX_STAMP, allocVector(RAWSXP, 4 * sizeof(int)));
+  index_stamp((int *) RAW(VECTOR_ELT(prot, IDX_STAMP)));
+  SEXP res =
+    PROTECT(R_MakeExternalPtr(&index_checked, index_tag(), prot)); ++prt;
+  UNPROTECT(prt);
+  return res;
+}
+// - Query ---------------------------------------------------------------------
+
+/*
+ * Retrieve Index Contents
+ *
+ * @param idx will be filled with the index contents if `x` is an index.
+ * @return `idx` if `x` is an index, NULL otherwise.
+ */
+static int int_vec(SEXP x, R_xlen_t len) {
+  return TYPEOF(x) == INTSXP && XLENGTH(x) == len;
+}
+static int fmt_valid(
+  const struct FANSI_index_fmt * fmt, int n_fmt, int id, int bytes
+) {
+  if(id < 0 || id >= n_fmt) return 0;
+  const struct FANSI_index_fmt * f = fmt + id;
+  return !f->has_url || (
+    f->url.start <= (unsigned int) bytes &&
+    f->url.len <= (unsigned int) bytes - f->url.start &&
+    f->id.start <= (unsigned int) bytes &&
+    f->id.len <= (unsigned int) bytes - f->id.start
+  );
+}
+/*
+ * Validate a Re-loaded Index
+ *
+ * An index read back from a file may be from a different version of fansi or
+ * platform, or have been tampered with.  Lengths, positions, and ids are all
+ * checked so that reads from the index stay within bounds.  SGR contents are
+ * trusted once the stamp matches.
+ */
+static int index_valid(SEXP prot) {
+  if(TYPEOF(prot) != VECSXP || XLENGTH(prot) != IDX_SIZE) return 0;
+  SEXP x = VECTOR_ELT(prot, IDX_X);
+  SEXP stamp = VECTOR_ELT(prot, IDX_STAMP);
+  SEXP fmt = VECTOR_ELT(prot, IDX_FMT);
+  SEXP wd_elt = VECTOR_ELT(prot, IDX_WD_ELT);
+  SEXP wd = VECTOR_ELT(prot, IDX_WD);
+  int stamp_n[4];
+  index_stamp(stamp_n);
+  if(
+    TYPEOF(stamp) != RAWSXP || XLENGTH(stamp) != sizeof(stamp_n) ||
+    memcmp(RAW(stamp), stamp_n, sizeof(stamp_n)) ||
+    TYPEOF(x) != STRSXP ||
+    !int_vec(VECTOR_ELT(prot, IDX_SET), 1) ||
+    ((unsigned int) INTEGER(VECTOR_ELT(prot, IDX_SET))[0] & ~IDX_SET_MASK) ||
+    !int_vec(VECTOR_ELT(prot, IDX_ELT), XLENGTH(x) + 1) ||
+    !int_vec(VECTOR_ELT(prot, IDX_CTL), XLENGTH(x)) ||
+    !int_vec(VECTOR_ELT(prot, IDX_ERR), XLENGTH(x)) ||
+    TYPEOF(VECTOR_ELT(prot, IDX_CP_X)) != INTSXP ||
+    XLENGTH(VECTOR_ELT(prot, IDX_CP_X)) > FANSI_lim.lim_int.max ||
+    TYPEOF(fmt) != RAWSXP || XLENGTH(fmt) % sizeof(struct FANSI_index_fmt) ||
+    XLENGTH(fmt) / sizeof(struct FANSI_index_fmt) >
+      (size_t) FANSI_lim.lim_int.max
+  )
+    return 0;
+
+  R_xlen_t x_len = XLENGTH(x);
+  int n_cp = (int) XLENGTH(VECTOR_ELT(prot, IDX_CP_X));
+  int n_fmt = (int) (XLENGTH(fmt) / sizeof(struct FANSI_index_fmt));
+  if(
+    !int_vec(VECTOR_ELT(prot, IDX_CP_W), (R_xlen_t) n_cp * (COUNT_ALL + 1)) ||
+    !int_vec(VECTOR_ELT(prot, IDX_CP_UTF8), n_cp) ||
+    !int_vec(VECTOR_ELT(prot, IDX_CP_FMT), n_cp)
+  )
+    return 0;
+
+  const int * elt = INTEGER(VECTOR_ELT(prot, IDX_ELT));
+  const int * cp_x = INTEGER(VECTOR_ELT(prot, IDX_CP_X));
+  const int * cp_w = INTEGER(VECTOR_ELT(prot, IDX_CP_W));
+  const int * cp_utf8 = INTEGER(VECTOR_ELT(prot, IDX_CP_UTF8));
+  const int * cp_fmt = INTEGER(VECTOR_ELT(prot, IDX_CP_FMT));
+  const struct FANSI_index_fmt * fmt_p =
+    (const struct FANSI_index_fmt *) RAW(fmt);
+  if(elt[0] || elt[x_len] != n_cp) return 0;
+  for(R_xlen_t i = 0; i < x_len; ++i) {
+    FANSI_interrupt(i);
+    int bytes = LENGTH(STRING_ELT(x, i));
+    if(elt[i + 1] < elt[i] || elt[i + 1] > n_cp) return 0;
+    if(STRING_ELT(x, i) == NA_STRING && elt[i + 1] != elt[i]) return 0;
+    for(int k = elt[i]; k < elt[i + 1]; ++k) {
+      if(
+        cp_x[k] < 0 || cp_x[k] > bytes || cp_utf8[k] < 0 ||
+        (k > elt[i] && cp_x[k] < cp_x[k - 1]) ||
+        !fmt_valid(fmt_p, n_fmt, cp_fmt[k], bytes)
+      )
+        return 0;
+      for(int mode = 0; mode <= COUNT_ALL; ++mode) {
+        const int * w = cp_w + (R_xlen_t) mode * n_cp;
+        if(w[k] < 0 || (k > elt[i] && w[k] < w[k - 1])) return 0;
+  } } }
+  if(wd_elt == R_NilValue) return 1;
+  if(
+    !int_vec(wd_elt, x_len + 1) || TYPEOF(wd) != RAWSXP ||
+    XLENGTH(wd) % sizeof(struct FANSI_index_word) ||
+    XLENGTH(wd) / sizeof(struct FANSI_index_word) >
+      (size_t) FANSI_lim.lim_int.max
+  )
+    return 0;
+
+  int n_wd = (int) (XLENGTH(wd) / sizeof(struct FANSI_index_word));
+  const int * wd_elt_i = INTEGER(wd_elt);
+  const struct FANSI_index_word * wd_p =
+    (const struct FANSI_index_word *) RAW(wd);
+  if(wd_elt_i[0] || wd_elt_i[x_len] != n_wd) return 0;
+  for(R_xlen_t i = 0; i < x_len; ++i) {
+    FANSI_interrupt(i);
+    int bytes = LENGTH(STRING_ELT(x, i));
+    if(wd_elt_i[i + 1] < wd_elt_i[i] || wd_elt_i[i + 1] > n_wd) return 0;
+    for(int k = wd_elt_i[i]; k < wd_elt_i[i + 1]; ++k) {
+      const struct FANSI_index_word * w = wd_p + k;
+      if(
+        w->x < 0 || w->last_x < w->x || w->last_x > bytes ||
+        w->w < 0 || w->last_w < w->w || w->last_utf8 < 0 ||
+        (k > wd_elt_i[i] && w->x < w[-1].last_x) ||
+        (w->last_fmt != -1 && !fmt_valid(fmt_p, n_fmt, w->last_fmt, bytes))
+      )
+        return 0;
+  } }
+  return 1;
+}
+struct FANSI_index * FANSI_index_get(struct FANSI_index * idx, SEXP x) {
+  if(TYPEOF(x) != EXTPTRSXP) return NULL;
+  SEXP prot = R_ExternalPtrProtected(x);
+  if(R_ExternalPtrTag(x) != index_tag())
+    error("Internal Error: malformed `ctl_index` object.");  // nocov
+  if(R_ExternalPtrAddr(x) != &index_checked) {
+    if(!index_valid(prot))
+      error(
+        "%s%s",
+        "`ctl_index` object is invalid or from a different version of fansi; ",
+        "re-create it with `ctl_index`."
+      );
+    R_SetExternalPtrAddr(x, &index_checked);
+  }
+  idx->x = VECTOR_ELT(prot, IDX_X);
+  idx->settings = (unsigned int) asInteger(VECTOR_ELT(prot, IDX_SET));
+  idx->elt = INTEGER(VECTOR_ELT(prot, IDX_ELT));
+  idx->cp_x = INTEGER(VECTOR_ELT(prot, IDX_CP_X));
+  idx->cp_w = INTEGER(VECTOR_ELT(prot, IDX_CP_W));
+  idx->cp_utf8 = INTEGER(VECTOR_ELT(prot, IDX_CP_UTF8));
+  idx->cp_fmt = INTEGER(VECTOR_ELT(prot, IDX_CP_FMT));
+  idx->ctl = INTEGER(VECTOR_ELT(prot, IDX_CTL));
+  idx->err = INTEGER(VECTOR_ELT(prot, IDX_ERR));
+  idx->fmt = (const struct FANSI_index_fmt *) RAW(VECTOR_ELT(prot, IDX_FMT));
+  idx->n_cp = (int) XLENGTH(VECTOR_ELT(prot, IDX_CP_X));
+  idx->wd_elt = NULL;
+  idx->wd = NULL;
+  if(VECTOR_ELT(prot, IDX_WD_ELT) != R_NilValue) {
+    idx->wd_elt = INTEGER(VECTOR_ELT(prot, IDX_WD_ELT));
+    idx->wd =
+      (const struct FANSI_index_word *) RAW(VECTOR_ELT(prot, IDX_WD));
+  }
+  return idx;
+}
+/*
+ * Whether the Index Can Stand In for Reading Element `i`
+ *
+ * Terminal settings must match.  The controls handled by the query may be a
+ * subset of the index ones, so long as element `i` contains none of those it
+ * does not handle, as then both reads are the same.  Finally, the read must not
+ * produce warnings or errors as we do not record where those happen.
+ */
+int FANSI_index_ok(
+  struct FANSI_index * idx, R_xlen_t i, unsigned int settings
+) {
+  unsigned int ctl_q = settings & CTL_MASK;
+  unsigned int ctl_i = idx->settings & CTL_MASK;
+  unsigned int seen = (unsigned int) idx->ctl[i];
+  unsigned int err = (unsigned int) idx->err[i];
+  return
+    (settings & IDX_SET_MASK & ~CTL_MASK) ==
+      (idx->settings & ~CTL_MASK) &&
+    !(ctl_q & ~ctl_i) && !(seen & ~ctl_q) &&
+    !((err << SET_WARN) & settings & WARN_MASK);
+}
+int FANSI_index_bad_utf8(struct FANSI_index * idx, R_xlen_t i) {
+  return idx->err[i] & (1 << (ERR_BAD_UTF8 - 1));
+}
+// Width of all of element `i` in COUNT_* `mode`.
+
+int FANSI_index_width(struct FANSI_index * idx, R_xlen_t i, int mode) {
+  int k = idx->elt[i + 1] - 1;
+  return k < idx->elt[i] ? 0 : idx->cp_w[(R_xlen_t) mode * idx->n_cp + k];
+}
+// Is the state at the beginning of its string, with no format?
+
+static int state_clean(struct FANSI_state * state) {
+  return !state->pos.x && !state->pos.w && !state->fmt_id;
+}
+static void index_set_fmt(
+  struct FANSI_index * idx, int id, struct FANSI_state * state
+) {
+  const struct FANSI_index_fmt * f = idx->fmt + id;
+  struct FANSI_format fmt = {.sgr = f->sgr};
+  if(f->has_url) {
+    fmt.url.string = state->string;
+    fmt.url.url = f->url;
+    fmt.url.id = f->id;
+  }
+  FANSI_state_set_fmt(state, fmt);
+}
+static void index_restore(
+  struct FANSI_index * idx, int k, struct FANSI_state * state
+) {
+  int mode = FANSI_GET_RNG(state->settings, SET_WIDTH, COUNT_ALL);
+  index_set_fmt(idx, idx->cp_fmt[k], state);
+  state->pos.x = idx->cp_x[k];
+  state->pos.w = idx->cp_w[(R_xlen_t) mode * idx->n_cp + k];
+  state->utf8 = idx->cp_utf8[k];
+  state->status &= STAT_WARNED;
+}
+/*
+ * Advance State to the Last Checkpoint Before `until`
+ *
+ * State must be at the beginning of element `i`, with no format (e.g. not
+ * carrying from a prior element).  Checkpoints at the very end of the string
+ * are skipped as `FANSI_read_until` in terminate mode does not read trailing
+ * escapes.  The state is then the same as it would be in `FANSI_read_until`
+ * just before reading past the checkpoint, so reading can resume from it.
+ *
+ * @return whether the state was advanced.
+ */
+int FANSI_index_seek(
+  struct FANSI_index * idx, R_xlen_t i, struct FANSI_state * state, int until
+) {
+  if(
+    !state_clean(state) || !FANSI_index_ok(idx, i, state->settings) ||
+    FANSI_index_bad_utf8(idx, i)
+  )
+    return 0;
+
+  int mode = FANSI_GET_RNG(state->settings, SET_WIDTH, COUNT_ALL);
+  const int * w = idx->cp_w + (R_xlen_t) mode * idx->n_cp;
+  int lo = idx->elt[i], hi = idx->elt[i + 1];
+
+  // Widths are non-decreasing, find first checkpoint with w >= until
+  while(lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if(w[mid] < until) lo = mid + 1;
+    else hi = mid;
+  }
+  int k = lo - 1;
+  if(k >= idx->elt[i] && !state->string[idx->cp_x[k]]) --k;
+  if(k < idx->elt[i]) return 0;
+  index_restore(idx, k, state);
+  return 1;
+}
+/*
+ * Advance State to the End of Element `i`
+ *
+ * Same as `FANSI_read_all` would, subject to the same requirements as
+ * `FANSI_index_seek`.
+ *
+ * @return whether the state was advanced.
+ */
+int FANSI_index_end(
+  struct FANSI_index * idx, R_xlen_t i, struct FANSI_state * state
+) {
+  if(!state_clean(state) || !FANSI_index_ok(idx, i, state->settings))
+    return 0;
+  int k = idx->elt[i + 1] - 1;
+  if(k >= idx->elt[i]) index_restore(idx, k, state);
+  return 1;
+}
+/*
+ * Words of Element `i` for Wrapping
+ *
+ * Subject to the same requirements as `FANSI_index_seek`, and additionally
+ * the state must be in COUNT_WIDTH mode and reading the indexed string (e.g.
+ * not one with spaces stripped).
+ *
+ * @param n set to the number of words.
+ * @return the first word, or NULL if the words cannot be used.
+ */
+static double index_words_hits, index_words_misses;
+
+const struct FANSI_index_word * FANSI_index_words(
+  struct FANSI_index * idx, R_xlen_t i, struct FANSI_state * state, int * n
+) {
+  *n = 0;
+  if(
+    !idx->wd_elt || !state_clean(state) ||
+    FANSI_GET_RNG(state->settings, SET_WIDTH, COUNT_ALL) != COUNT_WIDTH ||
+    state->string != CHAR(STRING_ELT(idx->x, i)) ||
+    !FANSI_index_ok(idx, i, state->settings)
+  ) {
+    ++index_words_misses;
+    return NULL;
+  }
+  ++index_words_hits;
+  *n = idx->wd_elt[i + 1] - idx->wd_elt[i];
+  return *n ? idx->wd + idx->wd_elt[i] : NULL;
+}
+/*
+ * Report on the use of index words
+ *
+ * @param reset TRUE to zero the counters.
+ * @return the number of elements wrapped with and without their words since
+ *   the last reset (prior to any reset by this call).
+ */
+SEXP FANSI_index_words_stats(SEXP reset) {
+  if(!FANSI_is_tf(reset))
+    error("Internal Error: `reset` must be TRUE or FALSE.");  // nocov
+
+  SEXP res = PROTECT(allocVector(REALSXP, 2));
+  SEXP res_names = PROTECT(allocVector(STRSXP, 2));
+  REAL(res)[0] = index_words_hits;
+  REAL(res)[1] = index_words_misses;
+  SET_STRING_ELT(res_names, 0, mkChar("hits"));
+  SET_STRING_ELT(res_names, 1, mkChar("misses"));
+  setAttrib(res, R_NamesSymbol, res_names);
+  if(asLogical(reset)) index_words_hits = index_words_misses = 0;
+  UNPROTECT(2);
+  return res;
+}
+/*
+ * Advance State From the Start of a Word to Before its Last Element
+ *
+ * The state is then the same as if it had been read element by element with
+ * `FANSI_read_next`, which it should be to read the last element.  Widths are
+ * relative to those of the state as `strwrap` resets them on each line.
+ */
+void FANSI_index_word(
+  struct FANSI_index * idx, const struct FANSI_index_word * wd,
+  struct FANSI_state * state
+) {
+  if(state->pos.x != wd->x)
+    error("Internal Error: state not at start of word.");  // nocov
+  if(wd->last_fmt >= 0) index_set_fmt(idx, wd->last_fmt, state);
+  // Positions of UTF-8 before the word depend on the read, not the word
+  if(wd->last_utf8 > wd->x) state->utf8 = wd->last_utf8;
+  state->pos.x = wd->last_x;
+  state->pos.w += wd->last_w - wd->w;
+  state->status =
+    (unsigned int) wd->last_status | (state->status & STAT_WARNED);
+}
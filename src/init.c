@@ -23,7 +23,7 @@ static const
 R_CallMethodDef callMethods[] = {
   {"has_csi", (DL_FUNC) &FANSI_has, 3},
   {"strip_csi", (DL_FUNC) &FANSI_strip, 3},
-  {"strwrap_csi", (DL_FUNC) &FANSI_strwrap_ext, 18},
+  {"strwrap_csi", (DL_FUNC) &FANSI_strwrap_ext, 21},
   {"substr", (DL_FUNC) &FANSI_substr, 12},
   {"process", (DL_FUNC) &FANSI_process_ext, 3},
   {"check_assumptions", (DL_FUNC) &FANSI_check_assumptions, 0},
@@ -56,7 +56,19 @@ R_CallMethodDef callMethods[] = {
   {"state_at_end", (DL_FUNC) &FANSI_state_at_end_ext, 8},
   {"bridge_state", (DL_FUNC) &FANSI_bridge_state_ext, 4},
   {"trimws", (DL_FUNC) &FANSI_trimws, 6},
+  {"ctl_index", (DL_FUNC) &FANSI_ctl_index, 4},
   {"unicode_version", (DL_FUNC) &FANSI_unicode_version, 0},
+  {"set_scan_mode", (DL_FUNC) &FANSI_set_scan_mode, 1},
+  {"width_table_check", (DL_FUNC) &FANSI_width_table_check, 0},
+  {"esc_cache", (DL_FUNC) &FANSI_esc_cache, 2},
+  {"seek_cache", (DL_FUNC) &FANSI_seek_cache, 2},
+  {"index_words_stats", (DL_FUNC) &FANSI_index_words_stats, 1},
+  {"wrap_breaks", (DL_FUNC) &FANSI_wrap_breaks_ext, 11},
+  {"strtrim", (DL_FUNC) &FANSI_strtrim_ext, 10},
+  {"strsplit", (DL_FUNC) &FANSI_strsplit_ext, 9},
+  {"substr_multi", (DL_FUNC) &FANSI_substr_multi_ext, 11},
+  {"substr_multi_replace", (DL_FUNC) &FANSI_substr_multi_replace_ext, 12},
+  {"style_ranges", (DL_FUNC) &FANSI_style_ranges_ext, 11},
   {NULL, NULL, 0}
 };
 
@@ -69,5 +81,9 @@ void attribute_visible R_init_fansi(DllInfo *info)
   R_registerRoutines(info, NULL, callMethods, NULL, NULL);
   R_useDynamicSymbols(info, FALSE);
   R_forceSymbols(info, FALSE);
+  // Pick vectorized byte scanner if available (see scan.c)
+  FANSI_scan_init();
+  // Expand the Unicode width range tables into lookup tables (see width.c)
+  FANSI_width_init();
 }
 
@@ -20,6 +20,8 @@
 /*
  * Not very optimized.
  *
+ * @param x character vector, or a parsed string index (see index.c), in which
+ *   case widths are looked up from it instead of read where possible.
  * @param z logical(1L) whether to stop once we confirm there is one non-sgr
  *  character.
  */
@@ -44,6 +46,10 @@ SEXP FANSI_nchar(
 
   const char * arg = "x";;
 
+  struct FANSI_index index;
+  struct FANSI_index * idx = FANSI_index_get(&index, x);
+  if(idx) x = idx->x;
+
   R_xlen_t x_len = XLENGTH(x);
 
   SEXP res = PROTECT(allocVector(zz ? LGLSXP : INTSXP, x_len)); prt++;
@@ -57,6 +63,7 @@ SEXP FANSI_nchar(
       state = FANSI_state_init_full(
         x, warn, term_cap, allowNA, keepNA, type, ctl, i
       );
+      PROTECT(state.tab->mem); ++prt;
     } else FANSI_state_reinit(&state, x, i);
 
     if(STRING_ELT(x, i) == R_NaString) {
@@ -72,7 +79,13 @@ SEXP FANSI_nchar(
         resi[i] = zz ? NA_LOGICAL : NA_INTEGER;
       } else resi[i] = zz ? 1 : 2;
     } else {
-      if(zz) {  // nzchar mode
+      if(
+        idx && !zz && FANSI_index_ok(idx, i, state.settings) &&
+        (!FANSI_index_bad_utf8(idx, i) || state.settings & SET_ALLOWNA)
+      ) {
+        resi[i] = FANSI_index_bad_utf8(idx, i) ?
+          NA_INTEGER : FANSI_index_width(idx, i, type_int);
+      } else if(zz) {  // nzchar mode
         FANSI_read_until(&state, 1, 0, 0, 1, i, arg);
         resi[i] = state.pos.w > 0;
       } else {
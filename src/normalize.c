@@ -100,7 +100,9 @@ static SEXP normalize_state_int(
   SEXP ctl = PROTECT(ScalarInteger(1)); ++prt;  // "all"
   int do_carry = STRING_ELT(carry, 0) != NA_STRING;
   int any_na = 0;
-  struct FANSI_state state_carry = FANSI_carry_init(carry, warn, term_cap, ctl);
+  struct FANSI_state state_carry =
+    FANSI_carry_init(carry, warn, term_cap, ctl);
+  PROTECT(state_carry.tab->mem); ++prt;
   struct FANSI_state state_start, state;
   const char * err_msg = "Normalizing state";
 
@@ -108,6 +110,7 @@ static SEXP normalize_state_int(
     FANSI_interrupt(i + index0);
     if(!i) {
       state = FANSI_state_init(x, warn, term_cap, i);
+      PROTECT(state.tab->mem); ++prt;
     } else FANSI_state_reinit(&state, x, i);
 
     SEXP chrsxp = STRING_ELT(x, i);
@@ -119,18 +122,14 @@ static SEXP normalize_state_int(
       continue;
     }
     // Measure
-    if(do_carry) {
-      state.fmt.sgr = state_carry.fmt.sgr;
-      state.fmt.url = state_carry.fmt.url;
-    }
+    if(do_carry) FANSI_state_copy_fmt(&state, &state_carry);
     state_start = state;
 
     FANSI_reset_buff(buff);
     int len = FANSI_W_normalize(
       buff, &state, (int)LENGTH(chrsxp), i, err_msg, "x"
     );
-    state_carry.fmt.sgr = state.fmt.sgr;
-    state_carry.fmt.url = state.fmt.url;
+    FANSI_state_copy_fmt(&state_carry, &state);
 
     if(len < 0) continue;
 
@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) Brodie Gaslam
+ *
+ * This file is part of "fansi - ANSI Control Sequence Aware String Functions"
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Go to <https://www.r-project.org/Licenses> for a copies of the licenses.
+ */
+
+/*
+ * UTF-8 Reader Template
+ *
+ * Included by read.c once per width mode with READ_UTF8_NAME set to the name
+ * of the function to define and READ_UTF8_MODE to one of the COUNT_* modes.
+ * With the mode a constant the compiler drops the tests on it from the
+ * per-character loop.  Relies on helpers defined in read.c before inclusion.
+ *
+ * No include guard as this is meant to be included multiple times.
+ */
+#if !defined(READ_UTF8_NAME) || !defined(READ_UTF8_MODE)
+# error "READ_UTF8_NAME and READ_UTF8_MODE must be defined."
+#endif
+
+// See `read_utf8_until` in read.c.
+
+static void READ_UTF8_NAME(
+  struct FANSI_state * state, int until, int overshoot
+) {
+  char x;
+  const unsigned int w_mode = READ_UTF8_MODE;
+  int w_or_g = w_mode == COUNT_WIDTH || w_mode == COUNT_GRAPH;
+  // Grapheme state, see GS_* in read.c
+  unsigned int gs = state->status & STAT_ZWJ ? GS_ZWJ :
+    (state->status & STAT_RI ? GS_RI : GS_NONE);
+  state->status = state->status & STAT_WARNED;
+  // Bytes before this offset are known to be >= 0x80 (see bulk read)
+  int run_end = state->pos.x;
+  // Don't retry bulk read until this offset after a failed attempt
+  int bulk_next = state->pos.x;
+  // Character decoded ahead while reading a grapheme, if at `pend_x`
+  int pend_x = -1, pend_cp = 0, pend_size = 0;
+
+  while((x = state->string[state->pos.x]) && IS_UTF8(x)) {
+    // - Bulk Read -------------------------------------------------------------
+    //
+    // Runs of 2 or 3 byte characters can be neither RIs nor skin modifiers.  If
+    // there is room for them to not reach `until` and no ZWJ is pending, all
+    // we need is the widths.  16 is enough room for 8 x 2 or 5 x 3 bytes, at
+    // most 2 width each (or bytes in "bytes" mode).
+    int room = until - state->pos.w;
+    if(gs != GS_ZWJ && room >= 16 && state->pos.x >= bulk_next) {
+      if(state->pos.x >= run_end) {
+        int max = room < 1024 ? room * 4 : 4096;
+        if(max > state->len - state->pos.x) max = state->len - state->pos.x;
+        run_end = state->pos.x + FANSI_scan_utf8(
+          state->string + state->pos.x, max
+        );
+      }
+      const char * chr = state->string + state->pos.x;
+      int size = run_end - state->pos.x >= 16 ? utf8_run_size(chr) : 0;
+      if(!size) bulk_next = state->pos.x + 16;
+      else {
+        int w = state->pos.w;
+        int k, n = 16 / size;
+        for(k = 0; k < n; ++k, chr += size) {
+          int cp = size == 2 ?
+            ((chr[0] & 0x1F) << 6) | (chr[1] & 0x3F) :
+            ((chr[0] & 0x0F) << 12) | ((chr[1] & 0x3F) << 6) | (chr[2] & 0x3F);
+          if(cp == 0x200D) break;  // ZWJ needs the full treatment
+          int disp_size = 1;
+          if(w_mode == COUNT_BYTES) disp_size = size;
+          else if(w_or_g) {
+            disp_size = FANSI_unicode_width(cp);
+            if(w_mode == COUNT_GRAPH && disp_size > 1) disp_size = 1;
+          }
+          w += disp_size;
+        }
+        if(k) {
+          state->pos.x += k * size;
+          state->pos.w = w;
+          state->utf8 = state->pos.x;
+          state->status &= ~(STAT_RI | STAT_ZWJ);
+          gs = GS_NONE;
+          if(w == until) overshoot = 0;
+          continue;
+    } } }
+    // - One Character ---------------------------------------------------------
+
+    int cp = 0;
+    int disp_size = 0;
+    int add = 1;
+    unsigned int gs_next = GS_NONE;
+    int byte_size;
+    if(pend_x == state->pos.x) {
+      byte_size = pend_size;
+      cp = pend_cp;
+    } else byte_size = utf8_decode(state->string + state->pos.x, &cp);
+    int mb_err = !byte_size;
+
+    if(mb_err) {
+      // mimic what R_nchar does on mb error.  Breaks loop later.
+      disp_size = NA_INTEGER;
+      add = !w_or_g || gs != GS_ZWJ;
+    } else if(w_or_g) {
+      const struct graph_step * step = &graph_steps[gs][graph_class(cp)];
+      disp_size =
+        step->width == GW_BASE ? FANSI_unicode_width(cp) : step->width;
+      if(w_mode == COUNT_GRAPH && disp_size > 1) disp_size = 1;
+      add = step->add;
+      gs_next = step->next;
+    } else if(w_mode == COUNT_BYTES) {
+      disp_size = byte_size;
+    } else disp_size = 1;
+
+    if(disp_size == NA_INTEGER) {
+      // Whether this throws an error depends on what ->settings is.
+      state->status = set_err(state->status, ERR_BAD_UTF8);
+      disp_size = byte_size = 1;
+    }
+    int total_width = state->pos.w + disp_size;
+    if(total_width > until && !overshoot) {
+      state->status |= STAT_DONE;
+      break;
+    } else {
+      // We allow one overshoot if necessary and requested
+      if(total_width == until) overshoot = 0;
+      else if(total_width > until && overshoot) {
+        state->status |= STAT_OVERSHOT;
+        until = total_width;
+        overshoot = 0;
+      }
+      state->pos.x += byte_size;
+      state->utf8 = state->pos.x;  // record after so no ambiguity about 0
+      gs = gs_next;
+      // This could possibly overflow if byte_size >> 2 (e.g. if at some point
+      // width reports the \U escape codes.
+      if(state->pos.w > FANSI_lim.lim_int.max - disp_size)
+        error("Internal Error:  width greater than INT_MAX"); // nocov
+
+      if(add) state->pos.w += disp_size;
+    }
+    // Always break for error reporting
+    if(mb_err) break;
+
+    // - Rest of Grapheme ------------------------------------------------------
+    //
+    // Code points that continue the grapheme are zero width so always fit, and
+    // can be consumed without the checks above.  The first one that doesn't is
+    // kept for the next iteration.
+    while(w_or_g && IS_UTF8(state->string[state->pos.x])) {
+      int size = utf8_decode(state->string + state->pos.x, &cp);
+      if(size) {
+        const struct graph_step * step = &graph_steps[gs][graph_class(cp)];
+        if(
+          !step->width ||
+          (step->width == GW_BASE && !FANSI_unicode_width(cp))
+        ) {
+          state->pos.x += size;
+          state->utf8 = state->pos.x;
+          gs = step->next;
+          continue;
+      } }
+      pend_x = state->pos.x;
+      pend_cp = cp;
+      pend_size = size;
+      break;
+    }
+  }
+}
+
+#undef READ_UTF8_NAME
+#undef READ_UTF8_MODE
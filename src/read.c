@@ -16,7 +16,7 @@
  */
 
 #include <stdio.h>  // snprintf
-#include <string.h> // strlen
+#include <string.h> // strlen, memcpy
 #include "fansi.h"
 
 /*
@@ -64,72 +64,236 @@ static const char * err_messages[] = {
 /*- UTF8 Helpers --------------------------------------------------------------\
 \-----------------------------------------------------------------------------*/
 
-#include "utf8clen.h"
+/*
+ * UTF-8 Decoding DFA
+ *
+ * Decodes, and validates, one UTF-8 encoded character in a single pass over its
+ * bytes.  Each byte is mapped to a class, and the class and current state
+ * select the next state.  Validation is deliberately as permissive as the R
+ * `utf8clen` based version it replaces:  lead bytes 0xC0-0xF7 followed by the
+ * corresponding number of 10xxxxxx continuation bytes are accepted (so
+ * overlong encodings, surrogates, and code points up to 0x1FFFFF pass), and
+ * anything else is an error.  The NUL terminator is not a continuation byte so
+ * truncated sequences fail without reading past it.
+ */
+// Byte classes
+#define U8_ASCII  0   // 0x00-0x7F
+#define U8_CONT   1   // 0x80-0xBF
+#define U8_LEAD2  2   // 0xC0-0xDF
+#define U8_LEAD3  3   // 0xE0-0xEF
+#define U8_LEAD4  4   // 0xF0-0xF7
+#define U8_BAD    5   // 0xF8-0xFF (5 and 6 byte forms are not supported)
+// States; values 1-3 are the number of continuation bytes still needed
+#define U8_ACCEPT 0
+#define U8_REJECT 4
+#define U8_START  5
+
+static const unsigned char u8_class[256] = {
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2, 2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,
+  3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3, 4,4,4,4,4,4,4,4,5,5,5,5,5,5,5,5
+};
+// Transitions, indexed by [state][class]
+static const unsigned char u8_trans[6][6] = {
+  // ASCII CONT LEAD2 LEAD3 LEAD4 BAD
+  {4, 4, 4, 4, 4, 4},   // ACCEPT
+  {4, 0, 4, 4, 4, 4},   // need 1
+  {4, 1, 4, 4, 4, 4},   // need 2
+  {4, 2, 4, 4, 4, 4},   // need 3
+  {4, 4, 4, 4, 4, 4},   // REJECT
+  {4, 4, 1, 2, 3, 4}    // START
+};
+// Payload bits of lead bytes by class
+static const unsigned char u8_lead_mask[6] = {0x7F, 0, 0x1F, 0x0F, 0x07, 0};
 
 /*
- * Perfunctory validation, checks there is a zero in the right spot
- * for the first byte, and that continuation bytes start with 10.
+ * Decode the UTF-8 character at `chr`
  *
- * Assumes correct number of continuation bytes exist and that
- * input was read through utf8clen.
+ * @param cp will be set to the code point.
+ * @return the number of bytes in the character, or 0 if it is invalid.
+ */
+static int utf8_decode(const char * chr, int * cp) {
+  const unsigned char * x = (const unsigned char *) chr;
+  unsigned int cls = u8_class[*x];
+  unsigned int state = u8_trans[U8_START][cls];
+  int val = *x & u8_lead_mask[cls];
+  int bytes = 1;
+
+  while(state && state != U8_REJECT) {
+    ++x;
+    state = u8_trans[state][u8_class[*x]];
+    val = (val << 6) | (*x & 0x3F);
+    ++bytes;
+  }
+  if(state) return 0;
+  *cp = val;
+  return bytes;
+}
+/*
+ * Bulk decoding of runs of 2 or 3 byte characters
  *
- * DO NOT USE AS STANDALONE UTF8 VALIDATION.
+ * Checks whether the next 16 bytes are 8 two byte or 5 three byte characters
+ * by comparing them as two 64 bit words against masked patterns.  Callers
+ * must ensure 16 bytes are available (we use FANSI_scan_utf8 for this), so no
+ * NUL byte can be in range.  Unions initialize the words byte-wise so the
+ * patterns are endian-independent.
  */
-static int valid_utf8(const char * chr, int bytes) {
-  int pass = 0;
-  if(bytes > 1) {
-    pass = !(*chr & (0x20 >> (bytes - 2)));
-    switch(bytes) {
-      case 4: pass &= (*(++chr) & 0xc0) == 0x80; /* FALLTHRU */
-      case 3: pass &= (*(++chr) & 0xc0) == 0x80; /* FALLTHRU */
-      case 2: pass &= (*(++chr) & 0xc0) == 0x80; break;
-      default: pass = 0;
-  } }
-  return pass;
+union u8_pattern {unsigned char b[16]; uint64_t u[2];};
+
+static const union u8_pattern u8_mask2 = {{
+  0xE0,0xC0,0xE0,0xC0,0xE0,0xC0,0xE0,0xC0,
+  0xE0,0xC0,0xE0,0xC0,0xE0,0xC0,0xE0,0xC0
+}};
+static const union u8_pattern u8_pat2 = {{
+  0xC0,0x80,0xC0,0x80,0xC0,0x80,0xC0,0x80,
+  0xC0,0x80,0xC0,0x80,0xC0,0x80,0xC0,0x80
+}};
+static const union u8_pattern u8_mask3 = {{
+  0xF0,0xC0,0xC0,0xF0,0xC0,0xC0,0xF0,0xC0,
+  0xC0,0xF0,0xC0,0xC0,0xF0,0xC0,0xC0,0x00
+}};
+static const union u8_pattern u8_pat3 = {{
+  0xE0,0x80,0x80,0xE0,0x80,0x80,0xE0,0x80,
+  0x80,0xE0,0x80,0x80,0xE0,0x80,0x80,0x00
+}};
+// Returns the byte size of the characters if there is a run (2 or 3), else 0
+static int utf8_run_size(const char * chr) {
+  uint64_t w[2];
+  memcpy(w, chr, sizeof(w));
+  if(
+    (w[0] & u8_mask3.u[0]) == u8_pat3.u[0] &&
+    (w[1] & u8_mask3.u[1]) == u8_pat3.u[1]
+  )
+    return 3;
+  if(
+    (w[0] & u8_mask2.u[0]) == u8_pat2.u[0] &&
+    (w[1] & u8_mask2.u[1]) == u8_pat2.u[1]
+  )
+    return 2;
+  return 0;
 }
+/*
+ * Grapheme Approximation
+ *
+ * In width and grapheme modes code points are measured by a small state
+ * machine over a few code point classes instead of a chain of tests.  The
+ * state is whether the previous code point was a Regional Indicator (RI) that
+ * started a flag, or a Zero Width Joiner (ZWJ).
+ *
+ * * The first RI of a pair is width two, the second zero.
+ * * Emoji skin tone modifiers are zero width.
+ * * Anything following a ZWJ adds no width.  An RI following a ZWJ is measured
+ *   as width two to decide whether it fits, but does not add width.
+ * * Everything else is measured with `FANSI_unicode_width`.
+ *
+ * A code point that is measured zero width and adds none continues the
+ * grapheme of the one before it.
+ */
+#define GC_OTHER 0
+#define GC_RI    1
+#define GC_EMOD  2   // skin tone modifier
+#define GC_ZWJ   3
 
-// Compute a unicode code point from a _valid_ UTF8 encoding
-// Assumes 0 < bytes < 7 (or else bad stuff will happen)
-
-static int utf8_to_cp(const char * chr, int bytes) {
-  int cp = 0;
-  // Lead byte (trailing bytes only contribute 6 bits each)
-  cp |=
-    (*chr & (0xff >> (bytes + (bytes > 1)))) // keep  7, 5, 4, or 3 bits
-    << (bytes - 1) * 6;                      // shift by byte count
+#define GS_NONE  0
+#define GS_RI    1
+#define GS_ZWJ   2
 
-  // Trailing bytes keep trailing 6 bits
-  for(int i = bytes - 1; i > 0; --i)
-    cp |= (*(chr + bytes - i) & 0x3f) << (i - 1) * 6;
+#define GW_BASE -1   // use FANSI_unicode_width
 
-  return cp;
+struct graph_step {
+  signed char width;   // width to test against the target, or GW_BASE
+  unsigned char add;   // whether the width is added
+  unsigned char next;  // next state
+};
+// Indexed by [state][class]
+static const struct graph_step graph_steps[3][4] = {
+  // OTHER, RI, EMOD, ZWJ
+  {{GW_BASE, 1, GS_NONE}, {2, 1, GS_RI}, {0, 1, GS_NONE}, {0, 1, GS_ZWJ}},
+  {{GW_BASE, 1, GS_NONE}, {0, 1, GS_NONE}, {0, 1, GS_NONE}, {0, 1, GS_ZWJ}},
+  {{0, 0, GS_NONE}, {2, 0, GS_RI}, {0, 0, GS_NONE}, {0, 0, GS_ZWJ}}
+};
+static int graph_class(int cp) {
+  if(cp < 0x200D) return GC_OTHER;
+  if(cp == 0x200D) return GC_ZWJ;
+  if(cp >= 0x1F1E6 && cp <= 0x1F1FF) return GC_RI;
+  if(cp >= 0x1F3FB && cp <= 0x1F3FF) return GC_EMOD;
+  return GC_OTHER;
 }
+/*- ESC Helpers ---------------------------------------------------------------\
+\-----------------------------------------------------------------------------*/
+
+/*
+ * Byte classes for CSI and OSC parsing
+ *
+ * Parsers look up the class of each byte once instead of testing it against a
+ * chain of ranges.  The classes are ordered so that the printable ASCII ones
+ * (0x20-0x7E) are contiguous, see `BC_IS_PRINT`.
+ */
+#define BC_NUL  0   // string terminator
+#define BC_C0   1   // C0 controls other than format effectors, and DEL
+#define BC_FE   2   // format effectors 0x08-0x0D
+#define BC_INT  3   // intermediate bytes 0x20-0x2F
+#define BC_DIG  4   // parameter bytes [0-9]
+#define BC_PAR  5   // other parameter bytes [:<=>?]
+#define BC_SEMI 6   // parameter byte ';'
+#define BC_FIN  7   // final bytes 0x40-0x7E, except 'm'
+#define BC_M    8   // 'm', the SGR final byte
+#define BC_HI   9   // 0x80-0xFF
+
+#define BC_IS_PRINT(x) ((x) >= BC_INT && (x) <= BC_M)
+
+static const unsigned char byte_class[256] = {
+  0,1,1,1,1,1,1,1,2,2,2,2,2,2,1,1, 1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+  3,3,3,3,3,3,3,3,3,3,3,3,3,3,3,3, 4,4,4,4,4,4,4,4,4,4,5,6,5,5,5,5,
+  7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
+  7,7,7,7,7,7,7,7,7,7,7,7,7,8,7,7, 7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,1,
+  9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+  9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+  9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+  9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9
+};
+/*
+ * CSI parameter substring states
+ *
+ * Values below CSI_SGR are states the reader stays in, the others are the
+ * ways a substring can end:
+ *
+ * * CSI_PAR: reading parameter bytes.
+ * * CSI_INT: reading intermediate bytes.
+ * * CSI_TAIL: read an invalid byte, consuming until a final byte.
+ * * CSI_SGR: ';' or 'm' right after the parameters.
+ * * CSI_END: any other final byte.
+ * * CSI_NUL: the string ended first.
+ */
+#define CSI_PAR  0
+#define CSI_INT  1
+#define CSI_TAIL 2
+#define CSI_SGR  3
+#define CSI_END  4
+#define CSI_NUL  5
+
+// Transitions, indexed by [state][class]
+static const unsigned char csi_trans[3][10] = {
+  // NUL C0 FE INT DIG PAR SEMI FIN M HI
+  {5, 2, 2, 1, 0, 0, 3, 4, 3, 2},   // PAR
+  {5, 2, 2, 1, 2, 2, 2, 4, 4, 2},   // INT
+  {5, 2, 2, 2, 2, 2, 2, 4, 4, 2}    // TAIL
+};
 /*- Helpers -------------------------------------------------------------------\
 \-----------------------------------------------------------------------------*/
 
 static unsigned int set_err(unsigned int x, unsigned int err) {
   return FANSI_SET_RNG(x, STAT_ERR_START, STAT_ERR_ALL, err);
 }
-// Can a byte be interpreted as ASCII number?
-
-static int is_num(const char * string) {
-  return *string >= 48 && *string <= 57;
-}
-// Convert a char value to number by subtracting the zero char; only intended
-// for use with string values in [0-9]
-
-static int as_num(const char * string) {
-  if(!is_num(string))
-    // nocov start
-    error(
-      "Internal Error: attempt to convert non-numeric char (%d) to int.",
-      (int) *string
-    );
-    // nocov end
-  return (int) (*string - '0');
-}
 #define EW_BUFF 39
-static void alert(struct FANSI_state * state, R_xlen_t i, const char * arg) {
+static void alert_err(
+  struct FANSI_state * state, R_xlen_t i, const char * arg
+) {
   unsigned int err_code = FANSI_GET_ERR(state->status);
   int err_mode = (err_code == ERR_BAD_UTF8 || err_code == ERR_NON_ASCII);
   if(
@@ -167,6 +331,11 @@ static void alert(struct FANSI_state * state, R_xlen_t i, const char * arg) {
     state->status |= STAT_WARNED;  // only warn once
   }
 }
+// Called after each read, so kept small enough to inline; errors are rare.
+
+static void alert(struct FANSI_state * state, R_xlen_t i, const char * arg) {
+  if(state->status & STAT_ERR_MASK) alert_err(state, i, arg);
+}
 
 /*- Parsers -------------------------------------------------------------------\
 \-----------------------------------------------------------------------------*/
@@ -180,80 +349,67 @@ static void alert(struct FANSI_state * state, R_xlen_t i, const char * arg) {
  */
 
 unsigned int parse_token(struct FANSI_state * state) {
-  unsigned int mult, val;
-  int len, len_intermediate, len_tail, is_csi, non_standard, private,
-    leading_zeros, not_zero, is_sgr, err_code;
-  len = len_intermediate = len_tail = is_csi = non_standard = private =
-    leading_zeros = not_zero = is_sgr = err_code = 0;
-  mult = 1;
-  val = 0U;
-  const char * string = state->string + state->pos.x;
-
-  // `private` a bit redundant since we don't actually use it differentially to
-  // non-normal
-  private = *string >= 0x3C && * string <= 0x3F;
-  int bad_sub = 0;
-
-  // cycle through valid parameter bytes [0-9:;<=>?]
-  while(*string >= 0x30 && *string <= 0x3F && *string != ';') {
-    int is_zero = *string == '0';
-    if(!is_zero && !not_zero) not_zero = 1;
-    if(is_zero && !not_zero) ++leading_zeros;
-    non_standard |= *string > 0x39;
+  unsigned int val = 0U;
+  int digits, non_standard, not_zero, is_sgr, is_csi, err_code;
+  digits = non_standard = not_zero = is_sgr = err_code = 0;
+  const unsigned char * string =
+    (const unsigned char *) state->string + state->pos.x;
+  const unsigned char * string0 = string;
+
+  // Step through the bytes with `csi_trans`:
+  //
+  // * parameter bytes [0-9:;<=>?], with ';' ending the substring.
+  // * intermediate bytes, we allow 'infinite' here as per ECMA48, although they
+  //   note 1 byte is likely sufficient.
+  // * anything else that is not a final byte is invalid, in which case we
+  //   consume until we find a valid end or the string ends.
+  //
+  // Digits are accumulated as we go, but there is no point going past 3
+  // significant ones (see val > 255 below).
+  int cstate = CSI_PAR, next, cls;
+  while(1) {
+    cls = byte_class[*string];
+    next = csi_trans[cstate][cls];
+    if(next > CSI_TAIL) break;
+    if(next == CSI_PAR) {
+      if(cls == BC_DIG) {
+        if(*string != '0') not_zero = 1;
+        if(not_zero && ++digits <= 3) val = val * 10U + (*string - '0');
+      } else {
+        not_zero = non_standard = 1;
+        ++digits;
+      }
+    } else if(cls == BC_HI && next == CSI_TAIL) err_code = ERR_NON_ASCII;
+    cstate = next;
     ++string;
-    ++len;
   }
-  if(non_standard) bad_sub = 1;
+  int bad_sub = non_standard || cstate == CSI_TAIL || next == CSI_NUL;
 
-  // check for for intermediate bytes, we allow 'infinite' here as per
-  // ECMA48, although they note 1 byte is likely sufficient.
-  while(*string >= 0x20 && *string <= 0x2F) {
-    ++string;
-    ++len_intermediate;
-  }
-  // check for final byte
-  is_sgr = 0;
-  is_csi = 1;  // Really means "is escape 'complete'"
-  if((*string == ';' || *string == 'm') && !len_intermediate) {
-    // valid end of SGR parameter substring
-    if(*string == ';') is_csi = 0;
-    // technically non-sgrness is implicit in is_csi + err_code, but because we
-    // can parse multiple CSI sequences one after the other, and we accumulate
-    // the err_code value, it's cleaner to just explicitly determine whether
-    // sequence is actually sgr.
-  } else if(*string >= 0x40 && *string <= 0x7E) {
-    // valid final byte, but not SGR
-    err_code = ERR_NOT_SPECIAL;
-  } else {
-    // Invalid end, consume until find a valid end or end string
-    while(*string && (*string < 0x40 || *string > 0x7E)) {
-      if((unsigned char)*string > 0x7F) err_code = ERR_NON_ASCII;
-      ++string;
-      ++len_tail;
-    }
-    bad_sub = 1;
-    if(!*string && err_code < ERR_BAD_CSI_OSC) err_code = ERR_BAD_CSI_OSC;
-  }
-  if(*string == 'm') is_sgr = 1;
+  // Valid final byte, but not SGR
+  if(next == CSI_END && cstate != CSI_TAIL) err_code = ERR_NOT_SPECIAL;
+  else if(next == CSI_NUL && err_code < ERR_BAD_CSI_OSC)
+    err_code = ERR_BAD_CSI_OSC;
+
+  // technically non-sgrness is implicit in is_csi + err_code, but because we
+  // can parse multiple CSI sequences one after the other, and we accumulate
+  // the err_code value, it's cleaner to just explicitly determine whether
+  // sequence is actually sgr.
+  is_sgr = *string == 'm';
+  is_csi = !(next == CSI_SGR && *string == ';'); // "is escape 'complete'"
 
   // Check num length to avoid overflow.
-  if(len - leading_zeros > 3) bad_sub = 1;  // see val > 255 below
-  if(!bad_sub && err_code < ERR_BAD_SUB) {
-    int len2 = len - leading_zeros;
-    while(len2--) {
-      val += (as_num(--string) * mult);
-      mult *= 10;
-  } }
+  if(digits > 3) bad_sub = 1;  // see val > 255 below
+  if(bad_sub || err_code >= ERR_BAD_SUB) val = 0U;
   // Anything over 255 cannot be part of a valid CSI (reference?).  It seems as
   // if the standards only specify it should be a decimal number, so this is not
   // strictly correct.
-  if(val > 255) bad_sub = 1;
+  else if(val > 255) bad_sub = 1;
 
   if(bad_sub && !is_sgr && err_code < ERR_NOT_SPECIAL_BAD_SUB)
     err_code = ERR_NOT_SPECIAL_BAD_SUB;
   else if(bad_sub && err_code < ERR_BAD_SUB) err_code = ERR_BAD_SUB;
 
-  state->pos.x += len + len_intermediate + len_tail;
+  state->pos.x += string - string0;
   state->status = set_err(state->status, err_code);
   // csi/sgr mutually exclusive
   if(is_sgr) state->status |= CTL_SGR;
@@ -271,7 +427,7 @@ unsigned int parse_token(struct FANSI_state * state) {
  * @param colors is whether we are doing palette (5), or rgb truecolor (2)
  */
 void parse_colors(
-  struct FANSI_state * state, int mode
+  struct FANSI_state * state, struct FANSI_format * fmt, int mode
 ) {
   if(mode != 3 && mode != 4)
     error("Internal Error: parsing color with invalid mode.");  // nocov
@@ -337,18 +493,18 @@ void parse_colors(
           // could allow e.g. 900 as a color channel value as Iterm2 does.
           if(!err_col && !early_end) {
             if(colors == 2) {
-              if(mode == 3) state->fmt.sgr.color.x = CLR_TRU | 8U;
-              else          state->fmt.sgr.bgcol.x = CLR_TRU | 8U;
+              if(mode == 3) fmt->sgr.color.x = CLR_TRU | 8U;
+              else          fmt->sgr.bgcol.x = CLR_TRU | 8U;
               i_max = 3;
             } else if (colors == 5) {
-              if(mode == 3) state->fmt.sgr.color.x = CLR_256 | 8U;
-              else          state->fmt.sgr.bgcol.x = CLR_256 | 8U;
+              if(mode == 3) fmt->sgr.color.x = CLR_256 | 8U;
+              else          fmt->sgr.bgcol.x = CLR_256 | 8U;
               i_max = 1;
             } else error("Internal Error: 1301341"); // nocov
             if(mode == 3)
-              memcpy(state->fmt.sgr.color.extra, tmp_col, sizeof(tmp_col));
+              memcpy(fmt->sgr.color.extra, tmp_col, sizeof(tmp_col));
             else
-              memcpy(state->fmt.sgr.bgcol.extra, tmp_col, sizeof(tmp_col));
+              memcpy(fmt->sgr.bgcol.extra, tmp_col, sizeof(tmp_col));
           }
           if(cap_exceeded && err_col < ERR_EXCEED_CAP)
             state->status = set_err(state->status, ERR_EXCEED_CAP);
@@ -458,7 +614,9 @@ static struct FANSI_offset get_url_param(
 #define ID_END(x) ((x).id.len + (x).id.start)
 #define URL_END(x) ((x).url.len + (x).url.start)
 
-unsigned int parse_url(struct FANSI_state * state) {
+unsigned int parse_url(
+  struct FANSI_state * state, struct FANSI_format * fmt
+) {
   const char *end, *x0, *x;
   unsigned int err_tmp = 0;
   unsigned int osc_len = 0;
@@ -476,12 +634,13 @@ unsigned int parse_url(struct FANSI_state * state) {
     while(*end && *end != '\a' && !(*end == 0x1b && *(end + 1) == '\\')) {
       // neither params nor URI must contain bytes outside of 0x20-0x7E. This is
       // a narrower range than stricly allowed by OSC CSI.
-      if(*end >= 0x20 && *end <= 0x7e) {
+      int cls = byte_class[(unsigned char) *end];
+      if(BC_IS_PRINT(cls)) {
         // All good
-        if (*end == ';' && o_semic <= o_dat) o_semic = end - x0;
-      } else if((unsigned char)*end > 0x7f) {
+        if (cls == BC_SEMI && o_semic <= o_dat) o_semic = end - x0;
+      } else if(cls == BC_HI) {
         err_tmp = ERR_NON_ASCII;
-      } else if (!(*end >= 0x08 && *end <= 0x0d)) {
+      } else if (cls != BC_FE) {
         // Invalid sub string (these used to be 5)
         if(err_tmp < ERR_BAD_SUB) err_tmp  = ERR_BAD_SUB;
         o_bad = end - x0;
@@ -498,35 +657,35 @@ unsigned int parse_url(struct FANSI_state * state) {
       if(*end && o_semic >= o_dat) {
         // const char * url_o_dat = x0 + o_semic + 1;
         // Only record params/id if we're sure they don't contain a bad byte
-        state->fmt.url = (struct FANSI_url) {.string = state->string};
+        fmt->url = (struct FANSI_url) {.string = state->string};
         struct FANSI_offset id_tmp;
         id_tmp = get_url_param(
           state->string, o_dat, o_semic - o_dat, "id="
         );
-        if(id_tmp.start > o_bad) state->fmt.url.id = id_tmp;
+        if(id_tmp.start > o_bad) fmt->url.id = id_tmp;
 
         // Only record url if it has neither bad nor non-portable byte
-        if(o_semic > o_bad) state->fmt.url.url =
+        if(o_semic > o_bad) fmt->url.url =
           (struct FANSI_offset) {o_semic + 1, end - (x0 + o_semic + 1)};
 
         // Detect non id parameters
         if(
           // Params before id (+3 for "id=")
-          (state->fmt.url.id.start > o_dat + 3) ||
+          (fmt->url.id.start > o_dat + 3) ||
           // Params after id
           (
-            state->fmt.url.id.start &&
-            o_semic > state->fmt.url.id.start + state->fmt.url.id.len
+            fmt->url.id.start &&
+            o_semic > fmt->url.id.start + fmt->url.id.len
           ) ||
           // No id but other params
-          (!state->fmt.url.id.start && o_semic > o_dat)
+          (!fmt->url.id.start && o_semic > o_dat)
         ) {
           if(err_tmp < ERR_UNKNOWN_SUB) err_tmp = ERR_UNKNOWN_SUB;
         }
         // Sanity check
         if(
-          (end - state->string) < URL_LEN(state->fmt.url) ||
-          (end - state->string) < ID_LEN(state->fmt.url)
+          (end - state->string) < URL_LEN(fmt->url) ||
+          (end - state->string) < ID_LEN(fmt->url)
         )
           error("Internal Error: bad URI size.");  // nocov
       }
@@ -546,6 +705,46 @@ unsigned int parse_url(struct FANSI_state * state) {
   } else error("Internal Error: non-URL OSC fed to URL parser.\n"); // nocov
   return osc_len;
 }
+/*
+ * Point a URL into the string of a state
+ *
+ * URLs of formats from a format table point to the table's copy (see state.c),
+ * but some uses (e.g. index.c) need offsets into the string they were read
+ * from.  We look for the last URL sequence before the state's position with
+ * the same URL and id, which is what the URL was read from if the state has
+ * been reading its string from the beginning.
+ *
+ * @param url as normalized by the format table.
+ * @param last result of the previous call for the same string, or zeroed.  The
+ *   search is skipped if `url` is the same as `last`.  Updated with the result.
+ */
+static int url_same(struct FANSI_url a, struct FANSI_url b) {
+  return a.string && b.string &&
+    URL_LEN(a) == URL_LEN(b) && ID_LEN(a) == ID_LEN(b) &&
+    !memcmp(URL_STRING(a), URL_STRING(b), URL_LEN(a)) &&
+    !memcmp(ID_STRING(a), ID_STRING(b), ID_LEN(a));
+}
+void FANSI_url_rebase(
+  struct FANSI_url * url, struct FANSI_state * state, struct FANSI_url * last
+) {
+  if(!url->string || url->string == state->string) return;
+  if(url_same(*url, *last)) {
+    *url = *last;
+    return;
+  }
+  for(int k = state->pos.x - 1; k > 0; --k) {
+    const char * x = state->string + k;
+    if(x[-1] != 0x1b || x[0] != ']' || x[1] != '8' || x[2] != ';') continue;
+    struct FANSI_state st = *state;
+    struct FANSI_format fmt = {0};
+    st.pos.x = k + 1;
+    parse_url(&st, &fmt);
+    if(url_same(*url, fmt.url)) {
+      *url = *last = fmt.url;
+      return;
+  } }
+  error("Internal Error: URL not found in string.");  // nocov
+}
 /*
  * Return OSC length excluding initial "ESC]"
  *
@@ -566,8 +765,9 @@ static struct FANSI_osc parse_osc(const char * x) {
   const char * end = x;
   struct FANSI_osc osc = {.len=0, .error=0};
   while(*end && *end != '\a' && !(*end == 0x1b && *(end + 1) == '\\')) {
-    if (!((*end >= 0x08 && *end <= 0x0d) || (*end >= 0x20 && *end <= 0x7e))) {
-      if((unsigned char)*end > 0x7f) {
+    int cls = byte_class[(unsigned char) *end];
+    if (!(cls == BC_FE || BC_IS_PRINT(cls))) {
+      if(cls == BC_HI) {
         osc.error = ERR_NON_ASCII;
       }
       else if(osc.error < ERR_NOT_SPECIAL_BAD_SUB)
@@ -592,11 +792,8 @@ static void read_ascii_until(
   struct FANSI_state * state, int until, int reset
 ) {
   if(reset) state->status = state->status & STAT_WARNED;
-  int until2 = until - state->pos.w;
-  const char * start, * end;
-  end = start = state->string + state->pos.x;
-  while(IS_PRINT(*end) && (end - start) < until2) ++end;
-  int bytes = end - start;
+  // Find run of printable ASCII, scan.c
+  int bytes = FANSI_scan_print_state(state, until - state->pos.w);
   state->pos.w += bytes;
   state->pos.x += bytes;
 }
@@ -611,6 +808,498 @@ static void read_one(struct FANSI_state * state) {
   ++state->pos.x;
   ++state->pos.w;
 }
+/*
+ * Parse a CSI sequence
+ *
+ * Reads each parameter substring in turn, applying the SGR ones to
+ * `fmt->sgr`.  Status will have the error code of the last substring,
+ * and CTL_SGR or CTL_CSI depending on the kind of sequence.
+ *
+ * @param state must be set with .pos.x pointing to the '[' that follows the
+ *   ESC that begins the CSI sequence.  It will be advanced past the final
+ *   byte.
+ * @return the highest error code of all the substrings.
+ */
+static unsigned int parse_csi(
+  struct FANSI_state * state, struct FANSI_format * fmt
+) {
+  unsigned int err_code = 0;
+  int tok_val = 0;
+  ++state->pos.x;  // consume '['
+
+  // Loop through the SGR; each token we process successfully modifies state
+  // and advances to the next token.
+  do {
+    state->status = set_err(state->status, 0);
+    tok_val = parse_token(state);  // advances state by ref!
+    if(!FANSI_GET_ERR(state->status)) {
+      // We have a reasonable CSI substring, now we need to check whether it
+      // actually corresponds to anything that should modify state
+      //
+      // Only parse_colors below will modify positions. Otherwise sgr and
+      // error codes should be the only things changing.
+
+      if(!tok_val) fmt->sgr = (struct FANSI_sgr) {0};
+      // - Colors --------------------------------------------------------------
+      else if (tok_val == 39) fmt->sgr.color.x = 0;
+      else if (tok_val == 49) fmt->sgr.bgcol.x = 0;
+      else if (tok_val == 38 || tok_val == 48)
+        // parse_colors internally calls parse_token (advances state by ref)
+        parse_colors(state, fmt, tok_val < 40 ? 3 : 4);
+      else if (tok_val >=  30 && tok_val <  48) {
+        int fg = tok_val < 40;
+        unsigned int col_code = tok_val - (fg ? 30 : 40);
+        unsigned int col_enc = CLR_8 | col_code;
+        if(fg) fmt->sgr.color.x = col_enc;
+        else   fmt->sgr.bgcol.x = col_enc;
+      } else if (
+        (tok_val >=  90 && tok_val <=  97) ||
+        (tok_val >= 100 && tok_val <= 107)
+      ) {
+        // Old behavior: don't warn if exceed, and don't record color.  New
+        // behavior (post v1.0) warn if exceed, but record color.
+        int term_old = state->settings & SET_TERMOLD;
+        if((state->settings & TERM_BRIGHT) || !term_old) {
+          if(!(state->settings & TERM_BRIGHT) && !term_old)
+            state->status = set_err(state->status, ERR_EXCEED_CAP);
+
+          int fg = tok_val < 100;
+          unsigned int col_code = tok_val - (fg ? 90 : 100);
+          unsigned int col_enc = CLR_BRIGHT | col_code;
+          if(fg) fmt->sgr.color.x = col_enc;
+          else   fmt->sgr.bgcol.x = col_enc;
+        }
+      // - Styles On -----------------------------------------------------------
+      } else if (tok_val < 10) {
+        // 1-9 are the standard styles (bold/italic)
+        // We use a bit mask on to track these
+        fmt->sgr.style |= 1U << (tok_val - 1U);
+      } else if (tok_val < 20) {
+        // These are alternative fonts (10 is reset)
+        fmt->sgr.style &= ~FONT_MASK;
+        if(tok_val > 10) fmt->sgr.style |= tok_val << FONT_START;
+      } else if (tok_val == 20) {
+        // Fraktur
+        fmt->sgr.style |= STL_FRAKTUR;
+      } else if (tok_val == 21) {
+        // Double underline
+        fmt->sgr.style |= STL_UNDER2;
+      } else if (tok_val == 26) {
+        // reserved for proportional spacing as specified in CCITT
+        // Recommendation T.61; implicitly we are assuming this is a single
+        // substring parameter, unlike say 38;2;..., but really we have no
+        // idea what this is.
+        fmt->sgr.style |= STL_PROPSPC;
+
+      // - Styles Off ----------------------------------------------------------
+      } else if (tok_val == 22) {
+        fmt->sgr.style &= ~STL_BOLD;
+        fmt->sgr.style &= ~STL_BLUR;
+      } else if (tok_val == 23) {
+        fmt->sgr.style &= ~STL_ITALIC;
+        fmt->sgr.style &= ~STL_FRAKTUR;
+      } else if (tok_val == 24) {
+        fmt->sgr.style &= ~STL_UNDER;
+        fmt->sgr.style &= ~STL_UNDER2;
+      } else if (tok_val == 25) {
+        fmt->sgr.style &= ~STL_BLINK1;
+        fmt->sgr.style &= ~STL_BLINK2;
+      }
+      else if (tok_val == 27)
+        fmt->sgr.style &= ~STL_INVERT;
+      else if (tok_val == 28)
+        fmt->sgr.style &= ~STL_CONCEAL;
+      else if (tok_val == 29)
+        fmt->sgr.style &= ~STL_CROSSOUT;
+      else if(tok_val == 50)
+        fmt->sgr.style &= ~STL_PROPSPC;
+
+      // - Borders / Ideograms -------------------------------------------------
+      else if(tok_val > 50 && tok_val < 60) {
+        switch(tok_val) {
+          case 51: fmt->sgr.style |= BRD_FRAMED; break;
+          case 52: fmt->sgr.style |= BRD_ENCIRC; break;
+          case 53: fmt->sgr.style |= BRD_OVERLN; break;
+          case 54:
+            fmt->sgr.style &= ~(BRD_FRAMED | BRD_ENCIRC);
+            break;
+          case 55:
+            fmt->sgr.style &= ~BRD_OVERLN;
+            break;
+          default:
+            state->status = set_err(state->status, ERR_UNKNOWN_SUB);
+        }
+      } else if(tok_val >= 60 && tok_val <= 65) {
+        switch(tok_val) {
+          case 60: fmt->sgr.style |= IDG_UNDERL;  break;
+          case 61: fmt->sgr.style |= IDG_UNDERL2; break;
+          case 62: fmt->sgr.style |= IDG_OVERL;   break;
+          case 63: fmt->sgr.style |= IDG_OVERL2;  break;
+          case 64: fmt->sgr.style |= IDG_STRESS;  break;
+          default: // ony 65
+            fmt->sgr.style &= ~IDG_MASK;
+        }
+      } else {
+        state->status = set_err(state->status, ERR_UNKNOWN_SUB);
+      }
+    }
+    if(FANSI_GET_ERR(state->status) > err_code)
+      err_code = FANSI_GET_ERR(state->status);
+    if(state->string[state->pos.x] != ';') break;
+    ++state->pos.x;
+  } while(1);
+  // Consume closing char (parse_token already checked it is correct
+  if(state->string[state->pos.x]) ++state->pos.x;
+  return err_code;
+}
+/*- Escape Cache --------------------------------------------------------------\
+\-----------------------------------------------------------------------------*/
+/*
+ * Cache of parsed CSI and OSC URL sequences
+ *
+ * Styled strings tend to reuse the same few sequences over and over, so rather
+ * than re-parse them each time we record their effect keyed on their bytes and
+ * on the settings that affect how they are parsed.
+ *
+ * A CSI sequence only ever sets, clears, or assigns bits in `struct FANSI_sgr`
+ * irrespective of their prior values, so its effect can be recorded as an AND
+ * and an OR mask, found by parsing it once from an all zero SGR and once from
+ * an all one SGR.  An OSC URL either replaces the URL, in which case we record
+ * the offsets relative to the sequence, or leaves it unchanged.
+ *
+ * The cache is a small direct mapped table, with a second smaller one for long
+ * sequences so the common short ones keep compact keys.  Long sequences are
+ * mostly OSC hyperlinks, which are as long as their URLs.  Their keys allow
+ * for the 2083 byte URIs that VTE, and terminals following it, accept, plus
+ * the framing and a short id.  Longer links are not usable anyway and are
+ * parsed each time.  Entries are only valid for the
+ * generation they were recorded in.  By default the generation advances with
+ * each call (see `FANSI_esc_cache_next`), but it can be kept for the whole
+ * session, or the cache turned off, with `FANSI_esc_cache`.
+ */
+#define ESC_CACHE_SIZE      256   // entries, must be a power of two
+#define ESC_CACHE_KEY        96   // longest short sequence, in bytes
+#define ESC_CACHE_LONG_SIZE  16   // entries, must be an even power of two
+#define ESC_CACHE_LONG_KEY 2176   // longest sequence cached, in bytes
+
+struct esc_cache_entry {
+  unsigned int gen;
+  unsigned int settings;
+  int len;
+  char key[ESC_CACHE_KEY];
+  unsigned int status;           // CTL and error bits set by the sequence
+  unsigned int err;              // highest error in the sequence
+  unsigned char sgr_and[sizeof(struct FANSI_sgr)];
+  unsigned char sgr_or[sizeof(struct FANSI_sgr)];
+  int url_set;                   // whether the sequence replaces the URL
+  struct FANSI_offset url, id;   // relative to the start of the sequence
+  unsigned int stamp;            // unique to each recording, see read_csi
+};
+struct esc_cache_long {
+  struct esc_cache_entry e;      // `e.key` unused
+  char key[ESC_CACHE_LONG_KEY];
+};
+static struct esc_cache_entry esc_cache[ESC_CACHE_SIZE];
+static struct esc_cache_long esc_cache_long[ESC_CACHE_LONG_SIZE];
+static unsigned int esc_cache_gen = 1;
+static unsigned int esc_cache_stamp;
+static int esc_cache_mode = ESC_CACHE_CALL;
+static double esc_cache_hits, esc_cache_misses;
+
+static void esc_cache_clear(void) {
+  if(!++esc_cache_gen) {
+    // Wrapped around, so stale entries could look current
+    memset(esc_cache, 0, sizeof(esc_cache));
+    memset(esc_cache_long, 0, sizeof(esc_cache_long));
+    esc_cache_gen = 1;
+  }
+}
+/*
+ * Start a new generation if caching per call.
+ *
+ * Called on state initialization, which happens once at the beginning of each
+ * call (and a few more times in some).
+ */
+void FANSI_esc_cache_next(void) {
+  if(esc_cache_mode == ESC_CACHE_CALL) esc_cache_clear();
+}
+static int esc_cache_is(
+  struct esc_cache_entry * e, const char * key, const char * x, int len,
+  unsigned int settings
+) {
+  return e->gen == esc_cache_gen && e->settings == settings &&
+    e->len == len && !memcmp(key, x, len);
+}
+/*
+ * Find the slot for a key, and whether it holds that key
+ *
+ * Long sequences get one of two slots, the older one if neither holds the key,
+ * so that e.g. two links used in turn do not keep evicting each other.
+ *
+ * @param len at most ESC_CACHE_LONG_KEY.
+ * @param key set to where the slot keeps its key.
+ */
+static struct esc_cache_entry * esc_cache_find(
+  const char * x, int len, unsigned int settings, int * hit, char ** key
+) {
+  // FNV-1a
+  unsigned int h = 2166136261U ^ settings;
+  for(int k = 0; k < len; ++k) h = (h ^ (unsigned char) x[k]) * 16777619U;
+  struct esc_cache_entry * e;
+  if(len <= ESC_CACHE_KEY) {
+    e = esc_cache + (h & (ESC_CACHE_SIZE - 1));
+    *key = e->key;
+    *hit = esc_cache_is(e, *key, x, len, settings);
+  } else {
+    struct esc_cache_long * el =
+      esc_cache_long + (h & (ESC_CACHE_LONG_SIZE - 2));
+    int w = 0;
+    while(w < 2 && !esc_cache_is(&el[w].e, el[w].key, x, len, settings)) ++w;
+    *hit = w < 2;
+    if(!*hit)
+      w = el[0].e.gen == esc_cache_gen &&
+        (el[1].e.gen != esc_cache_gen || el[1].e.stamp < el[0].e.stamp);
+    e = &el[w].e;
+    *key = el[w].key;
+  }
+  if(*hit) ++esc_cache_hits; else ++esc_cache_misses;
+  return e;
+}
+static void esc_cache_key(
+  struct esc_cache_entry * e, char * key, const char * x, int len,
+  unsigned int settings
+) {
+  e->gen = esc_cache_gen;
+  e->settings = settings;
+  e->len = len;
+  memcpy(key, x, len);
+  if(!++esc_cache_stamp) ++esc_cache_stamp;  // zero is reserved
+  e->stamp = esc_cache_stamp;
+}
+static void esc_cache_advance(
+  struct FANSI_state * state, struct esc_cache_entry * e
+) {
+  state->pos.x += e->len;
+  state->status = (state->status & ~(CTL_MASK | STAT_ERR_MASK)) | e->status;
+}
+static void esc_cache_apply_sgr(
+  struct FANSI_state * state, struct FANSI_format * fmt,
+  struct esc_cache_entry * e
+) {
+  unsigned char * sgr = (unsigned char *) &fmt->sgr;
+  for(size_t k = 0; k < sizeof(struct FANSI_sgr); ++k)
+    sgr[k] = (sgr[k] & e->sgr_and[k]) | e->sgr_or[k];
+  esc_cache_advance(state, e);
+}
+/*
+ * Format being changed by a series of escape sequences
+ *
+ * While the id of the format is known `fmt` is only retrieved from the state's
+ * format table when needed (see read_csi).  If the id is not known, `fmt` is
+ * always valid.
+ */
+struct esc_fmt {
+  struct FANSI_format fmt;   // only valid if `ok`
+  unsigned int id;           // FMT_ID_NA if not known
+  int ok;
+};
+static struct FANSI_format * esc_fmt_get(
+  struct FANSI_state * state, struct esc_fmt * f
+) {
+  if(!f->ok) {
+    f->fmt = state->tab->fmt[f->id];
+    f->ok = 1;
+  }
+  return &f->fmt;
+}
+static void esc_fmt_restore(
+  struct esc_fmt * f, unsigned int id, struct FANSI_format * fmt
+) {
+  f->id = id;
+  f->ok = id == FMT_ID_NA;
+  if(f->ok) f->fmt = *fmt;
+}
+/*
+ * Cached version of parse_csi, same interface.
+ *
+ * Additionally tracks the id of the format in the state's format table (see
+ * state.c), which is found by memoizing the effect of each cached sequence on
+ * each id in `FANSI_fmt_tab_step`.  When the step is memoized the format
+ * itself is not needed.  The cache entry stamp identifies the sequence; note
+ * a stamp could be reused after 2^32 recordings but by then memoized steps
+ * from earlier calls would have been long overwritten.
+ *
+ * @param f the format to change, with its id set to FMT_ID_NA if the change
+ *   can't be memoized.
+ */
+static unsigned int read_csi(struct FANSI_state * state, struct esc_fmt * f) {
+  if(esc_cache_mode == ESC_CACHE_OFF) {
+    struct FANSI_format * fmt = esc_fmt_get(state, f);
+    f->id = FMT_ID_NA;
+    return parse_csi(state, fmt);
+  }
+
+  // A CSI sequence always ends at the first final byte (see parse_token), or
+  // the end of the string.
+  const char * x = state->string + state->pos.x;
+  int len = 1;  // '['
+  while(len <= ESC_CACHE_LONG_KEY) {
+    int cls = byte_class[(unsigned char) x[len]];
+    if(cls == BC_NUL) break;
+    ++len;
+    if(cls == BC_FIN || cls == BC_M) break;
+  }
+  if(len > ESC_CACHE_LONG_KEY) {
+    struct FANSI_format * fmt = esc_fmt_get(state, f);
+    f->id = FMT_ID_NA;
+    return parse_csi(state, fmt);
+  }
+
+  // Only the terminal capabilities affect how CSI is parsed
+  unsigned int settings = state->settings & (TERM_MASK | SET_TERMOLD);
+  int hit;
+  char * key;
+  struct esc_cache_entry * e = esc_cache_find(x, len, settings, &hit, &key);
+  if(!hit) {
+    struct FANSI_state st0 = *state;
+    struct FANSI_state st1 = *state;
+    struct FANSI_format fmt0, fmt1;
+    memset(&fmt0.sgr, 0, sizeof(struct FANSI_sgr));
+    memset(&fmt1.sgr, 0xFF, sizeof(struct FANSI_sgr));
+    unsigned int err = parse_csi(&st0, &fmt0);
+    parse_csi(&st1, &fmt1);
+    if(st0.pos.x - state->pos.x != len)
+      error("Internal Error: CSI length mismatch in cache.");  // nocov
+
+    esc_cache_key(e, key, x, len, settings);
+    e->err = err;
+    e->status = st0.status & (CTL_MASK | STAT_ERR_MASK);
+    memcpy(e->sgr_and, &fmt1.sgr, sizeof(struct FANSI_sgr));
+    memcpy(e->sgr_or, &fmt0.sgr, sizeof(struct FANSI_sgr));
+  }
+  if(f->id != FMT_ID_NA) {
+    unsigned int id =
+      FANSI_fmt_tab_step(state->tab, f->id, e->stamp, NULL);
+    if(id != FMT_ID_NA) {
+      f->id = id;
+      f->ok = 0;
+      esc_cache_advance(state, e);
+      return e->err;
+  } }
+  esc_cache_apply_sgr(state, esc_fmt_get(state, f), e);
+  if(f->id != FMT_ID_NA)
+    f->id =
+      FANSI_fmt_tab_step(state->tab, f->id, e->stamp, &f->fmt);
+  return e->err;
+}
+/*
+ * Cached version of parse_url, with the format as for read_csi.
+ */
+static unsigned int read_url(struct FANSI_state * state, struct esc_fmt * f) {
+  if(esc_cache_mode == ESC_CACHE_OFF) {
+    struct FANSI_format * fmt = esc_fmt_get(state, f);
+    f->id = FMT_ID_NA;
+    return parse_url(state, fmt);
+  }
+
+  // Runs through the BEL or ST terminator, or to the end of the string.
+  const char * x = state->string + state->pos.x;
+  int len = 0;
+  while(len <= ESC_CACHE_LONG_KEY && x[len]) {
+    if(x[len] == '\a') {++len; break;}
+    if(x[len] == 0x1b && x[len + 1] == '\\') {len += 2; break;}
+    ++len;
+  }
+  if(len > ESC_CACHE_LONG_KEY) {
+    struct FANSI_format * fmt = esc_fmt_get(state, f);
+    f->id = FMT_ID_NA;
+    return parse_url(state, fmt);
+  }
+
+  int hit;
+  char * key;
+  struct esc_cache_entry * e = esc_cache_find(x, len, 0U, &hit, &key);
+  if(!hit) {
+    struct FANSI_state st0 = *state;
+    struct FANSI_format fmt0 = {0};
+    parse_url(&st0, &fmt0);
+    if(st0.pos.x - state->pos.x != len)
+      error("Internal Error: URL length mismatch in cache.");  // nocov
+
+    esc_cache_key(e, key, x, len, 0U);
+    e->err = 0;
+    e->status = st0.status & (CTL_MASK | STAT_ERR_MASK);
+    e->url_set = fmt0.url.string != NULL;
+    e->url = fmt0.url.url;
+    e->id = fmt0.url.id;
+    // Zero start means no URL or id, and these can't start the sequence
+    if(e->url.start) e->url.start -= state->pos.x;
+    if(e->id.start) e->id.start -= state->pos.x;
+  }
+  // URLs are recorded by content (see state.c), so the stamp is enough to
+  // identify the step.
+  if(f->id != FMT_ID_NA) {
+    unsigned int id =
+      FANSI_fmt_tab_step(state->tab, f->id, e->stamp, NULL);
+    if(id != FMT_ID_NA) {
+      f->id = id;
+      f->ok = 0;
+      esc_cache_advance(state, e);
+      return (unsigned int) len;
+  } }
+  struct FANSI_format * fmt = esc_fmt_get(state, f);
+  if(e->url_set) {
+    fmt->url = (struct FANSI_url) {
+      .string=state->string, .url=e->url, .id=e->id
+    };
+    if(e->url.start) fmt->url.url.start += state->pos.x;
+    if(e->id.start) fmt->url.id.start += state->pos.x;
+  }
+  esc_cache_advance(state, e);
+  if(f->id != FMT_ID_NA)
+    f->id =
+      FANSI_fmt_tab_step(state->tab, f->id, e->stamp, fmt);
+  return (unsigned int) len;
+}
+/*
+ * Set the escape cache mode and report on the cache
+ *
+ * @param mode scalar integer, see ESC_CACHE_* in fansi-cnst.h, NA to leave
+ *   unchanged.
+ * @param reset TRUE to clear the cache and zero the counters.
+ * @return the mode in use prior to the call, and the number of cache hits and
+ *   misses since the last reset (prior to any reset by this call).
+ */
+SEXP FANSI_esc_cache(SEXP mode, SEXP reset) {
+  if(TYPEOF(mode) != INTSXP || XLENGTH(mode) != 1)
+    error("Internal Error: `mode` must be a scalar integer.");  // nocov
+  if(!FANSI_is_tf(reset))
+    error("Internal Error: `reset` must be TRUE or FALSE.");  // nocov
+
+  SEXP res = PROTECT(allocVector(REALSXP, 3));
+  SEXP res_names = PROTECT(allocVector(STRSXP, 3));
+  REAL(res)[0] = esc_cache_mode;
+  REAL(res)[1] = esc_cache_hits;
+  REAL(res)[2] = esc_cache_misses;
+  SET_STRING_ELT(res_names, 0, mkChar("mode"));
+  SET_STRING_ELT(res_names, 1, mkChar("hits"));
+  SET_STRING_ELT(res_names, 2, mkChar("misses"));
+  setAttrib(res, R_NamesSymbol, res_names);
+
+  int mode_int = asInteger(mode);
+  if(mode_int != NA_INTEGER) {
+    if(mode_int < ESC_CACHE_OFF || mode_int > ESC_CACHE_SESSION)
+      error("Internal Error: invalid escape cache mode.");  // nocov
+    if(mode_int != esc_cache_mode) esc_cache_clear();
+    esc_cache_mode = mode_int;
+  }
+  if(asLogical(reset)) {
+    esc_cache_clear();
+    esc_cache_hits = esc_cache_misses = 0;
+  }
+  UNPROTECT(2);
+  return res;
+}
 /*
  * Parses ESC sequences
  *
@@ -696,6 +1385,11 @@ void read_esc(struct FANSI_state * state, int term_i) {
 
   state->status &= ~CTL_MASK;
   unsigned int sgr_sup = state->settings & CTL_SGR;
+
+  // Sequences are applied to a working copy of the format, which is recorded
+  // in the state once all have been read.  We track its id when possible to
+  // avoid looking it up in the table (see read_csi).
+  struct esc_fmt f = {.id = state->fmt_id};
   unsigned int csi_sup = state->settings & CTL_CSI;
 
   // Consume all contiguous ESC sequences, subject to some conditions (see while
@@ -705,6 +1399,9 @@ void read_esc(struct FANSI_state * state, int term_i) {
 
   do {
     struct FANSI_state state_prev = *state;
+    struct FANSI_format fmt_prev;
+    unsigned int id_prev = f.id;
+    if(id_prev == FMT_ID_NA) fmt_prev = f.fmt;
     // Is the current escape recognized by the `ctl` parameter?  It doesn't
     // matter if it ends up being badly encoded or, not just that it starts out
     // as a presumptive escape that we requested to recognize and such should
@@ -718,136 +1415,13 @@ void read_esc(struct FANSI_state * state, int term_i) {
 
     if(state->string[state->pos.x] == '[' && (sgr_sup || csi_sup)) {
       // - CSI -----------------------------------------------------------------
-      ++state->pos.x;  // consume '['
-      int tok_val = 0;
-
       // Make sure ->status only contains one CTL per ESC sequence.
       unsigned int ctl_prev = state->status & CTL_MASK;
       state->status &= ~CTL_MASK;
 
-      // Loop through the SGR; each token we process successfully modifies state
-      // and advances to the next token.
-      do {
-        state->status = set_err(state->status, 0);
-        tok_val = parse_token(state);  // advances state by ref!
-        if(!FANSI_GET_ERR(state->status)) {
-          // We have a reasonable CSI substring, now we need to check whether it
-          // actually corresponds to anything that should modify state
-          //
-          // Only parse_colors below will modify positions. Otherwise sgr and
-          // error codes should be the only things changing.
-
-          if(!tok_val) state->fmt.sgr = (struct FANSI_sgr) {0};
-          // - Colors ----------------------------------------------------------
-          else if (tok_val == 39) state->fmt.sgr.color.x = 0;
-          else if (tok_val == 49) state->fmt.sgr.bgcol.x = 0;
-          else if (tok_val == 38 || tok_val == 48)
-            // parse_colors internally calls parse_token (advances state by ref)
-            parse_colors(state, tok_val < 40 ? 3 : 4);
-          else if (tok_val >=  30 && tok_val <  48) {
-            int fg = tok_val < 40;
-            unsigned int col_code = tok_val - (fg ? 30 : 40);
-            unsigned int col_enc = CLR_8 | col_code;
-            if(fg) state->fmt.sgr.color.x = col_enc;
-            else   state->fmt.sgr.bgcol.x = col_enc;
-          } else if (
-            (tok_val >=  90 && tok_val <=  97) ||
-            (tok_val >= 100 && tok_val <= 107)
-          ) {
-            // Old behavior: don't warn if exceed, and don't record color.  New
-            // behavior (post v1.0) warn if exceed, but record color.
-            int term_old = state->settings & SET_TERMOLD;
-            if((state->settings & TERM_BRIGHT) || !term_old) {
-              if(!(state->settings & TERM_BRIGHT) && !term_old)
-                state->status = set_err(state->status, ERR_EXCEED_CAP);
-
-              int fg = tok_val < 100;
-              unsigned int col_code = tok_val - (fg ? 90 : 100);
-              unsigned int col_enc = CLR_BRIGHT | col_code;
-              if(fg) state->fmt.sgr.color.x = col_enc;
-              else   state->fmt.sgr.bgcol.x = col_enc;
-            }
-          // - Styles On -------------------------------------------------------
-          } else if (tok_val < 10) {
-            // 1-9 are the standard styles (bold/italic)
-            // We use a bit mask on to track these
-            state->fmt.sgr.style |= 1U << (tok_val - 1U);
-          } else if (tok_val < 20) {
-            // These are alternative fonts (10 is reset)
-            state->fmt.sgr.style &= ~FONT_MASK;
-            if(tok_val > 10) state->fmt.sgr.style |= tok_val << FONT_START;
-          } else if (tok_val == 20) {
-            // Fraktur
-            state->fmt.sgr.style |= STL_FRAKTUR;
-          } else if (tok_val == 21) {
-            // Double underline
-            state->fmt.sgr.style |= STL_UNDER2;
-          } else if (tok_val == 26) {
-            // reserved for proportional spacing as specified in CCITT
-            // Recommendation T.61; implicitly we are assuming this is a single
-            // substring parameter, unlike say 38;2;..., but really we have no
-            // idea what this is.
-            state->fmt.sgr.style |= STL_PROPSPC;
-
-          // - Styles Off ------------------------------------------------------
-          } else if (tok_val == 22) {
-            state->fmt.sgr.style &= ~STL_BOLD;
-            state->fmt.sgr.style &= ~STL_BLUR;
-          } else if (tok_val == 23) {
-            state->fmt.sgr.style &= ~STL_ITALIC;
-            state->fmt.sgr.style &= ~STL_FRAKTUR;
-          } else if (tok_val == 24) {
-            state->fmt.sgr.style &= ~STL_UNDER;
-            state->fmt.sgr.style &= ~STL_UNDER2;
-          } else if (tok_val == 25) {
-            state->fmt.sgr.style &= ~STL_BLINK1;
-            state->fmt.sgr.style &= ~STL_BLINK2;
-          }
-          else if (tok_val == 27)
-            state->fmt.sgr.style &= ~STL_INVERT;
-          else if (tok_val == 28)
-            state->fmt.sgr.style &= ~STL_CONCEAL;
-          else if (tok_val == 29)
-            state->fmt.sgr.style &= ~STL_CROSSOUT;
-          else if(tok_val == 50)
-            state->fmt.sgr.style &= ~STL_PROPSPC;
-
-          // - Borders / Ideograms ---------------------------------------------
-          else if(tok_val > 50 && tok_val < 60) {
-            switch(tok_val) {
-              case 51: state->fmt.sgr.style |= BRD_FRAMED; break;
-              case 52: state->fmt.sgr.style |= BRD_ENCIRC; break;
-              case 53: state->fmt.sgr.style |= BRD_OVERLN; break;
-              case 54:
-                state->fmt.sgr.style &= ~(BRD_FRAMED | BRD_ENCIRC);
-                break;
-              case 55:
-                state->fmt.sgr.style &= ~BRD_OVERLN;
-                break;
-              default:
-                state->status = set_err(state->status, ERR_UNKNOWN_SUB);
-            }
-          } else if(tok_val >= 60 && tok_val <= 65) {
-            switch(tok_val) {
-              case 60: state->fmt.sgr.style |= IDG_UNDERL;  break;
-              case 61: state->fmt.sgr.style |= IDG_UNDERL2; break;
-              case 62: state->fmt.sgr.style |= IDG_OVERL;   break;
-              case 63: state->fmt.sgr.style |= IDG_OVERL2;  break;
-              case 64: state->fmt.sgr.style |= IDG_STRESS;  break;
-              default: // ony 65
-                state->fmt.sgr.style &= ~IDG_MASK;
-            }
-          } else {
-            state->status = set_err(state->status, ERR_UNKNOWN_SUB);
-          }
-        }
-        if(FANSI_GET_ERR(state->status) > err_code)
-          err_code = FANSI_GET_ERR(state->status);
-        if(state->string[state->pos.x] != ';') break;
-        ++state->pos.x;
-      } while(1);
-      // Consume closing char (parse_token already checked it is correct
-      if(state->string[state->pos.x]) ++state->pos.x;
+      // advances state by ref!
+      unsigned int err_csi = read_csi(state, &f);
+      if(err_csi > err_code) err_code = err_csi;
 
       // We have no way of knowning whether something could be SGR or other CSI
       // until we read the whole sequence.  If we do not support SGRs, the
@@ -866,6 +1440,7 @@ void read_esc(struct FANSI_state * state, int term_i) {
       else if((sgr && !sgr_sup) || (csi && !csi_sup)) {
         // Good sequence, but don't support it, so just read 1 char from prev
         *state = state_prev;
+        esc_fmt_restore(&f, id_prev, &fmt_prev);
         state->status &= STAT_WARNED;
         read_one(state);  // can't use read_ascii_until as this is not ascii
       }
@@ -881,8 +1456,8 @@ void read_esc(struct FANSI_state * state, int term_i) {
       state->settings & CTL_URL
     ) {
       // - OSC Encoded URL -----------------------------------------------------
-      ++state->pos.x;    // consume ']'
-      parse_url(state);  // advances state by ref!
+      ++state->pos.x;   // consume ']'
+      read_url(state, &f);  // advances state by ref!
       esc_types |= 2U;
     } else if(
       state->string[state->pos.x] == ']' &&
@@ -915,12 +1490,10 @@ void read_esc(struct FANSI_state * state, int term_i) {
       // sequences but we ignore them here.  There is also the possibility that
       // we mess up a utf-8 sequence if it starts right after the ESC, but oh
       // well...
-      if(
-        state->string[state->pos.x] >= 0x40 &&
-        state->string[state->pos.x] <= 0x7E
-      )
+      int cls = byte_class[(unsigned char) state->string[state->pos.x]];
+      if(cls == BC_FIN || cls == BC_M)
         err_code = ERR_ESC_OTHER;
-      else if((unsigned char)state->string[state->pos.x] > 0x7F)
+      else if(cls == BC_HI)
         err_code = ERR_NON_ASCII;
       else
         err_code = ERR_ESC_OTHER_BAD;
@@ -935,6 +1508,7 @@ void read_esc(struct FANSI_state * state, int term_i) {
     // Did we read mixed special and non-special escapes?
     if(esc_types == (1U | 2U)) {
       *state = state_prev;
+      esc_fmt_restore(&f, id_prev, &fmt_prev);
       break;
     }
     if(FANSI_GET_ERR(state->status) > err_code)
@@ -949,12 +1523,14 @@ void read_esc(struct FANSI_state * state, int term_i) {
       ) ) {
         if(term_i && !state->string[state->pos.x]) {
           *state = state_prev;
+          esc_fmt_restore(&f, id_prev, &fmt_prev);
           state->status |= STAT_DONE;
           break;
         } else state->status |= STAT_SPECIAL;
       }
     } else {
       *state = state_prev;
+      esc_fmt_restore(&f, id_prev, &fmt_prev);
       read_one(state);   // read one byte, can's use read_ascii_until
       break;
     }
@@ -963,6 +1539,11 @@ void read_esc(struct FANSI_state * state, int term_i) {
   );
   if(err_code > FANSI_GET_ERR(state->status))
     state->status = set_err(state->status, err_code);
+  if(f.id != FMT_ID_NA) state->fmt_id = f.id;
+  else {
+    struct FANSI_format fmt0 = FANSI_state_fmt(state);
+    if(memcmp(&f.fmt, &fmt0, sizeof(fmt0))) FANSI_state_set_fmt(state, f.fmt);
+  }
 }
 /*
  * C0 ESC sequences treated as zero width and do not count as characters either
@@ -988,7 +1569,9 @@ void read_c0(struct FANSI_state * state) {
 /*
  * Read a Series of UTF8 (and ASCII) Characters
  *
- * See GENERAL NOTES atop.
+ * See GENERAL NOTES atop.  The readers for each width mode are generated from
+ * the template in read-utf8.h, and chosen from the width mode set by
+ * `FANSI_state_init_full`.
  *
  * Hacky grapheme approximation ensures flags (RI) aren't split, sets skin
  * modifiers to width zero (so greedy / not greedy searches will / will  not
@@ -1002,101 +1585,30 @@ void read_c0(struct FANSI_state * state) {
  * @param overshoot allow overshooting of target width, if set to 0 it is
  *   critical that calling code check for the _DONE flag.  Must be 1 or 0
  */
+#define READ_UTF8_NAME read_utf8_until_chars
+#define READ_UTF8_MODE COUNT_CHARS
+#include "read-utf8.h"
+#define READ_UTF8_NAME read_utf8_until_width
+#define READ_UTF8_MODE COUNT_WIDTH
+#include "read-utf8.h"
+#define READ_UTF8_NAME read_utf8_until_graph
+#define READ_UTF8_MODE COUNT_GRAPH
+#include "read-utf8.h"
+#define READ_UTF8_NAME read_utf8_until_bytes
+#define READ_UTF8_MODE COUNT_BYTES
+#include "read-utf8.h"
+
+// Indexed by COUNT_* mode
+
+typedef void (*read_utf8_fun)(struct FANSI_state *, int, int);
+static const read_utf8_fun read_utf8_until_mode[] = {
+  read_utf8_until_chars, read_utf8_until_width,
+  read_utf8_until_graph, read_utf8_until_bytes
+};
 void read_utf8_until(struct FANSI_state * state, int until, int overshoot) {
-  char x;
-  unsigned int w_mode =
-    FANSI_GET_RNG(state->settings, SET_WIDTH, COUNT_ALL);
-  unsigned int cur_ri = state->status & STAT_RI;
-  unsigned int cur_zwj = state->status & STAT_ZWJ;
-  state->status = state->status & STAT_WARNED;
-
-  while((x = state->string[state->pos.x]) && IS_UTF8(x)) {
-    // These status are tracked in state->  because they must be retained
-    // across escape sequences.
-    unsigned int prev_zwj = cur_zwj;
-    unsigned int prev_ri = cur_ri;
-    cur_zwj = cur_ri = 0;
-    // Reset prior state info
-
-    int mb_err = 0;
-    int disp_size = 0;
-    int byte_size = utf8clen(state->string + state->pos.x, &mb_err);
-    mb_err |= !valid_utf8(state->string + state->pos.x, byte_size);
-
-    if(mb_err) {
-      // mimic what R_nchar does on mb error.  Breaks loop later.
-      disp_size = NA_INTEGER;
-    } else if(w_mode == COUNT_WIDTH || w_mode == COUNT_GRAPH) {
-      // Assumes valid UTF-8!  Should have been checked.
-      int cp = utf8_to_cp(state->string + state->pos.x, byte_size);
-
-      if(cp >= 0x1F1E6 && cp <= 0x1F1FF) {    // Regional Indicator
-        // First RI is width two, next zero.  At some point we took advantage of
-        // R's old approach of treating each of these as width one.  It's
-        // debatable what's more correct since we've seen both handlings in
-        // displays.
-        if(!(prev_ri)) {
-          cur_ri |= STAT_RI;
-          disp_size = 2;
-        } else {
-          disp_size = 0;
-        }
-        // we rely on external logic to force reading two RIs
-      } else {
-        if (cp >= 0x1F3FB && cp <= 0x1F3FF) {
-          // Skin type: these now naturally resolve to zero width in the
-          // lookup tables (different to R_nchar), so this exception moot.
-          disp_size = 0;
-        } else if (cp == 0x200D) {            // Zero Width Joiner
-          cur_zwj |= STAT_ZWJ;
-          disp_size = 0;
-        } else if (prev_zwj) {
-          disp_size = 0;
-        } else {
-          disp_size = FANSI_unicode_width(cp);
-      } }
-      if(w_mode == COUNT_GRAPH && disp_size > 1) disp_size = 1;
-    } else if(w_mode == COUNT_BYTES) {
-      disp_size = byte_size;
-    } else disp_size = 1;
-    // toggle RI
-    if(prev_ri) cur_ri = 0;
-
-    if(disp_size == NA_INTEGER) {
-      // Whether this throws an error depends on what ->settings is.
-      state->status = set_err(state->status, ERR_BAD_UTF8);
-      disp_size = byte_size = 1;
-    }
-    int total_width = state->pos.w + disp_size;
-    if(total_width > until && !overshoot) {
-      state->status |= STAT_DONE;
-      break;
-    } else {
-      // We allow one overshoot if necessary and requested
-      if(total_width == until) overshoot = 0;
-      else if(total_width > until && overshoot) {
-        state->status |= STAT_OVERSHOT;
-        until = total_width;
-        overshoot = 0;
-      }
-      state->pos.x += byte_size;
-      state->utf8 = state->pos.x;  // record after so no ambiguity about 0
-      state->status &= cur_ri | ~STAT_RI;
-      state->status &= cur_zwj | ~STAT_ZWJ;;
-      // This could possibly overflow if byte_size >> 2 (e.g. if at some point
-      // width reports the \U escape codes.
-      if(state->pos.w > FANSI_lim.lim_int.max - disp_size)
-        error("Internal Error:  width greater than INT_MAX"); // nocov
-
-      // Don't count width of things following ZWJ
-      int w_or_g = w_mode == COUNT_WIDTH || w_mode == COUNT_GRAPH;
-      if(!prev_zwj || !w_or_g) {
-        state->pos.w += disp_size;
-      }
-    }
-    // Always break for error reporting
-    if(mb_err) break;
-  }
+  read_utf8_until_mode[FANSI_GET_RNG(state->settings, SET_WIDTH, COUNT_ALL)](
+    state, until, overshoot
+  );
 }
 /*
  * Read a Character Off and Update State
@@ -1124,6 +1636,27 @@ void FANSI_read_next(
   // Trigger errors / warnings if warranted
   alert(state, i, arg);
 }
+/*
+ * Read One Chunk
+ *
+ * Same as one iteration of the basic read loop in `FANSI_read_until`, except no
+ * warnings or errors are issued.  The caller should check the error code in
+ * `state->status`.  The state at the end of each chunk is one
+ * `FANSI_read_until` also passes through (see index.c).
+ *
+ * @param until width limit for runs of ASCII, which can be split anywhere.
+ *   Other runs are read in full as splitting e.g. UTF-8 runs could change how
+ *   the characters either side of the split are measured.
+ */
+void FANSI_read_chunk(struct FANSI_state * state, int until) {
+  char x = state->string[state->pos.x];
+  state->status = state->status & (STAT_PERSIST);
+
+  if(IS_PRINT(x)) read_ascii_until(state, until, 1);
+  else if(IS_UTF8(x)) read_utf8_until(state, FANSI_lim.lim_int.max, 0);
+  else if(IS_ESC(x)) read_esc(state, 0);
+  else if(x) read_c0(state);
+}
 /*
  * Consume bytes until a certain width is met.
  *
@@ -1153,6 +1686,8 @@ void FANSI_read_until(
   int mode, R_xlen_t i, const char * arg
 ) {
   char x;
+  read_utf8_fun read_utf8 =
+    read_utf8_until_mode[FANSI_GET_RNG(state->settings, SET_WIDTH, COUNT_ALL)];
   // - Basic Read --------------------------------------------------------------
 
   state->status = state->status & STAT_WARNED;
@@ -1165,13 +1700,14 @@ void FANSI_read_until(
     state->status = state->status & (STAT_PERSIST);
 
     if(IS_PRINT(x)) read_ascii_until(state, until, 1);
-    else if(IS_UTF8(x)) read_utf8_until(state, until, overshoot);
+    else if(IS_UTF8(x)) read_utf8(state, until, overshoot);
     else if(IS_ESC(x)) read_esc(state, term_i);
     else if(x) read_c0(state);        // C0 escapes (e.g. \t, \n, etc)
 
     // Trigger errors / warnings if warranted
     alert(state, i, arg);
-    if(FANSI_GET_ERR(state->status) == ERR_BAD_UTF8) goto EXIT;
+    // `state_tmp` below is not yet set, so don't jump to EXIT
+    if(FANSI_GET_ERR(state->status) == ERR_BAD_UTF8) return;
   }
   // - Trail Read --------------------------------------------------------------
 
@@ -1196,7 +1732,7 @@ void FANSI_read_until(
     // If a special, save the prior point if in terminate mode
     if(IS_UTF8(x)) {
       int pos_prev = state_tmp.pos.x;
-      read_utf8_until(&state_tmp, until, overshoot);
+      read_utf8(&state_tmp, until, overshoot);
       // Next one was not zero width, so UTF8 cannot be advanced
       if(state_tmp.pos.x == pos_prev) break;
       // There was a zero width, so advance
@@ -1223,3 +1759,25 @@ void FANSI_read_all(struct FANSI_state * state, R_xlen_t i, const char * arg) {
   int mode = 1;
   FANSI_read_until(state, until, overshoot, term_i, mode, i, arg);
 }
+/*
+ * Whether a string can be read without R or shared state
+ *
+ * Printable ASCII, newlines, and valid UTF-8 are read without the escape cache
+ * or the format table, and cannot produce errors or warnings (which need R to
+ * be signaled), so strings made up only of those can be read off the main
+ * thread (see wrap.c).
+ */
+int FANSI_read_plain(const char * x, int len) {
+  const char * end = x + len;
+  while(*x) {
+    int cp;
+    x += FANSI_scan_print(x, (int)(end - x));
+    if(*x == '\n') ++x;
+    else if(IS_UTF8(*x)) {
+      int bytes = utf8_decode(x, &cp);
+      if(!bytes) return 0;
+      x += bytes;
+    } else if(*x) return 0;
+  }
+  return 1;
+}
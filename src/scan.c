@@ -0,0 +1,265 @@
+/*
+ * Copyright (C) Brodie Gaslam
+ *
+ * This file is part of "fansi - ANSI Control Sequence Aware String Functions"
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Go to <https://www.r-project.org/Licenses> for a copies of the licenses.
+ */
+
+#include "fansi.h"
+
+/*
+ * Byte Scanners
+ *
+ * Most strings are overwhelmingly plain ASCII, so the bulk of the time spent
+ * reading them is spent looking for the next byte that is not plain ASCII.
+ * These functions find the length of such runs, 16 or 32 bytes at a time where
+ * the hardware allows it, falling back to a byte by byte scan otherwise.
+ *
+ * There are two byte classes of interest:
+ *
+ * * "print": 0x20-0x7E, i.e. anything that is not a C0 control (including ESC
+ *   and the NUL terminator), DEL, or a UTF-8 byte.  This is what
+ *   `read_ascii_until` consumes in one go.
+ * * "noctl": anything that is not a C0 control or DEL, so UTF-8 bytes do NOT
+ *   interrupt the run.  This is what `FANSI_seek_ctl` skips.
+ * * "utf8": 0x80-0xFF, i.e. bytes that are part of multi-byte UTF-8 sequences
+ *   (or are invalid).  Used by `read_utf8_until` to find how many bytes it can
+ *   safely examine in bulk.
+ *
+ * All scans stop at the NUL terminator, and at most `max` bytes in.  `max`
+ * must not exceed the bytes left before the terminator (see `len` in
+ * `FANSI_state`), as vector loads are unaligned and only made for whole blocks
+ * within `max`; the remaining tail is scanned byte by byte.  This way no
+ * bytes outside of the string are ever read.
+ *
+ * SSE2 is the baseline on x86_64 so it is used unconditionally there.  AVX2 is
+ * chosen at load time if the CPU supports it (see `FANSI_scan_init`).
+ */
+
+#if defined(__GNUC__) && defined(__SSE2__) && \
+  (defined(__x86_64__) || defined(__i386__))
+#define HAVE_SSE2 1
+#include <emmintrin.h>
+#if (defined(__clang__) || __GNUC__ >= 5) && !defined(FANSI_NO_AVX2)
+#define HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+#endif
+
+// Mode in use, see SCAN_* in fansi-cnst.h
+static int scan_mode = SCAN_SCALAR;
+
+// - Scalar -------------------------------------------------------------------
+
+static int is_noctl(const char x) {
+  // Controls range from 0000 0001 (0x01) to 0001 1111 (0x1F), plus 0x7F;
+  // We don't treat C1 (C1, not C0) controls as specials, apparently
+  return x && !(!(x & (~0x1F)) || x == 0x7F);
+}
+static intmax_t scan_print_scalar(const char * x, intmax_t max) {
+  const char * x0 = x;
+  while(IS_PRINT(*x) && (x - x0) < max) ++x;
+  return x - x0;
+}
+static intmax_t scan_noctl_scalar(const char * x, intmax_t max) {
+  const char * x0 = x;
+  while(is_noctl(*x) && (x - x0) < max) ++x;
+  return x - x0;
+}
+static intmax_t scan_utf8_scalar(const char * x, intmax_t max) {
+  const char * x0 = x;
+  while(IS_UTF8(*x) && (x - x0) < max) ++x;
+  return x - x0;
+}
+
+// - SSE2 ---------------------------------------------------------------------
+
+#ifdef HAVE_SSE2
+
+// Bits set for bytes that are not 0x20-0x7E.  Signed comparison folds the
+// >= 0x80 bytes in with the C0 ones.
+static unsigned int stop_print_sse2(__m128i v) {
+  __m128i c0 = _mm_cmplt_epi8(v, _mm_set1_epi8(0x20));
+  __m128i del = _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7F));
+  return (unsigned int) _mm_movemask_epi8(_mm_or_si128(c0, del));
+}
+// Bits set for bytes that are 0x00-0x1F or 0x7F.
+static unsigned int stop_noctl_sse2(__m128i v) {
+  __m128i c0 = _mm_cmpeq_epi8(_mm_min_epu8(v, _mm_set1_epi8(0x1F)), v);
+  __m128i del = _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7F));
+  return (unsigned int) _mm_movemask_epi8(_mm_or_si128(c0, del));
+}
+// Bits set for bytes that are 0x00-0x7F.
+static unsigned int stop_utf8_sse2(__m128i v) {
+  return ~(unsigned int) _mm_movemask_epi8(v) & 0xFFFFU;
+}
+#define FANSI_SCAN_BODY(TYPE, WIDTH, LOAD, STOP, TAIL)                    \
+  intmax_t n = 0;                                                         \
+  while(max - n >= WIDTH) {                                               \
+    unsigned int m = STOP(LOAD((const TYPE *) (x + n)));                  \
+    if(m) return n + __builtin_ctz(m);                                    \
+    n += WIDTH;                                                           \
+  }                                                                       \
+  return n + TAIL(x + n, max - n);
+
+static intmax_t scan_print_sse2(const char * x, intmax_t max) {
+  FANSI_SCAN_BODY(
+    __m128i, 16, _mm_loadu_si128, stop_print_sse2, scan_print_scalar
+  )
+}
+static intmax_t scan_noctl_sse2(const char * x, intmax_t max) {
+  FANSI_SCAN_BODY(
+    __m128i, 16, _mm_loadu_si128, stop_noctl_sse2, scan_noctl_scalar
+  )
+}
+static intmax_t scan_utf8_sse2(const char * x, intmax_t max) {
+  FANSI_SCAN_BODY(
+    __m128i, 16, _mm_loadu_si128, stop_utf8_sse2, scan_utf8_scalar
+  )
+}
+#endif
+
+// - AVX2 ---------------------------------------------------------------------
+
+#ifdef HAVE_AVX2
+
+__attribute__((target("avx2")))
+static unsigned int stop_print_avx2(__m256i v) {
+  __m256i c0 = _mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), v);
+  __m256i del = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7F));
+  return (unsigned int) _mm256_movemask_epi8(_mm256_or_si256(c0, del));
+}
+__attribute__((target("avx2")))
+static unsigned int stop_noctl_avx2(__m256i v) {
+  __m256i c0 =
+    _mm256_cmpeq_epi8(_mm256_min_epu8(v, _mm256_set1_epi8(0x1F)), v);
+  __m256i del = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7F));
+  return (unsigned int) _mm256_movemask_epi8(_mm256_or_si256(c0, del));
+}
+__attribute__((target("avx2")))
+static unsigned int stop_utf8_avx2(__m256i v) {
+  return ~(unsigned int) _mm256_movemask_epi8(v);
+}
+__attribute__((target("avx2")))
+static intmax_t scan_print_avx2(const char * x, intmax_t max) {
+  FANSI_SCAN_BODY(
+    __m256i, 32, _mm256_loadu_si256, stop_print_avx2, scan_print_scalar
+  )
+}
+__attribute__((target("avx2")))
+static intmax_t scan_noctl_avx2(const char * x, intmax_t max) {
+  FANSI_SCAN_BODY(
+    __m256i, 32, _mm256_loadu_si256, stop_noctl_avx2, scan_noctl_scalar
+  )
+}
+__attribute__((target("avx2")))
+static intmax_t scan_utf8_avx2(const char * x, intmax_t max) {
+  FANSI_SCAN_BODY(
+    __m256i, 32, _mm256_loadu_si256, stop_utf8_avx2, scan_utf8_scalar
+  )
+}
+#endif
+
+// - Interface ----------------------------------------------------------------
+
+/*
+ * Length of run of 0x20-0x7E bytes starting at `x`, at most `max`.
+ */
+int FANSI_scan_print(const char * x, int max) {
+  if(max <= 0) return 0;
+  switch(scan_mode) {
+#ifdef HAVE_AVX2
+    case SCAN_AVX2: return (int) scan_print_avx2(x, max);
+#endif
+#ifdef HAVE_SSE2
+    case SCAN_SSE2: return (int) scan_print_sse2(x, max);
+#endif
+    default: return (int) scan_print_scalar(x, max);
+  }
+}
+/*
+ * As `FANSI_scan_print`, from the current position of `state`.
+ */
+int FANSI_scan_print_state(const struct FANSI_state * state, int max) {
+  int left = state->len - state->pos.x;
+  return FANSI_scan_print(
+    state->string + state->pos.x, max < left ? max : left
+  );
+}
+/*
+ * Length of run of bytes that are neither C0 controls nor DEL, at most `max`.
+ *
+ * Unlike `FANSI_scan_print` UTF-8 bytes do not end the run.
+ */
+intmax_t FANSI_scan_noctl(const char * x, intmax_t max) {
+  if(max <= 0) return 0;
+  switch(scan_mode) {
+#ifdef HAVE_AVX2
+    case SCAN_AVX2: return scan_noctl_avx2(x, max);
+#endif
+#ifdef HAVE_SSE2
+    case SCAN_SSE2: return scan_noctl_sse2(x, max);
+#endif
+    default: return scan_noctl_scalar(x, max);
+  }
+}
+/*
+ * Length of run of 0x80-0xFF bytes starting at `x`, at most `max`.
+ */
+int FANSI_scan_utf8(const char * x, int max) {
+  if(max <= 0) return 0;
+  switch(scan_mode) {
+#ifdef HAVE_AVX2
+    case SCAN_AVX2: return (int) scan_utf8_avx2(x, max);
+#endif
+#ifdef HAVE_SSE2
+    case SCAN_SSE2: return (int) scan_utf8_sse2(x, max);
+#endif
+    default: return (int) scan_utf8_scalar(x, max);
+  }
+}
+/*
+ * Pick the best scanner available, called on package load.
+ */
+void FANSI_scan_init(void) {
+  scan_mode = SCAN_SCALAR;
+#ifdef HAVE_SSE2
+  scan_mode = SCAN_SSE2;
+#endif
+#ifdef HAVE_AVX2
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx2")) scan_mode = SCAN_AVX2;
+#endif
+}
+/*
+ * For testing, set the scanner mode to use.
+ *
+ * Modes not available fall back to the best one available that is lower
+ * (scalar is always available).  NA just reports the current mode.
+ *
+ * @param x scalar integer, see SCAN_* in fansi-cnst.h
+ * @return the mode in use prior to the call.
+ */
+SEXP FANSI_set_scan_mode(SEXP x) {
+  if(TYPEOF(x) != INTSXP || XLENGTH(x) != 1)
+    error("Internal Error: `x` must be a scalar integer.");  // nocov
+  int prev = scan_mode;
+  int mode = asInteger(x);
+  if(mode != NA_INTEGER) {
+    if(mode < SCAN_SCALAR || mode > SCAN_AVX2)
+      error("Internal Error: invalid scan mode.");  // nocov
+    FANSI_scan_init();
+    if(mode < scan_mode) scan_mode = mode;
+  }
+  return ScalarInteger(prev);
+}
@@ -0,0 +1,232 @@
+/*
+ * Copyright (C) Brodie Gaslam
+ *
+ * This file is part of "fansi - ANSI Control Sequence Aware String Functions"
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Go to <https://www.r-project.org/Licenses> for a copies of the licenses.
+ */
+
+#include "fansi.h"
+
+/*
+ * Width Checkpoints for Long Strings
+ *
+ * Reading up to a position in a string is linear in the position, so taking
+ * many substrings of the same long string is quadratic overall.  To avoid this
+ * we record a snapshot of the read state every SEEK_STEP width units for long
+ * strings that are read more than once, and resume reading from the last
+ * snapshot before the target position.
+ *
+ * Snapshots are taken at points `FANSI_read_until` also passes through (see
+ * `FANSI_read_chunk`), and strings that would produce warnings or errors are
+ * not checkpointed as we cannot resume past the point where those would be
+ * emitted.  Together this ensures results are identical to a full read.
+ *
+ * Snapshots record the format by value rather than as an id as they may
+ * outlive the format table of the state they were taken from (see state.c),
+ * with the URL pointing into the string.
+ *
+ * Checkpoints are kept in a small cache keyed on the CHARSXP and the read
+ * settings.  The first time a string is seen it is only noted, and its
+ * checkpoints are built the next time it is seen.  The CHARSXPs are kept alive
+ * by the cache so that their addresses cannot be reused by other strings.  By
+ * default the cache is cleared with each call, but it can be kept for the
+ * whole session or turned off with `FANSI_seek_cache`.
+ */
+#define SEEK_CACHE_SIZE     8  // strings
+#define SEEK_STEP        2048  // width between checkpoints
+#define SEEK_MIN_BYTES  16384  // shortest string checkpointed
+
+struct seek_cp {
+  struct FANSI_state state;
+  struct FANSI_format fmt;
+};
+struct seek_cache_entry {
+  SEXP chr;
+  unsigned int settings;
+  int n;                              // checkpoints, -1 if not yet built
+  const struct seek_cp * cp;
+};
+static struct seek_cache_entry seek_cache[SEEK_CACHE_SIZE];
+static SEXP seek_cache_prot;          // keeps the CHARSXPs and checkpoints
+static int seek_cache_next_i;         // next entry to evict
+static int seek_cache_mode = SEEK_CACHE_CALL;
+static double seek_cache_hits, seek_cache_misses;
+
+static void seek_cache_clear(void) {
+  for(int j = 0; j < SEEK_CACHE_SIZE; ++j)
+    seek_cache[j] = (struct seek_cache_entry) {.chr = R_NilValue, .n = -1};
+  if(seek_cache_prot)
+    for(R_xlen_t j = 0; j < XLENGTH(seek_cache_prot); ++j)
+      SET_VECTOR_ELT(seek_cache_prot, j, R_NilValue);
+  seek_cache_next_i = 0;
+}
+/*
+ * Drop cached checkpoints if caching per call.
+ *
+ * Called at the beginning and end of each call that seeks, so that the long
+ * strings are not kept alive past the call.
+ */
+void FANSI_seek_cache_next(void) {
+  if(seek_cache_mode == SEEK_CACHE_CALL) seek_cache_clear();
+}
+/*
+ * Record checkpoints for `state->string`
+ *
+ * @param state at the beginning of the string, with no format.
+ * @param j slot in `seek_cache_prot` to store checkpoints in.
+ * @return the number of checkpoints, 0 if the string cannot be checkpointed.
+ */
+static int seek_build(struct FANSI_state state, R_xlen_t j) {
+  // Width in the COUNT_* modes used for seeking can't exceed bytes
+  R_xlen_t n_max = (R_xlen_t)(state.len / SEEK_STEP) + 1;
+  SEXP cp_sxp = PROTECT(allocVector(RAWSXP, n_max * sizeof(struct seek_cp)));
+  struct seek_cp * cp = (struct seek_cp *) RAW(cp_sxp);
+  int n = 0;
+  int next = SEEK_STEP;
+  struct FANSI_url url_last = {0};
+
+  while(state.string[state.pos.x]) {
+    FANSI_read_chunk(&state, next);
+    unsigned int err = FANSI_GET_ERR(state.status);
+    if(
+      err == ERR_BAD_UTF8 ||
+      (err && (state.settings & (1U << (SET_WARN + err - 1U))))
+    ) {
+      n = 0;
+      break;
+    }
+    // Checkpoints at the very end are not resumable (see index.c)
+    if(state.pos.w >= next && state.string[state.pos.x]) {
+      if(n >= n_max)
+        error("Internal Error: too many seek checkpoints.");  // nocov
+      struct FANSI_format fmt = FANSI_state_fmt(&state);
+      FANSI_url_rebase(&fmt.url, &state, &url_last);
+      cp[n++] = (struct seek_cp) {.state=state, .fmt=fmt};
+      next = state.pos.w > FANSI_lim.lim_int.max - SEEK_STEP ?
+        FANSI_lim.lim_int.max : state.pos.w + SEEK_STEP;
+  } }
+  SET_VECTOR_ELT(seek_cache_prot, j, n ? cp_sxp : R_NilValue);
+  UNPROTECT(1);
+  return n;
+}
+/*
+ * Advance State to the Last Checkpoint Before `until`
+ *
+ * Like `FANSI_index_seek`, but for the string in CHARSXP `chr`, with the
+ * checkpoints built on demand.
+ *
+ * @param state at the beginning of `chr`, with no format.  Advanced to the
+ *   last checkpoint with width less than `until`, if any.
+ * @return whether the state was advanced.
+ */
+int FANSI_seek(struct FANSI_state * state, SEXP chr, int until) {
+  if(
+    seek_cache_mode == SEEK_CACHE_OFF || until <= SEEK_STEP ||
+    TYPEOF(chr) != CHARSXP || LENGTH(chr) < SEEK_MIN_BYTES ||
+    state->string != CHAR(chr) ||
+    state->pos.x || state->pos.w || state->fmt_id
+  )
+    return 0;
+
+  if(!seek_cache_prot) {
+    seek_cache_prot = allocVector(VECSXP, 2 * SEEK_CACHE_SIZE);
+    R_PreserveObject(seek_cache_prot);
+    seek_cache_clear();
+  }
+  int j;
+  for(j = 0; j < SEEK_CACHE_SIZE; ++j)
+    if(seek_cache[j].chr == chr && seek_cache[j].settings == state->settings)
+      break;
+
+  if(j == SEEK_CACHE_SIZE) {
+    // First time seen, note it and read as usual
+    j = seek_cache_next_i;
+    seek_cache_next_i = (seek_cache_next_i + 1) % SEEK_CACHE_SIZE;
+    SET_VECTOR_ELT(seek_cache_prot, 2 * j, chr);
+    SET_VECTOR_ELT(seek_cache_prot, 2 * j + 1, R_NilValue);
+    seek_cache[j] = (struct seek_cache_entry) {
+      .chr = chr, .settings = state->settings, .n = -1
+    };
+    ++seek_cache_misses;
+    return 0;
+  }
+  struct seek_cache_entry * e = seek_cache + j;
+  if(e->n < 0) {
+    struct FANSI_state state_tmp = *state;
+    state_tmp.status = 0;
+    e->n = seek_build(state_tmp, 2 * j + 1);
+    e->cp = e->n ?
+      (const struct seek_cp *) RAW(VECTOR_ELT(seek_cache_prot, 2 * j + 1)) :
+      NULL;
+  }
+  // Widths are increasing, find first checkpoint with w >= until
+  int lo = 0, hi = e->n;
+  while(lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if(e->cp[mid].state.pos.w < until) lo = mid + 1;
+    else hi = mid;
+  }
+  if(!lo) {
+    ++seek_cache_misses;
+    return 0;
+  }
+  unsigned int status = state->status;
+  struct FANSI_fmt_tab * tab = state->tab;
+  *state = e->cp[lo - 1].state;
+  state->status = status & STAT_WARNED;
+  state->tab = tab;
+  state->fmt_id = 0;
+  FANSI_state_set_fmt(state, e->cp[lo - 1].fmt);
+  ++seek_cache_hits;
+  return 1;
+}
+/*
+ * Set the seek checkpoint cache mode and report on the cache
+ *
+ * @param mode scalar integer, see SEEK_CACHE_* in fansi-cnst.h, NA to leave
+ *   unchanged.
+ * @param reset TRUE to clear the cache and zero the counters.
+ * @return the mode in use prior to the call, and the number of seeks that
+ *   used and did not use checkpoints since the last reset (prior to any reset
+ *   by this call).
+ */
+SEXP FANSI_seek_cache(SEXP mode, SEXP reset) {
+  if(TYPEOF(mode) != INTSXP || XLENGTH(mode) != 1)
+    error("Internal Error: `mode` must be a scalar integer.");  // nocov
+  if(!FANSI_is_tf(reset))
+    error("Internal Error: `reset` must be TRUE or FALSE.");  // nocov
+
+  SEXP res = PROTECT(allocVector(REALSXP, 3));
+  SEXP res_names = PROTECT(allocVector(STRSXP, 3));
+  REAL(res)[0] = seek_cache_mode;
+  REAL(res)[1] = seek_cache_hits;
+  REAL(res)[2] = seek_cache_misses;
+  SET_STRING_ELT(res_names, 0, mkChar("mode"));
+  SET_STRING_ELT(res_names, 1, mkChar("hits"));
+  SET_STRING_ELT(res_names, 2, mkChar("misses"));
+  setAttrib(res, R_NamesSymbol, res_names);
+
+  int mode_int = asInteger(mode);
+  if(mode_int != NA_INTEGER) {
+    if(mode_int < SEEK_CACHE_OFF || mode_int > SEEK_CACHE_SESSION)
+      error("Internal Error: invalid seek cache mode.");  // nocov
+    if(mode_int != seek_cache_mode) seek_cache_clear();
+    seek_cache_mode = mode_int;
+  }
+  if(asLogical(reset)) {
+    seek_cache_clear();
+    seek_cache_hits = seek_cache_misses = 0;
+  }
+  UNPROTECT(2);
+  return res;
+}
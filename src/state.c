@@ -25,6 +25,12 @@
  * FANSI_state_init_full is specifically to handle the allowNA case in nchar,
  * for which we MUST check FANSI_GET_ERR(state.status) after each
  * `FANSI_read_next`.
+ *
+ * The format table of the state is returned unprotected (see
+ * `FANSI_fmt_tab_new`).  Callers own it and must `PROTECT(state.tab->mem)`
+ * before they allocate anything else, for as long as they use the state or
+ * any state copied from it.  This is also true of the functions that wrap this
+ * one.
  */
 struct FANSI_state FANSI_state_init_full(
   SEXP strsxp, SEXP warn, SEXP term_cap, SEXP allowNA, SEXP keepNA,
@@ -104,9 +110,14 @@ struct FANSI_state FANSI_state_init_full(
   settings |= asLogical(keepNA) ? SET_KEEPNA : 0;
   settings |= (unsigned int) warn_int;
 
+  // Normally a new call, so new parsed escape cache generation (see read.c)
+  FANSI_esc_cache_next();
+
   // All others struct-inited to zero.
   return (struct FANSI_state) {
     .string = string,
+    .len = LENGTH(chrsxp),
+    .tab = FANSI_fmt_tab_new(),
     .settings = settings
   };
 }
@@ -130,6 +141,7 @@ void FANSI_state_reinit(
   FANSI_check_chrsxp(chrsxp, i);
   const char * string = CHAR(chrsxp);
   state->string = string;
+  state->len = LENGTH(chrsxp);
   FANSI_reset_state(state);
 }
 // We don't care about unicode width here, but do care about CSI / SGR (which
@@ -204,11 +216,289 @@ void FANSI_reset_pos(struct FANSI_state * state) {
  * consistency with others.
  */
 void FANSI_reset_state(struct FANSI_state * state) {
-  state->fmt = (struct FANSI_format){0};
+  state->fmt_id = 0;
   state->pos = (struct FANSI_position){0};
   state->status = 0U;
   state->utf8 = 0;
 }
+/*
+ * Format Table
+ *
+ * Formats (SGR and URL) are recorded once per table in a hash table, and
+ * states only hold the id.  This keeps states small, and lets equal formats be
+ * detected by comparing ids, provided the states share a table.
+ *
+ * Formats are normalized before they are recorded so that formats that are
+ * equivalent for all purposes get the same id:
+ *
+ * * Unused color channels are zeroed (these are not reset when a color is
+ *   changed to one that does not use them).
+ * * Closed URLs (i.e. with no URL and no id) are zeroed.
+ *
+ * URLs are keyed by content, and the table keeps its own copy of the URL and
+ * id of each format it records.  So a URL repeated across the elements of a
+ * vector is recorded once, and formats from the table remain valid for as long
+ * as the table even if the string they were read from is not.  The flip side
+ * is that formats from the table do not point into the string of the state
+ * (see `FANSI_url_rebase`).
+ *
+ * Table memory is from R rather than `R_alloc` so that tables may grow after
+ * a `FANSI_buff` is allocated without preventing its release (see write.c),
+ * and so that memory outgrown is reclaimed by the GC.  `FANSI_fmt_tab_new`
+ * returns the table unprotected, and it is up to the caller to PROTECT
+ * `tab->mem`.
+ */
+#define FMT_TAB_INIT 16     // must be a power of two
+#define FMT_TAB_URL 4096    // bytes of URL memory allocated at a time
+
+#define FMT_MEM_TAB  0
+#define FMT_MEM_FMT  1
+#define FMT_MEM_STEP 2
+#define FMT_MEM_URL  3
+#define FMT_MEM_SIZE 4
+
+// Allocate `fmt` and `slot` for `alloc` formats, and clear `slot`.
+
+static void fmt_tab_alloc(struct FANSI_fmt_tab * tab, unsigned int alloc) {
+  SEXP mem = allocVector(
+    RAWSXP,
+    (R_xlen_t) alloc * (sizeof(*tab->fmt) + 2 * sizeof(*tab->slot))
+  );
+  SET_VECTOR_ELT(tab->mem, FMT_MEM_FMT, mem);
+  tab->fmt = (struct FANSI_format *) RAW(mem);
+  tab->slot = (unsigned int *) (tab->fmt + alloc);
+  memset(tab->slot, 0, 2 * (size_t) alloc * sizeof(*tab->slot));
+  tab->alloc = alloc;
+}
+struct FANSI_fmt_tab * FANSI_fmt_tab_new(void) {
+  SEXP mem = PROTECT(allocVector(VECSXP, FMT_MEM_SIZE));
+  SEXP tab_sxp = allocVector(RAWSXP, sizeof(struct FANSI_fmt_tab));
+  SET_VECTOR_ELT(mem, FMT_MEM_TAB, tab_sxp);
+  struct FANSI_fmt_tab * tab = (struct FANSI_fmt_tab *) RAW(tab_sxp);
+  *tab = (struct FANSI_fmt_tab) {.mem = mem};
+  fmt_tab_alloc(tab, FMT_TAB_INIT);
+  tab->fmt[0] = (struct FANSI_format) {0};
+  tab->n = 1;
+  UNPROTECT(1);
+  return tab;
+}
+static void color_norm(struct FANSI_color * color) {
+  if(!(color->x & (CLR_256 | CLR_TRU)))
+    memset(color->extra, 0, sizeof(color->extra));
+  else if(!(color->x & CLR_TRU))
+    color->extra[1] = color->extra[2] = 0;
+}
+static struct FANSI_format fmt_norm(struct FANSI_format fmt) {
+  color_norm(&fmt.sgr.color);
+  color_norm(&fmt.sgr.bgcol);
+  if(!URL_LEN(fmt.url) && !ID_LEN(fmt.url)) fmt.url = (struct FANSI_url) {0};
+  return fmt;
+}
+// Formats must be normalized, and we compare fields to avoid padding.
+
+static int fmt_same(struct FANSI_format * a, struct FANSI_format * b) {
+  return
+    a->sgr.style == b->sgr.style &&
+    a->sgr.color.x == b->sgr.color.x && a->sgr.bgcol.x == b->sgr.bgcol.x &&
+    !memcmp(a->sgr.color.extra, b->sgr.color.extra, 3) &&
+    !memcmp(a->sgr.bgcol.extra, b->sgr.bgcol.extra, 3) &&
+    a->url.url.len == b->url.url.len && a->url.id.len == b->url.id.len && (
+      !a->url.string || (
+        !memcmp(
+          a->url.string + a->url.url.start, b->url.string + b->url.url.start,
+          a->url.url.len
+        ) &&
+        !memcmp(
+          a->url.string + a->url.id.start, b->url.string + b->url.id.start,
+          a->url.id.len
+    ) ) );
+}
+static uint64_t url_hash(const char * x, unsigned int len) {
+  uint64_t h = len;
+  for(unsigned int k = 0; k < len; ++k)
+    h = (h ^ (unsigned char) x[k]) * 0x100000001B3ULL;
+  return h;
+}
+static unsigned int fmt_hash(struct FANSI_format * f) {
+  uint64_t color = f->sgr.color.x | (uint64_t) f->sgr.color.extra[0] << 8 |
+    (uint64_t) f->sgr.color.extra[1] << 16 |
+    (uint64_t) f->sgr.color.extra[2] << 24;
+  uint64_t bgcol = f->sgr.bgcol.x | (uint64_t) f->sgr.bgcol.extra[0] << 8 |
+    (uint64_t) f->sgr.bgcol.extra[1] << 16 |
+    (uint64_t) f->sgr.bgcol.extra[2] << 24;
+  uint64_t v[4] = {(uint64_t) f->sgr.style << 32 | color, bgcol, 0, 0};
+  if(f->url.string) {
+    v[2] = url_hash(f->url.string + f->url.url.start, f->url.url.len);
+    v[3] = url_hash(f->url.string + f->url.id.start, f->url.id.len);
+  }
+  uint64_t h = 0;
+  for(int k = 0; k < 4; ++k) {
+    h = (h ^ v[k]) * 0x9E3779B97F4A7C15ULL;
+    h ^= h >> 29;
+  }
+  return (unsigned int) (h >> 32);
+}
+static void fmt_tab_grow(struct FANSI_fmt_tab * tab) {
+  if(tab->alloc > (unsigned int) FANSI_lim.lim_int.max / 4)
+    error("Internal Error: too many distinct formats.");  // nocov
+  // The old memory is only dropped once the new one is allocated, and nothing
+  // else allocates until we are done copying from it.
+  struct FANSI_format * fmt = tab->fmt;
+  fmt_tab_alloc(tab, tab->alloc * 2);
+  memcpy(tab->fmt, fmt, tab->n * sizeof(*fmt));
+  for(unsigned int id = 1; id < tab->n; ++id) {
+    unsigned int h = fmt_hash(tab->fmt + id) & (2 * tab->alloc - 1);
+    while(tab->slot[h]) h = (h + 1) & (2 * tab->alloc - 1);
+    tab->slot[h] = id;
+  }
+}
+/*
+ * Copy the URL and id of a format into the table's memory.
+ *
+ * Offsets of zero mean no URL or id (see parse_url), so copies start at the
+ * second byte.
+ */
+static struct FANSI_url url_own(
+  struct FANSI_fmt_tab * tab, struct FANSI_url url
+) {
+  if(!url.string) return url;
+  int need = 1 + url.id.len + url.url.len;
+  if(tab->url_left < need) {
+    SEXP list = VECTOR_ELT(tab->mem, FMT_MEM_URL);
+    if(list == R_NilValue || tab->url_n == XLENGTH(list)) {
+      R_xlen_t n = list == R_NilValue ? 4 : 2 * XLENGTH(list);
+      SEXP tmp = PROTECT(allocVector(VECSXP, n));
+      for(int k = 0; k < tab->url_n; ++k)
+        SET_VECTOR_ELT(tmp, k, VECTOR_ELT(list, k));
+      SET_VECTOR_ELT(tab->mem, FMT_MEM_URL, tmp);
+      UNPROTECT(1);
+      list = tmp;
+    }
+    int size = need > FMT_TAB_URL ? need : FMT_TAB_URL;
+    SEXP chunk = allocVector(RAWSXP, size);
+    SET_VECTOR_ELT(list, tab->url_n++, chunk);
+    tab->url = (char *) RAW(chunk);
+    tab->url_left = size;
+  }
+  struct FANSI_url res = {.string = tab->url};
+  if(url.id.len) {
+    memcpy(tab->url + 1, url.string + url.id.start, url.id.len);
+    res.id = (struct FANSI_offset) {1, url.id.len};
+  }
+  if(url.url.len) {
+    memcpy(
+      tab->url + 1 + url.id.len, url.string + url.url.start, url.url.len
+    );
+    res.url = (struct FANSI_offset) {1 + url.id.len, url.url.len};
+  }
+  tab->url += need;
+  tab->url_left -= need;
+  return res;
+}
+/*
+ * Record a format in the table, if not already there.
+ *
+ * @param fmt a normalized format.
+ * @return the id of the format.
+ */
+static unsigned int fmt_intern(
+  struct FANSI_fmt_tab * tab, struct FANSI_format * fmt
+) {
+  unsigned int mask = 2 * tab->alloc - 1;
+  unsigned int h = fmt_hash(fmt) & mask;
+  while(tab->slot[h]) {
+    if(fmt_same(tab->fmt + tab->slot[h], fmt)) return tab->slot[h];
+    h = (h + 1) & mask;
+  }
+  struct FANSI_format own = {.url = url_own(tab, fmt->url), .sgr = fmt->sgr};
+  if(tab->n == tab->alloc) {
+    fmt_tab_grow(tab);
+    mask = 2 * tab->alloc - 1;
+    h = fmt_hash(&own) & mask;
+    while(tab->slot[h]) h = (h + 1) & mask;
+  }
+  unsigned int id = tab->n++;
+  tab->fmt[id] = own;
+  tab->slot[h] = id;
+  return id;
+}
+// Id of a format, recording it if needed
+
+static unsigned int fmt_id(
+  struct FANSI_fmt_tab * tab, struct FANSI_format fmt
+) {
+  struct FANSI_format fmt0 = {0};
+  fmt = fmt_norm(fmt);
+  return fmt_same(&fmt, &fmt0) ? 0 : fmt_intern(tab, &fmt);
+}
+/*
+ * Id of a format reached by applying a known change to another format
+ *
+ * Interning a format requires hashing and comparing it, which is significant
+ * relative to applying a cached escape sequence (see read.c).  Since the same
+ * sequences tend to be applied to the same few formats over and over, we
+ * memoize the result of applying the sequence identified by `key` to format
+ * `from` so that in most cases the id is a lookup away.
+ *
+ * @param from id of the format before the change.
+ * @param key non-zero, uniquely identifies the change for the life of the
+ *   table.
+ * @param fmt the format after the change, used if the step is not memoized,
+ *   or NULL to only look up the step.
+ * @return the id of `fmt`, or FMT_ID_NA if `fmt` is NULL and the step is not
+ *   memoized.
+ */
+#define FMT_STEP_BITS 12
+#define FMT_STEP_SIZE (1U << FMT_STEP_BITS)
+
+unsigned int FANSI_fmt_tab_step(
+  struct FANSI_fmt_tab * tab, unsigned int from, unsigned int key,
+  struct FANSI_format * fmt
+) {
+  if(!tab->step) {
+    SEXP mem = allocVector(RAWSXP, FMT_STEP_SIZE * sizeof(*tab->step));
+    SET_VECTOR_ELT(tab->mem, FMT_MEM_STEP, mem);
+    tab->step = (struct FANSI_fmt_step *) RAW(mem);
+    memset(tab->step, 0, FMT_STEP_SIZE * sizeof(*tab->step));
+  }
+  unsigned int h = ((from * 0x9E3779B1U) ^ key) * 0x85EBCA6BU;
+  struct FANSI_fmt_step * step = tab->step + (h >> (32 - FMT_STEP_BITS));
+  if(step->key != key || step->from != from) {
+    if(!fmt) return FMT_ID_NA;
+    unsigned int to = fmt_id(tab, *fmt);
+    *step = (struct FANSI_fmt_step) {.from=from, .key=key, .to=to};
+  }
+  return step->to;
+}
+/*
+ * Format of a state
+ */
+struct FANSI_format FANSI_state_fmt(struct FANSI_state * state) {
+  return state->fmt_id ?
+    state->tab->fmt[state->fmt_id] : (struct FANSI_format) {0};
+}
+/*
+ * Set the format of a state
+ */
+void FANSI_state_set_fmt(
+  struct FANSI_state * state, struct FANSI_format fmt
+) {
+  state->fmt_id = fmt_id(state->tab, fmt);
+}
+void FANSI_state_set_sgr(struct FANSI_state * state, struct FANSI_sgr sgr) {
+  struct FANSI_format fmt = FANSI_state_fmt(state);
+  fmt.sgr = sgr;
+  FANSI_state_set_fmt(state, fmt);
+}
+/*
+ * Copy the format of `from` into `to`.
+ */
+void FANSI_state_copy_fmt(
+  struct FANSI_state * to, struct FANSI_state * from
+) {
+  if(to->tab == from->tab || !from->fmt_id) to->fmt_id = from->fmt_id;
+  else FANSI_state_set_fmt(to, FANSI_state_fmt(from));
+}
 /*
  * Generate the tag corresponding to the state and write it out as a NULL
  * terminated string.
@@ -219,13 +509,14 @@ void FANSI_reset_state(struct FANSI_state * state) {
 char * FANSI_state_as_chr(
   struct FANSI_buff *buff, struct FANSI_state state, int normalize, R_xlen_t i
 ) {
+  struct FANSI_format fmt = FANSI_state_fmt(&state);
   FANSI_reset_buff(buff);
-  FANSI_W_sgr(buff, state.fmt.sgr, normalize, 1, i);
-  FANSI_W_url(buff, state.fmt.url, i);
+  FANSI_W_sgr(buff, fmt.sgr, normalize, 1, i);
+  FANSI_W_url(buff, fmt.url, i);
 
   FANSI_size_buff(buff);
-  FANSI_W_sgr(buff, state.fmt.sgr, normalize, 1, i);
-  FANSI_W_url(buff, state.fmt.url, i);
+  FANSI_W_sgr(buff, fmt.sgr, normalize, 1, i);
+  FANSI_W_url(buff, fmt.url, i);
   return buff->buff;
 }
 /*
@@ -394,6 +685,7 @@ SEXP FANSI_state_close_ext(SEXP x, SEXP warn, SEXP term_cap, SEXP norm) {
       state = FANSI_state_init_full(
         x, warn, term_cap, R_true, R_true, R_zero, R_one, i
       );
+      PROTECT(state.tab->mem); ++prt;
     } else FANSI_state_reinit(&state, x, i);
 
     SEXP x_chr = STRING_ELT(x, i);
@@ -401,12 +693,12 @@ SEXP FANSI_state_close_ext(SEXP x, SEXP warn, SEXP term_cap, SEXP norm) {
 
     FANSI_read_all(&state, i, arg);
     FANSI_reset_buff(&buff);
-    FANSI_W_close(&buff, state.fmt, normalize, i);
+    FANSI_W_close(&buff, FANSI_state_fmt(&state), normalize, i);
 
     if(buff.len) {
       if(res == x) REPROTECT(res = duplicate(x), ipx);
       FANSI_size_buff(&buff);
-      FANSI_W_close(&buff, state.fmt, normalize, i);
+      FANSI_W_close(&buff, FANSI_state_fmt(&state), normalize, i);
 
       cetype_t chr_type = getCharCE(x_chr);
       SEXP reschr = PROTECT(FANSI_mkChar(buff, chr_type, i));
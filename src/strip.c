@@ -52,10 +52,11 @@ SEXP FANSI_strip(SEXP x, SEXP ctl, SEXP warn) {
 
   R_xlen_t i, len = xlength(x);
   SEXP res_fin = x;
+  int prt = 0;
 
   PROTECT_INDEX ipx;
   // reserve spot if we need to alloc later
-  PROTECT_WITH_INDEX(res_fin, &ipx);
+  PROTECT_WITH_INDEX(res_fin, &ipx); ++prt;
 
   int any_ansi = 0;
   R_len_t mem_req = 0;          // how much memory we need for each ansi
@@ -78,8 +79,10 @@ SEXP FANSI_strip(SEXP x, SEXP ctl, SEXP warn) {
 
   for(i = 0; i < len; ++i) {
     // Now full check
-    if(!i) state = FANSI_state_init_ctl(x, warn, ctl, i);
-    else FANSI_state_reinit(&state, x, i);
+    if(!i) {
+      state = FANSI_state_init_ctl(x, warn, ctl, i);
+      PROTECT(state.tab->mem); ++prt;
+    } else FANSI_state_reinit(&state, x, i);
 
     SEXP x_chr = STRING_ELT(x, i);
     if(x_chr == NA_STRING) continue;
@@ -138,7 +141,7 @@ SEXP FANSI_strip(SEXP x, SEXP ctl, SEXP warn) {
       UNPROTECT(1);
     }
   }
-  UNPROTECT(1);
+  UNPROTECT(prt);
   return res_fin;
 }
 static int is_special(char x) {
@@ -154,8 +157,190 @@ static int is_special(char x) {
  *
  * Allows two spaces after periods, question marks, and exclamation marks.  This
  * is to line up with strwrap behavior.
+ *
+ * @param state at the beginning of the string to process.
+ * @param len_j bytes in the string.
+ * @param buff buffer the processed string is written to.  It is only sized and
+ *   written to if the string needs stripping.
+ * @return whether the string was stripped.
  */
+int FANSI_process_one(
+  struct FANSI_state state, int len_j, struct FANSI_buff * buff, R_xlen_t i
+) {
+  const char * err_msg = "Processing whitespace";
+  const char * arg = "x";
+  const char * string = state.string;
+  const char * string_start = string;
+
+  int strip_this, to_strip, to_strip_nl, punct_prev, punct_prev_prev,
+      space_prev, space_start, para_start, newlines, newlines_start,
+      has_tab_or_nl, leading_spaces, reset;
+
+  strip_this = to_strip = to_strip_nl = punct_prev = punct_prev_prev =
+    space_prev = space_start = newlines = newlines_start = has_tab_or_nl =
+    reset = 0;
 
+  para_start = leading_spaces = 1;
+
+  int j_last = 0;
+
+  // All spaces [ \t\n] are converted to spaces.  First space is kept, unless
+  // right after [.?!][)\\"']{0,1}, in which case one more space can be kept.
+  //
+  // One exception is that sequences of spaces that resolve to more than one
+  // newline are kept as a pair of newlines.
+  //
+  // We purposefully allow ourselves to read up to the NULL terminator.
+
+  for(int j = 0; j <= len_j; ++j) {
+    int newline = string[j] == '\n';
+    int tab = string[j] == '\t';
+
+    has_tab_or_nl += newline + tab;
+
+    if(newline) {
+      if(!newlines) {
+        newlines_start = j;
+        to_strip_nl = to_strip;  // how many chrs need stripping by first nl
+      }
+      ++newlines;
+    }
+    int space = ((string[j] == ' ') || tab || newline);
+    int line_end = !string[j];
+
+    // Need to keep track if we're in a sequence that starts with a space in
+    // case a line ends, as normally we keep one or two spaces, but if we hit
+    // the end of the line we don't want to keep them.
+    if(space && !para_start) {
+      if(!space_prev) space_start = 1;
+      else if(space && space_prev && punct_prev_prev) space_start = 2;
+    }
+    // Anything we want to treat as a control is kept, and in the end will
+    // be copied to the end of the string in question.
+
+    int special = is_special(string[j]);
+    int special_len = 0;
+
+    if(special) { // Check that it is really special.
+      int pos_prev = state.pos.x = j;
+      FANSI_read_next(&state, i, arg);
+      // Sequence is special if it is a recognized control
+      if(state.status & CTL_ALL) {
+        special_len = state.pos.x - pos_prev;
+      } else {
+        special = special_len = 0;
+      }
+    }
+    // transcribe string if:
+    if(
+      // we've hit something that we don't need to strip, and we have accrued
+      // characters to strip (more than one space, or more than two spaces if
+      // preceeded by punct, or leading spaces
+      (
+        !space && !special && (
+          (
+            (to_strip && leading_spaces) ||
+            (to_strip > 1 && (!punct_prev)) ||
+            (to_strip > 2)
+          ) ||
+          has_tab_or_nl
+      ) )
+      ||
+      // string end and we've already stripped previously or ending in spaces
+      (line_end && (strip_this || space_start))
+    ) {
+      // Make sure buffer is big enough (could be too big)
+      if(!strip_this) {
+        FANSI_size_buff0(buff, len_j);
+        strip_this = 1;
+      }
+      // newlines normally act as spaces, but if there are two or more in a
+      // sequence of tabs/spaces then they behave like a paragraph break
+      // so we will replace that sequence with two newlines;
+
+      const char * spc_chr = " ";
+      int copy_to = j;
+      int to_strip0 = to_strip;
+
+      if(newlines > 1) {
+        copy_to = newlines_start;
+        space_start = 2;
+        to_strip = to_strip_nl; // how many chars to strip by first newline
+        spc_chr = "\n";
+      }
+      // Copy the portion up to the point we know should be copied, will add
+      // back spaces and/or newlines as needed.  This does not skip specials,
+      // just delays them!
+
+      int copy_bytes =
+        copy_to -      // current position
+        j_last -       // less last time we copied
+        to_strip;      // less extra stuff to strip
+
+      if(copy_bytes) {
+        FANSI_W_MCOPY(buff, string_start, copy_bytes);
+      }
+      // Instead of all the trailing spaces etc we skip, write one or two
+      // spaces or newlines as needed.
+      if(!line_end) {
+        if(space_start) FANSI_W_COPY(buff, spc_chr);
+        if(space_start > 1) FANSI_W_COPY(buff, spc_chr);
+      }
+      // Anything that is not a space/tab/nl that was considered non-breaking
+      // with respect to trailing white space should be copied at end
+      // otherwise unmodified.
+      int copy_end = j_last + copy_bytes;
+      for(int k = copy_end; k < copy_end + to_strip0; ++k) {
+        if(is_special(string[k])) {
+          state.pos.x = k;
+          FANSI_read_next(&state, i, arg);
+          int bytes = state.pos.x - k;
+          FANSI_W_MCOPY(buff, string + k, bytes);
+          k += bytes - 1;
+        }
+      }
+      // Preprare for next sequence
+      string_start = string + j;
+      j_last = j;
+      reset = 1;
+    } else if(space) {
+      to_strip++;
+    } else if(special) {
+      // treat special like a space, but only if preceded by space
+      if(space_prev) {
+        to_strip += special_len;
+        space = 1;
+      }
+      j += special_len - 1;
+    } else {
+      reset = 1;
+    }
+    // We ended streak of spaces/etc so, reset
+    if(reset) {
+      reset = 0;
+      to_strip = space_start = newlines = has_tab_or_nl = leading_spaces = 0;
+    }
+    para_start = newlines > 1;
+    space_prev = space;
+    punct_prev_prev = punct_prev || (special && punct_prev_prev);
+
+    // To match what `strwrap` does, we treat as punctuation [.?!], and also
+    // treat them as punctuation if they are followed by closing quotes or
+    // parens.
+    punct_prev =
+      (string[j] == '.' || string[j] == '!' || string[j] == '?') ||
+      (
+        punct_prev &&
+        (string[j] == '"' || string[j] == '\'' || string[j] == ')')
+      );
+  }
+  return strip_this;
+}
+/*
+ * Strips Extra ASCII Spaces from Each Element of `input`
+ *
+ * See `FANSI_process_one`.
+ */
 SEXP FANSI_process(
   SEXP input, SEXP term_cap, SEXP ctl, struct FANSI_buff *buff
 ) {
@@ -168,8 +353,6 @@ SEXP FANSI_process(
   PROTECT_WITH_INDEX(res, &ipx); ++prt;
   SEXP R_true = PROTECT(ScalarLogical(1)); ++prt;
   SEXP R_zero = PROTECT(ScalarInteger(0)); ++prt;
-  char * err_msg = "Processing whitespace";
-  const char * arg = "x";
 
   int strip_any = 0;          // Have any elements in the STRSXP been stripped
 
@@ -187,180 +370,16 @@ SEXP FANSI_process(
       state = FANSI_state_init_full(
         input, warn, term_cap, allowNA, keepNA, width, ctl, i
       );
+      PROTECT(state.tab->mem); ++prt;
     } else FANSI_state_reinit(&state, input, i);
 
-    const char * string = state.string;
-    const char * string_start = string;
-
     int len_j = LENGTH(STRING_ELT(input, i)); // R_len_t checked to fit in int
-    int strip_this, to_strip, to_strip_nl, punct_prev, punct_prev_prev,
-        space_prev, space_start, para_start, newlines, newlines_start,
-        has_tab_or_nl, leading_spaces, reset;
-
-    strip_this = to_strip = to_strip_nl = punct_prev = punct_prev_prev =
-      space_prev = space_start = newlines = newlines_start = has_tab_or_nl =
-      reset = 0;
-
-    para_start = leading_spaces = 1;
-
-    int j_last = 0;
-
-    // All spaces [ \t\n] are converted to spaces.  First space is kept, unless
-    // right after [.?!][)\\"']{0,1}, in which case one more space can be kept.
-    //
-    // One exception is that sequences of spaces that resolve to more than one
-    // newline are kept as a pair of newlines.
-    //
-    // We purposefully allow ourselves to read up to the NULL terminator.
-
-    for(int j = 0; j <= len_j; ++j) {
-      int newline = string[j] == '\n';
-      int tab = string[j] == '\t';
-
-      has_tab_or_nl += newline + tab;
-
-      if(newline) {
-        if(!newlines) {
-          newlines_start = j;
-          to_strip_nl = to_strip;  // how many chrs need stripping by first nl
-        }
-        ++newlines;
+    if(FANSI_process_one(state, len_j, buff, i)) {
+      // need to copy entire STRSXP since we haven't done that yet
+      if(!strip_any) {
+        REPROTECT(res = duplicate(input), ipx);
+        strip_any = 1;
       }
-      int space = ((string[j] == ' ') || tab || newline);
-      int line_end = !string[j];
-
-      // Need to keep track if we're in a sequence that starts with a space in
-      // case a line ends, as normally we keep one or two spaces, but if we hit
-      // the end of the line we don't want to keep them.
-      if(space && !para_start) {
-        if(!space_prev) space_start = 1;
-        else if(space && space_prev && punct_prev_prev) space_start = 2;
-      }
-      // Anything we want to treat as a control is kept, and in the end will
-      // be copied to the end of the string in question.
-
-      int special = is_special(string[j]);
-      int special_len = 0;
-
-      if(special) { // Check that it is really special.
-        int pos_prev = state.pos.x = j;
-        FANSI_read_next(&state, i, arg);
-        // Sequence is special if it is a recognized control
-        if(state.status & CTL_ALL) {
-          special_len = state.pos.x - pos_prev;
-        } else {
-          special = special_len = 0;
-        }
-      }
-      // transcribe string if:
-      if(
-        // we've hit something that we don't need to strip, and we have accrued
-        // characters to strip (more than one space, or more than two spaces if
-        // preceeded by punct, or leading spaces
-        (
-          !space && !special && (
-            (
-              (to_strip && leading_spaces) ||
-              (to_strip > 1 && (!punct_prev)) ||
-              (to_strip > 2)
-            ) ||
-            has_tab_or_nl
-        ) )
-        ||
-        // string end and we've already stripped previously or ending in spaces
-        (line_end && (strip_this || space_start))
-      ) {
-        // need to copy entire STRSXP since we haven't done that yet
-        if(!strip_any) {
-          REPROTECT(res = duplicate(input), ipx);
-          strip_any = 1;
-        }
-        // Make sure buffer is big enough (could be too big)
-        if(!strip_this) {
-          FANSI_size_buff0(buff, len_j);
-          strip_this = 1;
-        }
-        // newlines normally act as spaces, but if there are two or more in a
-        // sequence of tabs/spaces then they behave like a paragraph break
-        // so we will replace that sequence with two newlines;
-
-        const char * spc_chr = " ";
-        int copy_to = j;
-        int to_strip0 = to_strip;
-
-        if(newlines > 1) {
-          copy_to = newlines_start;
-          space_start = 2;
-          to_strip = to_strip_nl; // how many chars to strip by first newline
-          spc_chr = "\n";
-        }
-        // Copy the portion up to the point we know should be copied, will add
-        // back spaces and/or newlines as needed.  This does not skip specials,
-        // just delays them!
-
-        int copy_bytes =
-          copy_to -      // current position
-          j_last -       // less last time we copied
-          to_strip;      // less extra stuff to strip
-
-        if(copy_bytes) {
-          FANSI_W_MCOPY(buff, string_start, copy_bytes);
-        }
-        // Instead of all the trailing spaces etc we skip, write one or two
-        // spaces or newlines as needed.
-        if(!line_end) {
-          if(space_start) FANSI_W_COPY(buff, spc_chr);
-          if(space_start > 1) FANSI_W_COPY(buff, spc_chr);
-        }
-        // Anything that is not a space/tab/nl that was considered non-breaking
-        // with respect to trailing white space should be copied at end
-        // otherwise unmodified.
-        int copy_end = j_last + copy_bytes;
-        for(int k = copy_end; k < copy_end + to_strip0; ++k) {
-          if(is_special(string[k])) {
-            state.pos.x = k;
-            FANSI_read_next(&state, i, arg);
-            int bytes = state.pos.x - k;
-            FANSI_W_MCOPY(buff, string + k, bytes);
-            k += bytes - 1;
-          }
-        }
-        // Preprare for next sequence
-        string_start = string + j;
-        j_last = j;
-        reset = 1;
-      } else if(space) {
-        to_strip++;
-      } else if(special) {
-        // treat special like a space, but only if preceded by space
-        if(space_prev) {
-          to_strip += special_len;
-          space = 1;
-        }
-        j += special_len - 1;
-      } else {
-        reset = 1;
-      }
-      // We ended streak of spaces/etc so, reset
-      if(reset) {
-        reset = 0;
-        to_strip = space_start = newlines = has_tab_or_nl = leading_spaces = 0;
-      }
-      para_start = newlines > 1;
-      space_prev = space;
-      punct_prev_prev = punct_prev || (special && punct_prev_prev);
-
-      // To match what `strwrap` does, we treat as punctuation [.?!], and also
-      // treat them as punctuation if they are followed by closing quotes or
-      // parens.
-      punct_prev =
-        (string[j] == '.' || string[j] == '!' || string[j] == '?') ||
-        (
-          punct_prev &&
-          (string[j] == '"' || string[j] == '\'' || string[j] == ')')
-        );
-    }
-    if(strip_this) {
       SEXP chrsxp = PROTECT(
         FANSI_mkChar0(
           buff->buff0, buff->buff, getCharCE(STRING_ELT(input, i)), i
@@ -0,0 +1,301 @@
+/*
+ * Copyright (C) Brodie Gaslam
+ *
+ * This file is part of "fansi - ANSI Control Sequence Aware String Functions"
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Go to <https://www.r-project.org/Licenses> for a copies of the licenses.
+ */
+
+#include "fansi.h"
+
+/*
+ * Split positions are computed on the string with _Control Sequences_ removed
+ * and are in characters (see COUNT_CHARS), so they can be used directly as
+ * substring positions in the original string.  Each piece spans from the end
+ * of a match to the start of the next one, and all the pieces of an element
+ * are then extracted in one forward read (see `FANSI_substr_multi`).
+ */
+
+/*
+ * Copy the parts of the current element that are not _Control Sequences_
+ * into `out`, NUL terminated.
+ *
+ * @param state at the beginning of the element, not modified.
+ * @return the number of bytes in the stripped string.
+ */
+static int strip_one(struct FANSI_state state, char * out, R_xlen_t i) {
+  // Errors are as for `strip_ctl(warn=FALSE)`; warnings are issued when the
+  // pieces are read.
+  state.settings &= ~WARN_MASK | WARN_ERROR;
+  const char * arg = "x";
+  int len = 0, has_ctl = 0;
+  int prev = state.pos.x;
+  while(state.string[state.pos.x]) {
+    int pos = FANSI_find_ctl(&state, i, arg);
+    // As with `FANSI_strip`, strings without _Control Sequences_ are kept as
+    // is, but otherwise trailing specials not treated as controls are dropped.
+    has_ctl = has_ctl || (state.status & CTL_MASK);
+    if(!has_ctl) pos = state.pos.x;
+    memcpy(out + len, state.string + prev, pos - prev);
+    len += pos - prev;
+    prev = state.pos.x;
+  }
+  out[len] = 0;
+  return len;
+}
+/*
+ * Track conversion of increasing byte offsets in a UTF-8 string to character
+ * offsets.
+ */
+struct to_char {const char * string; int byte; int chr;};
+
+static int to_char(struct to_char * tc, int byte) {
+  for(; tc->byte < byte; ++tc->byte)
+    tc->chr += (tc->string[tc->byte] & 0xC0) != 0x80;
+  return tc->chr;
+}
+/*
+ * Add the piece between the match ending before `start` and the next one
+ * starting at `next`, both 1-indexed characters.  Pieces starting past the end
+ * of the string are dropped, as happens when a match runs to the end.
+ */
+static int add_piece(int * starts, int * stops, int n, int start, int next) {
+  starts[n] = start < 1 ? 1 : start;
+  stops[n] = next - 1;
+  return n + 1;
+}
+/*
+ * Compute pieces for a fixed `split`, natively.
+ *
+ * Matches are non-overlapping and taken left to right as with `gregexpr`.  An
+ * empty `split` puts each character in its own piece.
+ *
+ * @return the number of pieces, zero if there are no matches.
+ */
+static int split_fixed(
+  const char * strip, int chars, const char * split,
+  int * starts, int * stops
+) {
+  int n = 0;
+  if(!*split) {
+    // Single characters are not split, as with `gregexpr` matches
+    if(chars < 2) return 0;
+    for(int k = 1; k <= chars; ++k) {
+      starts[n] = stops[n] = k;
+      ++n;
+    }
+    return n;
+  }
+  size_t split_len = strlen(split);
+  struct to_char tc = {.string = strip};
+  int start = 1;
+  const char * p = strip;
+  const char * m;
+  while((m = strstr(p, split))) {
+    int m_chr = to_char(&tc, (int) (m - strip)) + 1;
+    n = add_piece(starts, stops, n, start, m_chr);
+    p = m + split_len;
+    start = to_char(&tc, (int) (p - strip)) + 1;
+  }
+  if(n && start <= chars) n = add_piece(starts, stops, n, start, chars + 1);
+  return n;
+}
+/*
+ * Compute pieces from `gregexpr` output.
+ *
+ * @param match an element of the return value of `gregexpr` applied to the
+ *   stripped string.
+ * @return the number of pieces, zero if there are no matches.
+ */
+static int split_regex(
+  SEXP match, const char * strip, int chars, int * starts, int * stops,
+  R_xlen_t i
+) {
+  if(TYPEOF(match) != INTSXP)
+    error("Internal Error: bad match at index [%jd].", FANSI_ind(i)); // nocov
+  SEXP mlen = getAttrib(match, install("match.length"));
+  SEXP bytes = getAttrib(match, install("useBytes"));
+  if(TYPEOF(mlen) != INTSXP || XLENGTH(mlen) != XLENGTH(match))
+    error("Internal Error: bad match length at [%jd].", FANSI_ind(i)); // nocov
+  int bytes_i = TYPEOF(bytes) == LGLSXP && asLogical(bytes) == 1;
+  R_xlen_t m_len = XLENGTH(match);
+  if(m_len > chars + 1)
+    error("Internal Error: too many matches at [%jd].", FANSI_ind(i)); // nocov
+  int * m = INTEGER(match);
+  int * ml = INTEGER(mlen);
+  struct to_char tc = {.string = strip};
+  int n = 0;
+  int start = 1;
+  for(R_xlen_t k = 0; k < m_len; ++k) {
+    if(m[k] < 1) continue;
+    int m0 = m[k], m1 = m[k] + ml[k];
+    if(bytes_i) {
+      m0 = to_char(&tc, m0 - 1) + 1;
+      m1 = to_char(&tc, m1 - 1) + 1;
+    }
+    n = add_piece(starts, stops, n, start, m0);
+    start = m1;
+  }
+  if(n && start <= chars) n = add_piece(starts, stops, n, start, chars + 1);
+  return n;
+}
+/*
+ * Split Strings
+ *
+ * @param split character vector same length as `x`, used where `matches` is
+ *   NULL.
+ * @param matches list same length as `x`, each NULL or the `gregexpr` result
+ *   for the stripped string.
+ */
+SEXP FANSI_strsplit_ext(
+  SEXP x, SEXP split, SEXP matches,
+  SEXP warn, SEXP term_cap, SEXP ctl, SEXP norm,
+  SEXP carry, SEXP terminate
+) {
+  if(TYPEOF(x) != STRSXP)
+    error("Internal Error: `x` must be character.");  // nocov
+  R_xlen_t len = XLENGTH(x);
+  if(
+    TYPEOF(split) != STRSXP || XLENGTH(split) != len ||
+    TYPEOF(matches) != VECSXP || XLENGTH(matches) != len
+  )
+    error("Internal Error: bad `split` or `matches`.");  // nocov
+  if(!FANSI_is_tf(terminate))
+    error("Internal Error: invalid `terminate`."); // nocov
+  FANSI_val_args(x, norm, carry);
+
+  int prt = 0;
+  SEXP res = PROTECT(allocVector(VECSXP, len)); ++prt;
+  if(!len) {
+    UNPROTECT(prt);
+    return res;
+  }
+  int norm_i = asLogical(norm);
+  int term_i = asLogical(terminate);
+  int carry_i = STRING_ELT(carry, 0) != NA_STRING;
+
+  // Scratch memory for the stripped strings and piece bounds, from R so it
+  // does not get in the way of releasing `buff`.  All elements are stripped
+  // before any are split so errors come ahead of warnings as they would from
+  // `strip_ctl`.
+  R_len_t len_max = 0;
+  R_xlen_t strip_size = 0;
+  for(R_xlen_t i = 0; i < len; ++i) {
+    R_len_t chr_len = LENGTH(STRING_ELT(x, i));
+    if(chr_len > len_max) len_max = chr_len;
+    strip_size += chr_len + 1;
+  }
+  size_t n_max = (size_t) len_max + 2;
+  SEXP bounds = PROTECT(
+    allocVector(RAWSXP, (R_xlen_t) (n_max * 2 * sizeof(int)))
+  ); ++prt;
+  int * starts = (int *) RAW(bounds);
+  int * stops = starts + n_max;
+  SEXP strips = PROTECT(allocVector(RAWSXP, strip_size)); ++prt;
+
+  SEXP allowNA, keepNA, type;
+  allowNA = keepNA = PROTECT(ScalarLogical(0)); ++prt;
+  type = PROTECT(ScalarInteger(COUNT_CHARS)); ++prt;
+  struct FANSI_state state, state_init, state_ref;
+  state_init = FANSI_state_init_full(
+    x, warn, term_cap, allowNA, keepNA, type, ctl, (R_xlen_t) 0
+  );
+  PROTECT(state_init.tab->mem); ++prt;
+
+  char * strip = (char *) RAW(strips);
+  for(R_xlen_t i = 0; i < len; ++i) {
+    FANSI_interrupt(i);
+    *strip = 0;
+    if(STRING_ELT(x, i) != NA_STRING) {
+      state = state_init;
+      FANSI_state_reinit(&state, x, i);
+      strip += strip_one(state, strip, i);
+    }
+    ++strip;
+  }
+  struct FANSI_buff buff;
+  FANSI_INIT_BUFF(&buff);
+  const char * arg = "x";
+
+  // Each element is split independently, with the pieces extracted as if by
+  // `substr_ctl` from copies of the element, so each piece warns on its own
+  // and reports its own index.
+  strip = (char *) RAW(strips);
+  for(R_xlen_t i = 0; i < len; ++i, strip += strlen(strip) + 1) {
+    FANSI_interrupt(i);
+    SEXP x_chr = STRING_ELT(x, i);
+    if(x_chr == NA_STRING) {
+      SET_VECTOR_ELT(res, i, ScalarString(NA_STRING));
+      continue;
+    }
+    state = state_init;
+    FANSI_state_reinit(&state, x, i);
+
+    int chars = 0;
+    for(const char * c = strip; *c; ++c) chars += (*c & 0xC0) != 0x80;
+    int n = 0;
+    if(chars) {
+      SEXP match = VECTOR_ELT(matches, i);
+      if(match == R_NilValue)
+        n = split_fixed(
+          strip, chars, CHAR(STRING_ELT(split, i)), starts, stops
+        );
+      else n = split_regex(match, strip, chars, starts, stops, i);
+    }
+    if(!chars) {
+      SET_VECTOR_ELT(res, i, allocVector(STRSXP, 0));
+      continue;
+    } else if(!n) {
+      SET_VECTOR_ELT(res, i, ScalarString(x_chr));
+      continue;
+    }
+    SEXP pieces = allocVector(STRSXP, n);
+    SET_VECTOR_ELT(res, i, pieces);
+    state_ref = state;
+    if(!carry_i) {
+      FANSI_substr_multi(
+        &state, &state_ref, &buff, i, starts, stops, n, RND_START, norm_i,
+        term_i, carry_i, pieces, 0, NULL, 1
+      );
+      continue;
+    }
+    // With carry the first piece starts with the `carry` state, and each
+    // later one with the state at the end of the element, since each piece's
+    // copy of the element carries into the next.  Those copies are read in
+    // full, so if the element warns every piece does.
+    state_ref.string = CHAR(STRING_ELT(carry, 0));
+    state_ref.len = LENGTH(STRING_ELT(carry, 0));
+    FANSI_read_all(&state_ref, 0, "carry");
+    FANSI_state_copy_fmt(&state, &state_ref);
+    struct FANSI_state state_end = state;
+    FANSI_substr_multi(
+      &state_end, &state_ref, &buff, i, starts, stops, 1, RND_START, norm_i,
+      term_i, carry_i, pieces, 0, NULL, 1
+    );
+    FANSI_read_all(&state_end, 0, arg);
+    // The rest are extracted in one sweep, unless each must repeat warnings
+    int warned = state_end.status & STAT_WARNED;
+    for(int k = 1; k < n; k = warned ? k + 1 : n) {
+      struct FANSI_state state_k = state;
+      FANSI_state_reinit(&state_k, x, i);
+      FANSI_state_copy_fmt(&state_k, &state_end);
+      FANSI_substr_multi(
+        &state_k, &state_ref, &buff, i, starts + k, stops + k,
+        warned ? 1 : n - k, RND_START, norm_i, term_i, carry_i, pieces,
+        (R_xlen_t) k, NULL, 1
+      );
+      if(warned) FANSI_read_all(&state_k, k, arg);
+  } }
+  FANSI_release_buff(&buff, 1);
+  UNPROTECT(prt);
+  return res;
+}
@@ -0,0 +1,338 @@
+/*
+ * Copyright (C) Brodie Gaslam
+ *
+ * This file is part of "fansi - ANSI Control Sequence Aware String Functions"
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 or 3 of the License.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * Go to <https://www.r-project.org/Licenses> for a copies of the licenses.
+ */
+
+#include "fansi.h"
+
+/*
+ * Ranges are styled in place: the bytes of `x` are all kept, and within each
+ * range the requested SGR is layered on top of whatever state `x` has at that
+ * point.  This means re-applying it after any SGR or URL in `x` that falls in
+ * the range, and at the end of the range bridging back to the state `x` has
+ * there (see `FANSI_W_bridge`).
+ *
+ * The sequences in each range are found while computing the range points and
+ * recorded as `style_ev`, so that the measuring and writing passes only replay
+ * them instead of reading `x` again.
+ */
+
+struct style_ev {
+  int x;                      // byte after the sequence in `x`
+  struct FANSI_state from;    // terminal state after the sequence
+  struct FANSI_state to;      // `sgr` layered on the state of `x` after it
+};
+/*
+ * Layer `sgr` on top of the format of `x`.
+ *
+ * @param s state for reading `sgr`, validated in advance so warnings are off.
+ */
+static struct FANSI_state style_fmt(
+  struct FANSI_state x, struct FANSI_state s, R_xlen_t i
+) {
+  FANSI_reset_state(&s);
+  FANSI_state_copy_fmt(&s, &x);
+  FANSI_read_all(&s, i, "sgr");
+  return s;
+}
+/*
+ * Record the sequences in `x` that change the state within a range.
+ *
+ * `x`'s SGR is applied on top of what the terminal shows at that point, so the
+ * state it leaves is `x`'s SGR applied to the styled state before it.  One
+ * ESC at a time so runs of sequences don't cross the end of the range.
+ *
+ * @param a, b states at the start and end of the range.
+ * @param s state for reading the SGR of the range.
+ * @param out set to the styled state at the start of the range.
+ * @param ev_sxp, ipx vector holding the records, re-allocated as needed.
+ * @param n_ev records so far, updated.
+ * @return the byte the range ends at when writing, which is before any escape
+ *   cut short by the end of the string as it would swallow the closing
+ *   sequence.
+ */
+static int style_record(
+  struct FANSI_state a, struct FANSI_state b, struct FANSI_state s,
+  struct FANSI_state * out, SEXP * ev_sxp, PROTECT_INDEX ipx, int * n_ev,
+  R_xlen_t i
+) {
+  const char * string = a.string;
+  struct FANSI_state t = a, o, to = style_fmt(a, s, i);
+  t.settings = (t.settings & ~WARN_MASK) | SET_ESCONE;
+  int end = b.pos.x;
+  *out = to;
+
+  while(string[t.pos.x]) {
+    int pos = FANSI_find_ctl(&t, i, "x");
+    if(!(t.status & CTL_MASK) || pos >= b.pos.x) break;
+    if(!(t.status & (CTL_SGR | CTL_URL))) {
+      unsigned int err = FANSI_GET_ERR(t.status);
+      if(
+        !string[t.pos.x] &&
+        (err == ERR_BAD_CSI_OSC || err == ERR_ESC_OTHER_BAD)
+      )
+        end = pos;
+      continue;
+    }
+    o = t;
+    o.pos.x = pos;
+    FANSI_state_copy_fmt(&o, &to);
+    FANSI_read_next(&o, i, "x");
+    to = style_fmt(t, s, i);
+
+    R_xlen_t ev_max = XLENGTH(*ev_sxp) / (R_xlen_t) sizeof(struct style_ev);
+    if(*n_ev == ev_max) {
+      if(ev_max > FANSI_lim.lim_int.max / 2)
+        error("Internal Error: too many sequences to style.");  // nocov
+      SEXP tmp = allocVector(
+        RAWSXP, (ev_max ? 2 * ev_max : 16) * (R_xlen_t) sizeof(struct style_ev)
+      );
+      if(*n_ev)
+        memcpy(RAW(tmp), RAW(*ev_sxp), *n_ev * sizeof(struct style_ev));
+      REPROTECT(*ev_sxp = tmp, ipx);
+    }
+    ((struct style_ev *) RAW(*ev_sxp))[(*n_ev)++] =
+      (struct style_ev) {.x=t.pos.x, .from=o, .to=to};
+  }
+  return end;
+}
+/*
+ * Write one element with the ranges styled.
+ *
+ * @param a, b states at the start and end of each range.
+ * @param s styled state at the start of each range.
+ * @param end byte each range ends at when writing.
+ * @param ev, ev0 records of the sequences in the ranges, those of range `k`
+ *   from `ev0[k]` up to `ev0[k + 1]`.
+ */
+static void style_write(
+  struct FANSI_buff * buff, SEXP x_chr, const struct FANSI_state * a,
+  const struct FANSI_state * b, const struct FANSI_state * s,
+  const int * end, const struct style_ev * ev, const int * ev0, int n,
+  int norm_i, R_xlen_t i
+) {
+  const char * err_msg = "Styling ranges";
+  const char * string = CHAR(x_chr);
+  int prev = 0;
+  for(int k = 0; k < n; ++k) {
+    FANSI_W_MCOPY(buff, string + prev, a[k].pos.x - prev);
+    FANSI_W_bridge(buff, a[k], s[k], norm_i, i, err_msg);
+    prev = a[k].pos.x;
+    struct FANSI_state out = s[k];
+    for(int e = ev0[k]; e < ev0[k + 1]; ++e) {
+      FANSI_W_MCOPY(buff, string + prev, ev[e].x - prev);
+      prev = ev[e].x;
+      FANSI_W_bridge(buff, ev[e].from, ev[e].to, norm_i, i, err_msg);
+      out = ev[e].to;
+    }
+    FANSI_W_MCOPY(buff, string + prev, end[k] - prev);
+    FANSI_W_bridge(buff, out, b[k], norm_i, i, err_msg);
+    prev = end[k];
+  }
+  FANSI_W_MCOPY(buff, string + prev, LENGTH(x_chr) - prev);
+}
+/*
+ * Style Ranges of Each Element
+ *
+ * Ranges with NA bounds or `sgr`, or with `stop` before `start`, are dropped,
+ * and the rest sorted by `start` so that each element is read forward once.
+ * Ranges are delimited as `substr_ctl` would, except that reads resume from
+ * the end of the previous range.
+ *
+ * @param start, stop, sgr lists the same length as `x` of integer and
+ *   character vectors of matching lengths.
+ */
+SEXP FANSI_style_ranges_ext(
+  SEXP x, SEXP start, SEXP stop, SEXP sgr,
+  SEXP type, SEXP rnd,
+  SEXP warn, SEXP term_cap,
+  SEXP ctl, SEXP norm, SEXP carry
+) {
+  if(TYPEOF(x) != STRSXP)
+    error("Internal Error: `x` must be character.");  // nocov
+  R_xlen_t len = XLENGTH(x);
+  if(
+    TYPEOF(start) != VECSXP || TYPEOF(stop) != VECSXP ||
+    TYPEOF(sgr) != VECSXP || XLENGTH(start) != len ||
+    XLENGTH(stop) != len || XLENGTH(sgr) != len
+  )
+    error("Internal Error: invalid `start`, `stop`, or `sgr`.");  // nocov
+  if(TYPEOF(rnd) != INTSXP || XLENGTH(rnd) != 1)
+    error("Internal Error: invalid `rnd`."); // nocov
+  FANSI_val_args(x, norm, carry);
+
+  int prt = 0;
+  SEXP res = PROTECT(allocVector(STRSXP, len)); ++prt;
+  if(!len) {
+    UNPROTECT(prt);
+    return res;
+  }
+  int rnd_i = asInteger(rnd);
+  int norm_i = asLogical(norm);
+  int carry_i = STRING_ELT(carry, 0) != NA_STRING;
+  int ov_start = !(rnd_i == RND_START || rnd_i == RND_BOTH);
+  int ov_stop = rnd_i == RND_STOP || rnd_i == RND_BOTH;
+
+  // Scratch memory for the sorted ranges and their points, from R so it does
+  // not get in the way of releasing `buff`.
+  R_xlen_t n_max = 0;
+  for(R_xlen_t i = 0; i < len; ++i) {
+    SEXP start_i = VECTOR_ELT(start, i), stop_i = VECTOR_ELT(stop, i),
+      sgr_i = VECTOR_ELT(sgr, i);
+    if(
+      TYPEOF(start_i) != INTSXP || TYPEOF(stop_i) != INTSXP ||
+      TYPEOF(sgr_i) != STRSXP || XLENGTH(start_i) != XLENGTH(stop_i) ||
+      XLENGTH(start_i) != XLENGTH(sgr_i) || XLENGTH(start_i) > INT_MAX
+    )
+      error("Internal Error: invalid ranges at [%jd].", FANSI_ind(i)); // nocov
+    if(XLENGTH(start_i) > n_max) n_max = XLENGTH(start_i);
+  }
+  SEXP scratch = PROTECT(
+    allocVector(
+      RAWSXP,
+      n_max * (3 * (R_xlen_t) sizeof(struct FANSI_state) +
+      5 * (R_xlen_t) sizeof(int)) + (R_xlen_t) sizeof(int)
+  ) ); ++prt;
+  struct FANSI_state * a = (struct FANSI_state *) RAW(scratch);
+  struct FANSI_state * b = a + n_max, * s = b + n_max;
+  int * start_s = (int *) (s + n_max);
+  int * stop_s = start_s + n_max;
+  int * at = stop_s + n_max;
+  int * end = at + n_max;
+  int * ev0 = end + n_max;
+  // Records of the sequences in the ranges, grown as needed
+  SEXP ev_sxp = allocVector(RAWSXP, 0);
+  PROTECT_INDEX ipx;
+  PROTECT_WITH_INDEX(ev_sxp, &ipx); ++prt;
+
+  SEXP allowNA, keepNA;
+  allowNA = keepNA = PROTECT(ScalarLogical(0)); ++prt;
+  struct FANSI_state state, state_carry;
+  state = FANSI_state_init_full(
+    x, warn, term_cap, allowNA, keepNA, type, ctl, (R_xlen_t) 0
+  );
+  PROTECT(state.tab->mem); ++prt;
+  state_carry = state;
+  if(carry_i) {
+    state_carry.string = CHAR(STRING_ELT(carry, 0));
+    state_carry.len = LENGTH(STRING_ELT(carry, 0));
+    FANSI_read_all(&state_carry, 0, "carry");
+  }
+  struct FANSI_buff buff;
+  FANSI_INIT_BUFF(&buff);
+  int any_na = 0;
+  const char * arg = "x";
+
+  for(R_xlen_t i = 0; i < len; ++i) {
+    FANSI_interrupt(i);
+    FANSI_state_reinit(&state, x, i);
+    SEXP x_chr = STRING_ELT(x, i);
+    if(x_chr == NA_STRING || (any_na && carry_i)) {
+      any_na = 1;
+      SET_STRING_ELT(res, i, NA_STRING);
+      continue;
+    }
+    if(carry_i) FANSI_state_copy_fmt(&state, &state_carry);
+    SEXP sgr_i = VECTOR_ELT(sgr, i);
+    int n = (int) XLENGTH(sgr_i);
+    const int * start_i = INTEGER(VECTOR_ELT(start, i));
+    const int * stop_i = INTEGER(VECTOR_ELT(stop, i));
+
+    // Drop NA and empty ranges, and sort the rest by `start` if needed
+    int m = 0, sorted = 1;
+    for(int k = 0; k < n; ++k) {
+      if(
+        start_i[k] == NA_INTEGER || stop_i[k] == NA_INTEGER ||
+        STRING_ELT(sgr_i, k) == NA_STRING || stop_i[k] < start_i[k]
+      )
+        continue;
+      if(m && start_i[k] < start_s[m - 1]) sorted = 0;
+      start_s[m] = start_i[k];
+      at[m++] = k;
+    }
+    if(!sorted) R_qsort_int_I(start_s, at, 1, m);
+    for(int k = 0; k < m; ++k) {
+      stop_s[k] = stop_i[at[k]];
+      if(k && start_s[k] <= stop_s[k - 1])
+        error(
+          "Ranges to style in element [%jd] overlap; %s",
+          FANSI_ind(i), "they must be disjoint."
+        );
+    }
+    // - Compute Points --------------------------------------------------------
+
+    int has_utf8 = getCharCE(x_chr) == CE_UTF8;
+    int w = 0, n_ev = 0;
+    for(int k = 0; k < m; ++k) {
+      SEXP sgr_chr = STRING_ELT(sgr_i, at[k]);
+      FANSI_check_chrsxp(sgr_chr, i);
+      s[w] = state;
+      s[w].string = CHAR(sgr_chr);
+      s[w].len = LENGTH(sgr_chr);
+      FANSI_reset_state(&s[w]);
+      while(s[w].string[s[w].pos.x]) {
+        FANSI_read_next(&s[w], i, "sgr");
+        if(s[w].pos.w)
+          error(
+            "Argument `sgr` may only contain Control Sequences, %s [%jd].",
+            "but has other characters at index", FANSI_ind(i)
+          );
+        if(s[w].status & CTL_MASK & ~(CTL_SGR | CTL_URL))
+          error(
+            "Argument `sgr` may only contain SGR and OSC hyperlink %s [%jd].",
+            "sequences, but has other Control Sequences at index",
+            FANSI_ind(i)
+          );
+      }
+      s[w].settings &= ~WARN_MASK;
+      has_utf8 = has_utf8 || getCharCE(sgr_chr) == CE_UTF8;
+
+      a[w] = state;
+      FANSI_read_until(&a[w], start_s[k] - 1, ov_start, 1, 0, i, arg);
+      b[w] = a[w];
+      FANSI_read_until(&b[w], stop_s[k], ov_stop, 1, 1, i, arg);
+      state = b[w];
+      // Ranges past the end or rounded away style nothing
+      if(b[w].pos.w > a[w].pos.w) {
+        ev0[w] = n_ev;
+        end[w] = style_record(
+          a[w], b[w], s[w], &s[w], &ev_sxp, ipx, &n_ev, i
+        );
+        ++w;
+      }
+    }
+    ev0[w] = n_ev;
+    // - Write -----------------------------------------------------------------
+
+    if(w) {
+      const struct style_ev * ev = (const struct style_ev *) RAW(ev_sxp);
+      for(int k = 0; k < 2; ++k) {
+        if(!k) FANSI_reset_buff(&buff);
+        else   FANSI_size_buff(&buff);
+        style_write(&buff, x_chr, a, b, s, end, ev, ev0, w, norm_i, i);
+      }
+      SET_STRING_ELT(
+        res, i, FANSI_mkChar(buff, has_utf8 ? CE_UTF8 : CE_NATIVE, i)
+      );
+    } else SET_STRING_ELT(res, i, x_chr);
+
+    if(carry_i) {
+      FANSI_read_all(&state, i, arg);
+      FANSI_state_copy_fmt(&state_carry, &state);
+  } }
+  FANSI_release_buff(&buff, 1);
+  UNPROTECT(prt);
+  return res;
+}
@@ -31,13 +31,15 @@ static int has_8bit(const char * x) {
  *
  * @param state_start starting state, will be overwritten.
  * @param state_stop write only.
+ * @param idx parsed string index to seek the start with, or NULL.
+ * @param chr the CHARSXP being read, for checkpointed seeks (see seek.c).
  * @return width of substring, in whatever width units have been selected.
  */
 
 static int substr_range(
   struct FANSI_state * state_start, struct FANSI_state * state_stop,
   R_xlen_t i, int start, int stop, int rnd_i, int term_i,
-  const char * arg
+  struct FANSI_index * idx, SEXP chr, const char * arg
 ) {
   *state_stop = *state_start;
   int start0 = start - 1;     // start wants the beginning byte
@@ -57,6 +59,8 @@ static int substr_range(
     if(state_tmp.status & STAT_SPECIAL) *state_start = state_tmp;
     state_start->status |= state_tmp.status & STAT_WARNED;
   } else {
+    if(!(idx && FANSI_index_seek(idx, i, state_start, start0)))
+      FANSI_seek(state_start, chr, start0);
     FANSI_read_until(state_start, start0, overshoot, term_i, mode, i, arg);
   }
   // - End Point -------------------------------------------------------------
@@ -73,27 +77,18 @@ static int substr_range(
 }
 
 /*
- * @param state modified by reference.
- * @param state_ref state at end of previous extracted substring.
- * @param mode whether in measure (0) or write (1) mode
- * @return if in measure, an integer vector with the size of the substring,
- *   otherwise the substring.
+ * Write out a substring computed by `substr_range`.
+ *
+ * @param ref state at end of previous extracted substring, to bridge from.
+ * @return the substring as a CHARSXP.
  */
-
-static SEXP substr_one(
-  struct FANSI_state * state, struct FANSI_state ref, struct FANSI_buff * buff,
-  R_xlen_t i, int start, int stop, int rnd_i, int norm_i, int term_i
+static SEXP substr_write(
+  struct FANSI_state ref,
+  struct FANSI_state state_start, struct FANSI_state state_stop,
+  struct FANSI_buff * buff, R_xlen_t i, int start, int stop,
+  int norm_i, int term_i
 ) {
-  struct FANSI_state state_start, state_stop;
-  state_start = state_stop = *state;
-  if(term_i) FANSI_reset_state(state);
-  else state->fmt = ref.fmt;
   const char * arg  = "x";
-  substr_range(
-    &state_start, &state_stop, i, start, stop, rnd_i, term_i, arg
-  );
-  // - Extract ---------------------------------------------------------------
-
   SEXP res;
   int empty_string = state_stop.pos.x == state_start.pos.x;
   if(!(empty_string && term_i) && stop > 0 && stop >= start) {
@@ -105,7 +100,7 @@ static SEXP substr_one(
 
       // Use bridge do write opening styles to account for potential carry and
       // similar in the input state.
-      FANSI_W_bridge(buff, *state, state_start, norm_i, i, err_msg);
+      FANSI_W_bridge(buff, ref, state_start, norm_i, i, err_msg);
 
       // Actual string, remember state_stop.pos.x is one past what we need
       int stop = state_stop.pos.x;
@@ -113,7 +108,7 @@ static SEXP substr_one(
         buff, state_start, norm_i, stop, i, err_msg, arg
       );
       // And turn off CSI styles if needed
-      if(term_i) FANSI_W_close(buff, state_stop.fmt, norm_i, i);
+      if(term_i) FANSI_W_close(buff, FANSI_state_fmt(&state_stop), norm_i, i);
     }
     cetype_t chr_type = CE_NATIVE;
     if(state_stop.utf8 > state_start.pos.x) chr_type = CE_UTF8;
@@ -121,16 +116,144 @@ static SEXP substr_one(
   } else {
     res = R_BlankString;
   }
+  return res;
+}
+/*
+ * @param state modified by reference.
+ * @param state_ref state at end of previous extracted substring.
+ * @param mode whether in measure (0) or write (1) mode
+ * @param idx parsed string index, or NULL.
+ * @param chr the CHARSXP being read.
+ * @return if in measure, an integer vector with the size of the substring,
+ *   otherwise the substring.
+ */
+
+static SEXP substr_one(
+  struct FANSI_state * state, struct FANSI_state ref, struct FANSI_buff * buff,
+  R_xlen_t i, int start, int stop, int rnd_i, int norm_i, int term_i,
+  struct FANSI_index * idx, SEXP chr
+) {
+  struct FANSI_state state_start, state_stop;
+  state_start = state_stop = *state;
+  if(term_i) FANSI_reset_state(state);
+  else FANSI_state_copy_fmt(state, &ref);
+  const char * arg  = "x";
+  substr_range(
+    &state_start, &state_stop, i, start, stop, rnd_i, term_i, idx, chr, arg
+  );
+  SEXP res = substr_write(
+    *state, state_start, state_stop, buff, i, start, stop, norm_i, term_i
+  );
   // Carry handled in `substr_extract`
   *state = state_stop;
   return res;
 }
+/*
+ * Advance a Chunk Cursor
+ *
+ * Moves `cursor` a chunk at a time (see `FANSI_read_chunk`) to the last chunk
+ * end with width less than `until`.  These are points a full read also passes
+ * through, so reading can resume from them.  Points with joiner or regional
+ * indicator state pending are passed over as `FANSI_read_until` does not
+ * resume that state.
+ *
+ * @return 0 if the cursor was stopped before a chunk that would warn or error,
+ *   in which case reads must resume from before it so those are emitted, 1
+ *   otherwise.
+ */
+static int cursor_advance(struct FANSI_state * cursor, int until) {
+  struct FANSI_state tmp = *cursor;
+  while(tmp.string[tmp.pos.x] && tmp.pos.w < until) {
+    struct FANSI_state next = tmp;
+    FANSI_read_chunk(&next, until - 1);
+    unsigned int err = FANSI_GET_ERR(next.status);
+    if(
+      err == ERR_BAD_UTF8 ||
+      (err && (next.settings & (1U << (SET_WARN + err - 1U))))
+    )
+      return 0;
+    if(
+      next.pos.w >= until || next.pos.x <= tmp.pos.x ||
+      !next.string[next.pos.x]
+    )
+      break;
+    tmp = next;
+    if(!(tmp.status & (STAT_ZWJ | STAT_RI))) *cursor = tmp;
+  }
+  return 1;
+}
+/*
+ * Extract Several Substrings From One Element
+ *
+ * Produces the same substrings as `substr_one` would for each of the ranges in
+ * turn, but reads the element once.  Ranges must be sorted by `start`.
+ *
+ * Reads for each range resume from a cursor that is advanced a chunk at a time
+ * (see `FANSI_read_chunk`), as these are points a full read also passes
+ * through.  Resuming from arbitrary points, e.g. the end of the previous
+ * substring, could change how the characters either side are measured.  As
+ * with seek.c the cursor stops before anything that warns or errors so those
+ * are still emitted.
+ *
+ * @param state at the beginning of the element, with any carried format
+ *   applied.  Set to the end of the last substring.
+ * @param ref state at the end of the previous extracted substring, updated to
+ *   the end of the last substring if `carry_i`.
+ * @param start, stop the `n` ranges.
+ * @param res character vector to write the substrings into, from `off`.
+ * @param at where in `res` to write each substring relative to `off`, or NULL
+ *   to write them in order.
+ * @param by_pos whether each substring is read as if from its own copy of the
+ *   element, as in `strsplit_ctl`, so that warnings are not shared between
+ *   them, and warnings and errors report where in `res` the substring is
+ *   written instead of `i`.
+ */
+void FANSI_substr_multi(
+  struct FANSI_state * state, struct FANSI_state * ref,
+  struct FANSI_buff * buff, R_xlen_t i,
+  const int * start, const int * stop, int n,
+  int rnd_i, int norm_i, int term_i, int carry_i,
+  SEXP res, R_xlen_t off, const int * at, int by_pos
+) {
+  struct FANSI_state origin, cursor, state_start, state_stop, state_ref;
+  origin = cursor = state_stop = *state;
+  int frozen = 0;
+  const char * arg = "x";
+
+  for(int k = 0; k < n; ++k) {
+    if(k && start[k] < start[k - 1])
+      error("Internal Error: unsorted substring ranges.");  // nocov
+    int start0 = start[k] - 1;
+    if(!frozen) frozen = !cursor_advance(&cursor, start0);
+    // Ranges starting before the string consume leading specials only
+    state_start = start[k] < 1 ? origin : cursor;
+    state_start.status = origin.status;
+    if(!by_pos) state_start.status |= state_stop.status & STAT_WARNED;
+    state_ref = origin;
+    if(term_i) FANSI_reset_state(&state_ref);
+    else FANSI_state_copy_fmt(&state_ref, ref);
+    R_xlen_t pos = off + (at ? at[k] : k);
+    R_xlen_t ind = by_pos ? pos : i;
+    substr_range(
+      &state_start, &state_stop, ind, start[k], stop[k], rnd_i, term_i, NULL,
+      R_NilValue, arg
+    );
+    SET_STRING_ELT(
+      res, pos,
+      substr_write(
+        state_ref, state_start, state_stop, buff, ind, start[k], stop[k],
+        norm_i, term_i
+    ) );
+    if(carry_i) *ref = state_stop;
+  }
+  *state = state_stop;
+}
 // Extract Substring (`substr_ctl`)
 
 static SEXP substr_extract(
   SEXP x, SEXP start, SEXP stop, SEXP carry,
   struct FANSI_state state, struct FANSI_buff * buff,
-  int rnd_i, int norm_i, int term_i
+  int rnd_i, int norm_i, int term_i, struct FANSI_index * idx
 ) {
   R_xlen_t len = XLENGTH(x);
   if(len < 1) error("Internal Error: must have at least one value.");
@@ -144,6 +267,7 @@ static SEXP substr_extract(
   state_carry = state;
   if(carry_i) {
     state_carry.string = CHAR(STRING_ELT(carry, 0));
+    state_carry.len = LENGTH(STRING_ELT(carry, 0));
     FANSI_read_all(&state_carry, 0, "carry");
   }
   // assume carry is active for 1st  iteration.  It may not be the case in later
@@ -168,21 +292,190 @@ static SEXP substr_extract(
       SET_STRING_ELT(res, i, NA_STRING);
     } else {
       // We do the full process even if stop_ii < start_ii for consistency
-      if(carry_i) state.fmt = state_carry.fmt;
+      if(carry_i) FANSI_state_copy_fmt(&state, &state_carry);
       SET_STRING_ELT(
         res, i,
         substr_one(
           &state, state_ref, buff, i,
-          start_ii, stop_ii, rnd_i, norm_i, term_i
+          start_ii, stop_ii, rnd_i, norm_i, term_i, idx, STRING_ELT(x, i)
     ) );}
     if(carry_i && STRING_ELT(x, i) != NA_STRING) {
       state_ref = state;
       FANSI_read_all(&state, i, arg);
-      state_carry.fmt = state.fmt;
+      FANSI_state_copy_fmt(&state_carry, &state);
   } }
   UNPROTECT(prt);
   return res;
 }
+/*
+ * Whether a full read from `cursor` passes through `target`, where `target` is
+ * the result of consuming only leading controls from `cursor`.  If so `cursor`
+ * is set to `target`, otherwise it is left unchanged.
+ */
+static int cursor_align(
+  struct FANSI_state * cursor, struct FANSI_state target
+) {
+  struct FANSI_state tmp = *cursor;
+  while(tmp.pos.x < target.pos.x) {
+    const char c = tmp.string[tmp.pos.x];
+    if(!c || IS_PRINT(c) || IS_UTF8(c)) return 0;
+    FANSI_read_chunk(&tmp, target.pos.w);
+  }
+  if(tmp.pos.x != target.pos.x) return 0;
+  *cursor = target;
+  return 1;
+}
+// Resume reading at `cursor`, remembering whether `prev` already warned.
+
+static struct FANSI_state resume(
+  struct FANSI_state cursor, struct FANSI_state prev
+) {
+  cursor.status |= prev.status & STAT_WARNED;
+  return cursor;
+}
+/*
+ * Chunk cursors into an element of `x` for computing replacement points.
+ *
+ * Reads for the end of a lead start past the leading controls (`ld`), and
+ * those for the start of a trail from the beginning of the string.  If a full
+ * read passes through `ld` the two share a path and only `cur_ld` is used.
+ * Cursors only move forward, so successive replacements in an element must be
+ * sorted and must not overlap.  `ld` also records whether `x` warned already.
+ */
+struct replace_x {
+  struct FANSI_state ld, cur_ld, cur_tr;
+  int aligned, frz_ld, frz_tr;
+};
+static struct replace_x replace_x_init(
+  struct FANSI_state x, R_xlen_t i, int rnd_i, int term_i
+) {
+  struct replace_x xc;
+  int ov_start = !(rnd_i == RND_START || rnd_i == RND_BOTH);
+  // Leading controls are consumed as for any substring starting at 1
+  xc.ld = xc.cur_tr = x;
+  FANSI_read_until(&xc.ld, 0, ov_start, term_i, 0, i, "x");
+  xc.aligned = cursor_align(&xc.cur_tr, xc.ld);
+  xc.cur_ld = xc.ld;
+  xc.frz_ld = xc.frz_tr = 0;
+  return xc;
+}
+/*
+ * Compute the points for replacing a substring.
+ *
+ * For `x` the start and end points we're computing are for the string we're
+ * REMOVING, so logic is a bit weird.
+ *
+ * In: substr_ctl(x, 3, 5) <- v
+ *   1 2 3 4 5 6
+ *  .x.x.x.x.x.x.x.x      .v.v.v
+ *     |       |           |   |
+ *     x0      x1          v0  v1
+ *
+ * `x2` is one "char" into the trail.  We don't need to read the entire trail,
+ * we just need to check it has at least one.
+ *
+ * The points are the same as separately reading each substring from the
+ * beginning of the strings would produce, but `x` is read forward from the
+ * cursors in `xc` (see `cursor_advance`) and `value` once.  Warnings are thus
+ * issued at most once per element for each.
+ *
+ * @param xc cursors into the element of `x`, advanced to the points.
+ * @param v state at the beginning of the element of `value`, with any carried
+ *   format applied.
+ * @param floor if not NULL, `x0` is moved forward to it if it is before it,
+ *   e.g. the end of a previous replacement.
+ * @return the width position of the start of the trail, possibly moved forward
+ *   so the replacement fits.
+ */
+static int replace_range(
+  struct replace_x * xc, struct FANSI_state v, R_xlen_t i,
+  int start, int stop, int rnd_i, int term_i, struct FANSI_state * floor,
+  struct FANSI_state * x0, struct FANSI_state * x1, struct FANSI_state * x2,
+  struct FANSI_state * v0, struct FANSI_state * v1
+) {
+  int ov_start = !(rnd_i == RND_START || rnd_i == RND_BOTH);
+  int ov_stop = rnd_i == RND_STOP || rnd_i == RND_BOTH;
+  // Remember that start/stop are 1 indexed, but bounds are "zero" indexed.
+  // (they are just a measure of width accrued prior to point).
+  // ld = lead, tr = trail
+  int stop_ld = start < 1 ? 1 : start;
+  int start_tr = stop + 1;
+  int stop_v = start_tr - stop_ld;
+
+  // - Lead and Trail of `x` ---------------------------------------------------
+
+  if(!xc->frz_ld) xc->frz_ld = !cursor_advance(&xc->cur_ld, stop_ld - 1);
+  *x0 = resume(xc->cur_ld, xc->ld);
+  FANSI_read_until(x0, stop_ld - 1, ov_stop, term_i, 1, i, "x");
+  if(floor && x0->pos.x < floor->pos.x) *x0 = resume(*floor, *x0);
+
+  if(start_tr > 1) {
+    struct FANSI_state * cur = &xc->cur_tr, tmp;
+    int * frz = &xc->frz_tr, frz_tmp = 0;
+    if(xc->aligned) {
+      if(start_tr >= stop_ld) {
+        cur = &xc->cur_ld;
+        frz = &xc->frz_ld;
+      } else {
+        tmp = xc->ld;
+        cur = &tmp;
+        frz = &frz_tmp;
+    } }
+    if(!*frz) *frz = !cursor_advance(cur, start_tr - 1);
+    *x1 = resume(*cur, *x0);
+    FANSI_read_until(x1, start_tr - 1, ov_start, term_i, 0, i, "x");
+  } else *x1 = resume(xc->ld, *x0);
+  *x2 = *x1;
+  FANSI_read_until(x2, start_tr, ov_stop, term_i, 1, i, "x");
+  xc->ld.status |= x2->status & STAT_WARNED;
+
+  // - Replacement -------------------------------------------------------------
+
+  struct FANSI_state cur_v;
+  *v0 = v;
+  FANSI_read_until(v0, 0, ov_start, term_i, 0, i, "value");
+  cur_v = *v0;
+  cursor_advance(&cur_v, stop_v - 1);
+  *v1 = resume(cur_v, *v0);
+  FANSI_read_until(v1, stop_v, ov_stop, term_i, 1, i, "value");
+
+  int size_x = x1->pos.w - x0->pos.w;
+  int size_v = v1->pos.w - v0->pos.w;
+
+  // Adjustments if substring does not fit exactly
+  if(size_v > size_x) {
+    // Reduce the size of the replacement by 1 to see if it fits that way.
+    // Implicit here is that the widths are all either 1 or 2, which may not
+    // be the case when a \U code is rendered (but that should only be for
+    // EncodeString, which we don't care about).  This re-reads from the start
+    // point, so only resume from the cursor if that did not move.
+    struct FANSI_state v0b = resume(*v0, *v1);
+    FANSI_read_until(&v0b, 0, ov_start, term_i, 0, i, "value");
+    *v1 = resume(v0b.pos.x == v0->pos.x ? cur_v : v0b, v0b);
+    *v0 = v0b;
+    FANSI_read_until(v1, stop_v - 1, ov_stop, term_i, 1, i, "value");
+    size_v = v1->pos.w - v0->pos.w;
+    // Reduction didn't work, collapse size_v;
+    if(size_v > size_x) {
+      *v1 = *v0;
+      size_v = 0;
+  } }
+  if(size_v < size_x) {
+    // Scooch forward trail by gap amount if replacement is too small.  This is
+    // the one read that does not resume from a cursor, but it only spans the
+    // replaced part of `x`.
+    struct FANSI_state x11 = resume(*x0, xc->ld);
+    int start_tr2 = x1->pos.w - (size_x - size_v) + 1;
+    FANSI_read_until(&x11, start_tr2 - 1, ov_start, term_i, 0, i, "x");
+    xc->ld.status |= x11.status & STAT_WARNED;
+    int size_x1 = x11.pos.w - x0->pos.w;
+    if(size_v <= size_x1) {
+      start_tr = start_tr2;
+      // We explicilty do not reset _x2 as that doesn't move
+      *x1 = x11;
+  } }
+  return start_tr;
+}
 // Replace Substring (`substr_ctl<-`)
 
 static SEXP substr_replace(
@@ -229,75 +522,20 @@ static SEXP substr_replace(
     FANSI_state_reinit(&st_x0, x, i);
     FANSI_state_reinit(&st_v0, value, i);
     if(carry_i == 1) {
-      st_x0.fmt = st_xlast.fmt;
-      st_v0.fmt = st_vlast.fmt;
+      FANSI_state_copy_fmt(&st_x0, &st_xlast);
+      FANSI_state_copy_fmt(&st_v0, &st_vlast);
     }
-    st_x2 = st_x1 = st_x0;
-
-    // Remember that start/stop are 1 indexed, but bounds are "zero" indexed.
-    // (they are just a measure of width accrued prior to point).
-    int start_ii, stop_ii, stop_ld, start_tr, start_v, stop_v;
-    start_ii = start_i[i];
-    stop_ii = stop_i[i];
-    // ld = lead, tr = trail
-    stop_ld = start_ii < 1 ? 1 : start_ii;
-    start_tr = stop_ii + 1;
-    start_v = 1;
-    stop_v = start_tr - stop_ld;
+
+    int start_ii = start_i[i];
+    int stop_ii = stop_i[i];
 
     // - Compute Lengths -------------------------------------------------------
 
-    // For `x` the start and end points we're computing are for the string we're
-    // REMOVING, so logic is a bit weird.
-    //
-    // In: substr_ctl(x, 3, 5) <- v
-    //   1 2 3 4 5 6
-    //  .x.x.x.x.x.x.x.x      .v.v.v
-    //     |       |           |   |
-    //     x0      x1          v0  v1
-
-    // We want the values in _x0 and _x1, using _x2 as dummy in the first call
-    // as we don't care about preserving the very start point.  We don't need to
-    // read the entire trail, we just need to check it has at leas one "char".
-    substr_range(&st_x2, &st_x0, i, 1, stop_ld - 1, rnd_i, term_i, "x");
-    // trail of x, we just need the first character position since
-    // we're going to copy the entire string after that.
-    substr_range(&st_x1, &st_x2, i, start_tr, start_tr, rnd_i, term_i, "x");
-    // More straightforward for the `value`
-    substr_range(&st_v0, &st_v1, i, start_v, stop_v, rnd_i, term_i, "value");
-
-    int size_x = st_x1.pos.w - st_x0.pos.w;
-    int size_v = st_v1.pos.w - st_v0.pos.w;
-
-    // Adjustments if substring does not fit exactly
-    if(size_v > size_x) {
-      // Reduce the size of the replacement by 1 to see if it fits that way.
-      // Implicit here is that the widths are all either 1 or 2, which may not
-      // be the case when a \U code is rendered (but that should only be for
-      // EncodeString, which we don't care about).
-      stop_v = stop_v - 1;
-      substr_range(&st_v0, &st_v1, i, start_v, stop_v, rnd_i, term_i, "value");
-      size_v = st_v1.pos.w - st_v0.pos.w;
-      if(size_v > size_x) {
-        // Reduction didn't work, collapse size_v;
-        st_v1 = st_v0;
-        size_v = 0;
-        stop_v = start_v - 1;
-    } }
-    if (size_v < size_x) {
-      // Scooch forward trail by gap amount if replacement is too small
-      struct FANSI_state st_x11, st_x21;
-      st_x11 = st_x0;
-      int start_tr2 = st_x1.pos.w - (size_x - size_v) + 1;
-      substr_range(
-        &st_x11, &st_x21, i, start_tr2, start_tr, rnd_i, term_i, "x"
-      );
-      int size_x1 = st_x11.pos.w - st_x0.pos.w;
-      if(size_v <= size_x1) {
-        start_tr = start_tr2;
-        // We explicilty do not reset _x2 as that doesn't move
-        st_x1 = st_x11;
-    } }
+    struct replace_x xc = replace_x_init(st_x0, i, rnd_i, term_i);
+    int start_tr = replace_range(
+      &xc, st_v0, i, start_ii, stop_ii, rnd_i, term_i, NULL,
+      &st_x0, &st_x1, &st_x2, &st_v0, &st_v1
+    );
     // - Extract String --------------------------------------------------------
 
     // Which portions of the strings are we actually writing out?
@@ -323,7 +561,7 @@ static SEXP substr_replace(
         // Lead
         if(write_ld) {
           FANSI_W_MCOPY(buff, st_x0.string, st_x0.pos.x);
-          if(term_i) FANSI_W_close(buff, st_x0.fmt, norm_i, i);
+          if(term_i) FANSI_W_close(buff, FANSI_state_fmt(&st_x0), norm_i, i);
         }
         // Replacement
         if(write_md) {
@@ -331,13 +569,13 @@ static SEXP substr_replace(
           FANSI_W_normalize_or_copy(
             buff, st_v0, norm_i, st_v1.pos.x, i, err_msg, "value"
           );
-          if(term_i) FANSI_W_close(buff, st_v1.fmt, norm_i, i);
+          if(term_i) FANSI_W_close(buff, FANSI_state_fmt(&st_v1), norm_i, i);
         }
         // Trailing string
         if(write_tr) {
           if(write_ld && !term_i) st_xref = st_x0;
           FANSI_W_bridge(buff, st_xref, st_x1, norm_i, i, err_msg);
-          int x_bytes = strlen(st_x1.string) - st_x1.pos.x;
+          int x_bytes = LENGTH(STRING_ELT(x, i)) - st_x1.pos.x;
           x1_string = st_x1.string + st_x1.pos.x;
           FANSI_W_MCOPY(buff, x1_string, x_bytes);
         }
@@ -362,6 +600,113 @@ static SEXP substr_replace(
   UNPROTECT(prt);
   return res;
 }
+/*
+ * Replace Several Substrings in One Element
+ *
+ * Each replacement is computed as `substr_replace` computes it on its own, but
+ * `x` is read forward once for all of them and the parts of it between
+ * replacements are copied once.  Replacements must be sorted by `start` and
+ * not overlap.  Those that would leave `x` unchanged on their own, e.g. an
+ * empty `value` with `terminate`, are skipped.
+ *
+ * @param x state at the beginning of the element, with any carried format
+ *   applied.  Set to the start of the trail after the last replacement.
+ * @param v state at the end of the previous value, to carry the format of if
+ *   `carry_i`, updated to the end of the last one written.
+ * @param vref state at the end of the previously written value, to bridge from
+ *   when not terminating, updated to the end of the last one written.
+ * @param ref state to bridge from into the trail of a replacement when not
+ *   carrying the lead state into it.
+ * @param value the replacement strings, `at` giving the one for each range.
+ * @param pts scratch memory for `4 * n` states.
+ */
+static SEXP replace_multi(
+  struct FANSI_state * x, struct FANSI_state * v, struct FANSI_state * vref,
+  struct FANSI_state ref, struct FANSI_buff * buff, R_xlen_t i, SEXP x_chr,
+  const int * start, const int * stop, SEXP value, const int * at, int n,
+  int rnd_i, int norm_i, int term_i, int carry_i, struct FANSI_state * pts
+) {
+  struct FANSI_state * x0 = pts, * x1 = pts + n, * v0 = pts + 2 * n,
+    * v1 = pts + 3 * n;
+  struct FANSI_state x2, v_k;
+  struct replace_x xc = replace_x_init(*x, i, rnd_i, term_i);
+  int write_ld, write_tr, has_utf8, m;
+  write_ld = write_tr = m = 0;
+  has_utf8 = getCharCE(x_chr) == CE_UTF8;
+
+  // - Compute Points ----------------------------------------------------------
+
+  for(int k = 0; k < n; ++k) {
+    SEXP v_chr = STRING_ELT(value, at[k]);
+    FANSI_check_chrsxp(v_chr, i);
+    v_k = *v;
+    v_k.string = CHAR(v_chr);
+    v_k.len = LENGTH(v_chr);
+    FANSI_reset_state(&v_k);
+    if(carry_i) FANSI_state_copy_fmt(&v_k, v);
+    int start_tr = replace_range(
+      &xc, v_k, i, start[k], stop[k], rnd_i, term_i, m ? &x1[m - 1] : NULL,
+      &x0[m], &x1[m], &x2, &v0[m], &v1[m]
+    );
+    if(v1[m].pos.x == v0[m].pos.x && term_i) continue;
+    if(!m)
+      write_ld = start[k] > 0 &&
+        (x0[m].pos.w > 0 || !(x0[m].status & CTL_ALL) || !term_i);
+    write_tr = (start_tr - 1) <= x2.pos.w;
+    has_utf8 = has_utf8 || getCharCE(v_chr) == CE_UTF8;
+    if(carry_i) {
+      *v = v1[m];
+      FANSI_read_all(v, i, "value");
+    }
+    ++m;
+  }
+  *x = m ? x1[m - 1] : xc.ld;
+  x->status |= xc.ld.status & STAT_WARNED;
+  if(!m) return x_chr;
+
+  // - Write -------------------------------------------------------------------
+
+  const char * err_msg = "Replacing substrings";
+  struct FANSI_state vref0 = *vref, xref0 = ref;
+  for(int k = 0; k < 2; ++k) {
+    if(!k) FANSI_reset_buff(buff);
+    else   FANSI_size_buff(buff);
+    *vref = vref0;
+    ref = xref0;
+
+    for(int j = 0; j < m; ++j) {
+      // Lead, or part between this and the previous replacement
+      int lead = j ? x0[j].pos.x > x1[j - 1].pos.x : write_ld;
+      if(lead) {
+        if(j) {
+          FANSI_W_bridge(buff, ref, x1[j - 1], norm_i, i, err_msg);
+          FANSI_W_MCOPY(
+            buff, x1[j - 1].string + x1[j - 1].pos.x,
+            x0[j].pos.x - x1[j - 1].pos.x
+          );
+        } else FANSI_W_MCOPY(buff, x0[j].string, x0[j].pos.x);
+        if(term_i) FANSI_W_close(buff, FANSI_state_fmt(&x0[j]), norm_i, i);
+        else ref = x0[j];
+      }
+      // Replacement
+      FANSI_W_bridge(buff, *vref, v0[j], norm_i, i, err_msg);
+      FANSI_W_normalize_or_copy(
+        buff, v0[j], norm_i, v1[j].pos.x, i, err_msg, "value"
+      );
+      if(term_i) FANSI_W_close(buff, FANSI_state_fmt(&v1[j]), norm_i, i);
+      else *vref = v1[j];
+    }
+    // Trailing string
+    if(write_tr) {
+      FANSI_W_bridge(buff, ref, x1[m - 1], norm_i, i, err_msg);
+      FANSI_W_MCOPY(
+        buff, x1[m - 1].string + x1[m - 1].pos.x,
+        LENGTH(x_chr) - x1[m - 1].pos.x
+      );
+    }
+  }
+  return FANSI_mkChar(*buff, has_utf8 ? CE_UTF8 : CE_NATIVE, i);
+}
 
 SEXP FANSI_substr(
   SEXP x,
@@ -378,6 +723,12 @@ SEXP FANSI_substr(
     error("Internal Error: invalid `rnd`."); // nocov
   if(!FANSI_is_tf(terminate))
     error("Internal Error: invalid `terminate`."); // nocov
+
+  // Parsed string index may be provided in lieu of `x` (see index.c)
+  struct FANSI_index index;
+  struct FANSI_index * idx = FANSI_index_get(&index, x);
+  if(idx) x = idx->x;
+
   if(TYPEOF(type) == INTSXP && XLENGTH(type) == 1) {
     switch(asInteger(type)) {
       case COUNT_CHARS:
@@ -422,10 +773,13 @@ SEXP FANSI_substr(
     state = FANSI_state_init_full(
       x, warn, term_cap, allowNA, keepNA, type, ctl, (R_xlen_t) 0
     );
+    PROTECT(state.tab->mem); ++prt;
+    // Long strings read repeatedly are checkpointed (see seek.c)
+    FANSI_seek_cache_next();
     // Note, UNPROTECT'ed SEXPs returned below
     if(value == R_NilValue) {
       res = substr_extract(
-        x, start, stop, carry, state, &buff, rnd_i, norm_i, term_i
+        x, start, stop, carry, state, &buff, rnd_i, norm_i, term_i, idx
       );
     } else {
       res = substr_replace(
@@ -435,6 +789,274 @@ SEXP FANSI_substr(
   } else res = allocVector(STRSXP, len);
   PROTECT(res); ++prt;
 
+  FANSI_seek_cache_next();
+  FANSI_release_buff(&buff, 1);
+  UNPROTECT(prt);
+  return res;
+}
+/*
+ * Extract Several Substrings From Each Element (`substr_ctl_multi`)
+ *
+ * Ranges are sorted by `start` so that each element is read forward once (see
+ * `FANSI_substr_multi`), and substrings are returned in the order the ranges
+ * were provided.  Ranges with NA bounds produce NA.
+ *
+ * @param start, stop lists the same length as `x` of integer vectors of
+ *   matching lengths.
+ * @return a list of character vectors.
+ */
+SEXP FANSI_substr_multi_ext(
+  SEXP x, SEXP start, SEXP stop,
+  SEXP type, SEXP rnd,
+  SEXP warn, SEXP term_cap,
+  SEXP ctl, SEXP norm,
+  SEXP carry, SEXP terminate
+) {
+  if(TYPEOF(x) != STRSXP)
+    error("Internal Error: `x` must be character.");  // nocov
+  R_xlen_t len = XLENGTH(x);
+  if(
+    TYPEOF(start) != VECSXP || TYPEOF(stop) != VECSXP ||
+    XLENGTH(start) != len || XLENGTH(stop) != len
+  )
+    error("Internal Error: invalid `start` or `stop`.");  // nocov
+  if(TYPEOF(rnd) != INTSXP || XLENGTH(rnd) != 1)
+    error("Internal Error: invalid `rnd`."); // nocov
+  if(!FANSI_is_tf(terminate))
+    error("Internal Error: invalid `terminate`."); // nocov
+  FANSI_val_args(x, norm, carry);
+
+  int prt = 0;
+  SEXP res = PROTECT(allocVector(VECSXP, len)); ++prt;
+  if(!len) {
+    UNPROTECT(prt);
+    return res;
+  }
+  int rnd_i = asInteger(rnd);
+  int norm_i = asLogical(norm);
+  int term_i = asLogical(terminate);
+  int carry_i = STRING_ELT(carry, 0) != NA_STRING;
+
+  // Scratch memory for the sorted ranges, from R so it does not get in the way
+  // of releasing `buff`.
+  R_xlen_t n_max = 0;
+  for(R_xlen_t i = 0; i < len; ++i) {
+    SEXP start_i = VECTOR_ELT(start, i), stop_i = VECTOR_ELT(stop, i);
+    if(
+      TYPEOF(start_i) != INTSXP || TYPEOF(stop_i) != INTSXP ||
+      XLENGTH(start_i) != XLENGTH(stop_i) || XLENGTH(start_i) > INT_MAX
+    )
+      error("Internal Error: invalid ranges at [%jd].", FANSI_ind(i)); // nocov
+    if(XLENGTH(start_i) > n_max) n_max = XLENGTH(start_i);
+  }
+  SEXP scratch = PROTECT(
+    allocVector(RAWSXP, n_max * 3 * (R_xlen_t) sizeof(int) + 1)
+  ); ++prt;
+  int * start_s = (int *) RAW(scratch);
+  int * stop_s = start_s + n_max;
+  int * at = stop_s + n_max;
+
+  SEXP allowNA, keepNA;
+  allowNA = keepNA = PROTECT(ScalarLogical(0)); ++prt;
+  struct FANSI_state state, state_carry, state_ref;
+  state = FANSI_state_init_full(
+    x, warn, term_cap, allowNA, keepNA, type, ctl, (R_xlen_t) 0
+  );
+  PROTECT(state.tab->mem); ++prt;
+  state_carry = state;
+  if(carry_i) {
+    state_carry.string = CHAR(STRING_ELT(carry, 0));
+    state_carry.len = LENGTH(STRING_ELT(carry, 0));
+    FANSI_read_all(&state_carry, 0, "carry");
+  }
+  state_ref = state_carry;
+
+  struct FANSI_buff buff;
+  FANSI_INIT_BUFF(&buff);
+  int any_na = 0;
+  const char * arg = "x";
+
+  for(R_xlen_t i = 0; i < len; ++i) {
+    FANSI_interrupt(i);
+    FANSI_state_reinit(&state, x, i);
+    SEXP x_chr = STRING_ELT(x, i);
+    int n = (int) XLENGTH(VECTOR_ELT(start, i));
+    SEXP sub = allocVector(STRSXP, n);
+    SET_VECTOR_ELT(res, i, sub);
+    if(x_chr == NA_STRING || (any_na && carry_i)) {
+      any_na = 1;
+      for(int k = 0; k < n; ++k) SET_STRING_ELT(sub, k, NA_STRING);
+      continue;
+    }
+    if(carry_i) FANSI_state_copy_fmt(&state, &state_carry);
+
+    // Drop NA ranges, and sort the rest by `start` if needed
+    const int * start_i = INTEGER(VECTOR_ELT(start, i));
+    const int * stop_i = INTEGER(VECTOR_ELT(stop, i));
+    int m = 0, sorted = 1;
+    for(int k = 0; k < n; ++k) {
+      if(start_i[k] == NA_INTEGER || stop_i[k] == NA_INTEGER) {
+        SET_STRING_ELT(sub, k, NA_STRING);
+        continue;
+      }
+      if(m && start_i[k] < start_s[m - 1]) sorted = 0;
+      start_s[m] = start_i[k];
+      at[m++] = k;
+    }
+    if(!sorted) R_qsort_int_I(start_s, at, 1, m);
+    for(int k = 0; k < m; ++k) stop_s[k] = stop_i[at[k]];
+
+    FANSI_substr_multi(
+      &state, &state_ref, &buff, i, start_s, stop_s, m, rnd_i, norm_i,
+      term_i, carry_i, sub, 0, at, 0
+    );
+    if(carry_i) {
+      FANSI_read_all(&state, i, arg);
+      FANSI_state_copy_fmt(&state_carry, &state);
+  } }
+  FANSI_release_buff(&buff, 1);
+  UNPROTECT(prt);
+  return res;
+}
+/*
+ * Replace Several Substrings in Each Element (`substr_ctl_multi<-`)
+ *
+ * Ranges with `stop` before `start` are dropped and the rest sorted by `start`
+ * so that each element is read forward once (see `replace_multi`).  Elements
+ * with any NA range or replacement are NA.  Values for dropped ranges, and
+ * elements left unchanged, are still read in full so that they are validated
+ * and warned about even when no edit applies.
+ *
+ * @param start, stop, value lists the same length as `x` of integer and
+ *   character vectors of matching lengths.
+ */
+SEXP FANSI_substr_multi_replace_ext(
+  SEXP x, SEXP start, SEXP stop, SEXP value,
+  SEXP type, SEXP rnd,
+  SEXP warn, SEXP term_cap,
+  SEXP ctl, SEXP norm,
+  SEXP carry, SEXP terminate
+) {
+  if(TYPEOF(x) != STRSXP)
+    error("Internal Error: `x` must be character.");  // nocov
+  R_xlen_t len = XLENGTH(x);
+  if(
+    TYPEOF(start) != VECSXP || TYPEOF(stop) != VECSXP ||
+    TYPEOF(value) != VECSXP || XLENGTH(start) != len ||
+    XLENGTH(stop) != len || XLENGTH(value) != len
+  )
+    error("Internal Error: invalid `start`, `stop`, or `value`.");  // nocov
+  if(TYPEOF(rnd) != INTSXP || XLENGTH(rnd) != 1)
+    error("Internal Error: invalid `rnd`."); // nocov
+  if(!FANSI_is_tf(terminate))
+    error("Internal Error: invalid `terminate`."); // nocov
+  FANSI_val_args(x, norm, carry);
+
+  int prt = 0;
+  SEXP res = PROTECT(allocVector(STRSXP, len)); ++prt;
+  if(!len) {
+    UNPROTECT(prt);
+    return res;
+  }
+  int rnd_i = asInteger(rnd);
+  int norm_i = asLogical(norm);
+  int term_i = asLogical(terminate);
+  int carry_i = STRING_ELT(carry, 0) != NA_STRING;
+
+  // Scratch memory for the sorted ranges and their points, from R so it does
+  // not get in the way of releasing `buff`.
+  R_xlen_t n_max = 0;
+  for(R_xlen_t i = 0; i < len; ++i) {
+    SEXP start_i = VECTOR_ELT(start, i), stop_i = VECTOR_ELT(stop, i),
+      value_i = VECTOR_ELT(value, i);
+    if(
+      TYPEOF(start_i) != INTSXP || TYPEOF(stop_i) != INTSXP ||
+      TYPEOF(value_i) != STRSXP || XLENGTH(start_i) != XLENGTH(stop_i) ||
+      XLENGTH(start_i) != XLENGTH(value_i) || XLENGTH(start_i) > INT_MAX
+    )
+      error("Internal Error: invalid ranges at [%jd].", FANSI_ind(i)); // nocov
+    if(XLENGTH(start_i) > n_max) n_max = XLENGTH(start_i);
+  }
+  SEXP scratch = PROTECT(
+    allocVector(
+      RAWSXP,
+      n_max * (4 * (R_xlen_t) sizeof(struct FANSI_state) +
+      3 * (R_xlen_t) sizeof(int)) + 1
+  ) ); ++prt;
+  struct FANSI_state * pts = (struct FANSI_state *) RAW(scratch);
+  int * start_s = (int *) (pts + 4 * n_max);
+  int * stop_s = start_s + n_max;
+  int * at = stop_s + n_max;
+
+  SEXP allowNA, keepNA;
+  allowNA = keepNA = PROTECT(ScalarLogical(0)); ++prt;
+  struct FANSI_state state, state_carry, state_ref, state_v, state_vref,
+    state_chk;
+  state = FANSI_state_init_full(
+    x, warn, term_cap, allowNA, keepNA, type, ctl, (R_xlen_t) 0
+  );
+  PROTECT(state.tab->mem); ++prt;
+  state_carry = state_ref = state_v = state_vref = state_chk = state;
+
+  struct FANSI_buff buff;
+  FANSI_INIT_BUFF(&buff);
+  int any_na = 0;
+  const char * arg = "x";
+
+  for(R_xlen_t i = 0; i < len; ++i) {
+    FANSI_interrupt(i);
+    FANSI_state_reinit(&state, x, i);
+    SEXP x_chr = STRING_ELT(x, i);
+    SEXP value_i = VECTOR_ELT(value, i);
+    int n = (int) XLENGTH(value_i);
+    const int * start_i = INTEGER(VECTOR_ELT(start, i));
+    const int * stop_i = INTEGER(VECTOR_ELT(stop, i));
+
+    // Drop empty ranges, and sort the rest by `start` if needed
+    int m = 0, sorted = 1, na = x_chr == NA_STRING || (any_na && carry_i);
+    state_chk.status = 0;
+    for(int k = 0; k < n && !na; ++k) {
+      na = start_i[k] == NA_INTEGER || stop_i[k] == NA_INTEGER ||
+        STRING_ELT(value_i, k) == NA_STRING;
+      if(na) continue;
+      if(stop_i[k] < start_i[k]) {
+        SEXP v_chr = STRING_ELT(value_i, k);
+        FANSI_check_chrsxp(v_chr, i);
+        unsigned int warned = state_chk.status & STAT_WARNED;
+        state_chk.string = CHAR(v_chr);
+        state_chk.len = LENGTH(v_chr);
+        FANSI_reset_state(&state_chk);
+        state_chk.status |= warned;
+        FANSI_read_all(&state_chk, i, "value");
+        continue;
+      }
+      if(m && start_i[k] < start_s[m - 1]) sorted = 0;
+      start_s[m] = start_i[k];
+      at[m++] = k;
+    }
+    if(na) {
+      any_na = 1;
+      SET_STRING_ELT(res, i, NA_STRING);
+      continue;
+    }
+    if(!sorted) R_qsort_int_I(start_s, at, 1, m);
+    for(int k = 0; k < m; ++k) {
+      stop_s[k] = stop_i[at[k]];
+      if(k && start_s[k] <= stop_s[k - 1])
+        error(
+          "Ranges to replace in element [%jd] overlap; %s",
+          FANSI_ind(i), "they must be disjoint."
+        );
+    }
+    if(carry_i) FANSI_state_copy_fmt(&state, &state_carry);
+    SEXP res_i = replace_multi(
+      &state, &state_v, &state_vref, state_ref, &buff, i, x_chr,
+      start_s, stop_s, value_i, at, m, rnd_i, norm_i, term_i, carry_i, pts
+    );
+    SET_STRING_ELT(res, i, res_i);
+    if(carry_i || res_i == x_chr) FANSI_read_all(&state, i, arg);
+    if(carry_i) FANSI_state_copy_fmt(&state_carry, &state);
+  }
   FANSI_release_buff(&buff, 1);
   UNPROTECT(prt);
   return res;
@@ -60,13 +60,40 @@ static int tab_width(
   return *tab_width - state.pos.w;
 }
 
-SEXP FANSI_tabs_as_spaces(
-  SEXP vec, SEXP tab_stops, struct FANSI_buff * buff,  SEXP warn,
-  SEXP term_cap, SEXP ctl
+/*
+ * Bytes Needed to Expand the Tabs in a String
+ *
+ * Allows `max_tab_stop` for every tab, which should over-allocate but is
+ * faster than computing the actual width.
+ *
+ * @param len bytes in `string`.
+ * @return 0 if there are no tabs in `string`.
+ */
+static int tabs_size(
+  const char * string, int len, int max_tab_stop
 ) {
-  if(TYPEOF(vec) != STRSXP)
-    error("Argument 'vec' should be a character vector"); // nocov
-  R_xlen_t len = XLENGTH(vec);
+  int tab_count = 0;
+  while(*string && (string = strchr(string, '\t'))) {
+    ++tab_count;
+    ++string;
+  }
+  if(!tab_count) return 0;
+
+  int new_buff_size = len;
+  int tab_extra = max_tab_stop - 1;
+
+  for(int k = 0; k < tab_count; ++k) {
+    if(new_buff_size > (FANSI_lim.lim_int.max - tab_extra))
+      error(
+        "%s%s",
+        "Converting tabs to spaces will cause string to be longer than ",
+        "allowed INT_MAX."
+      );
+    new_buff_size += tab_extra;
+  }
+  return new_buff_size;
+}
+static int tab_stop_max(SEXP tab_stops) {
   R_xlen_t len_stops = XLENGTH(tab_stops);
   int * tab_stops_i = INTEGER(tab_stops);
   int max_tab_stop = 1;
@@ -82,9 +109,97 @@ SEXP FANSI_tabs_as_spaces(
     if(tab_stops_i[j] < 1)
       error("Internal Error: stop size less than 1.");  // nocov
   }
+  return max_tab_stop;
+}
+/*
+ * Upper Bound on Bytes Needed to Expand the Tabs in a String
+ *
+ * @param len bytes in `string`.
+ * @return 0 if there are no tabs in `string`.
+ */
+int FANSI_tabs_size(const char * string, int len, SEXP tab_stops) {
+  return tabs_size(string, len, tab_stop_max(tab_stops));
+}
+/*
+ * Expand the Tabs in One String
+ *
+ * @param state at the beginning of the string, advanced to its end if it has
+ *   tabs so that e.g. `state->utf8` may be checked.
+ * @param len bytes in the string.
+ * @param buff buffer the expanded string is written to.  It is only sized and
+ *   written to if the string has tabs.
+ * @return whether the string had tabs.
+ */
+int FANSI_tabs_as_spaces_one(
+  struct FANSI_state * state_p, int len, SEXP tab_stops,
+  struct FANSI_buff * buff, R_xlen_t i
+) {
   const char * err_msg = "Converting tabs to spaces";
   const char * arg = "x";
-  const char * source;
+  R_xlen_t len_stops = XLENGTH(tab_stops);
+  int * tab_stops_i = INTEGER(tab_stops);
+  struct FANSI_state state = *state_p;
+
+  int new_buff_size =
+    tabs_size(state.string, len, tab_stop_max(tab_stops));
+  if(!new_buff_size) return 0;
+
+  // Note: this does not use the measure - write approach; we just
+  // overallocate knowing the upper bound of tab space usage.
+  FANSI_size_buff0(buff, new_buff_size);
+
+  char cur_chr;
+
+  int last_byte = state.pos.x;
+  unsigned int settings = state.settings;  // backup copy of settings
+  int tab_acc_width, tab_stop;
+  tab_acc_width = tab_stop = 0;
+
+  while(1) {
+    cur_chr = state.string[state.pos.x];
+
+    int extra_spaces = 0;
+
+    if(cur_chr == '\t') {
+      extra_spaces =
+        tab_width(state, tab_stops_i, len_stops, &tab_acc_width, &tab_stop);
+    } else if (cur_chr == '\n') {
+      FANSI_reset_width(&state);
+      tab_acc_width = 0;
+      tab_stop = 0;
+    }
+    // Write string
+    if(cur_chr == '\t' || !cur_chr) {
+      int write_bytes = state.pos.x - last_byte;
+      FANSI_W_MCOPY(buff, state.string + last_byte, write_bytes);
+
+      // consume tab and advance, temporarily suppressing warning
+      state.settings &= ~WARN_MASK;
+      FANSI_read_next(&state, i, arg);
+      state.settings = settings;
+      cur_chr = state.string[state.pos.x];
+      state = FANSI_inc_width(state, extra_spaces, i);
+      last_byte = state.pos.x;
+
+      // actually write the extra spaces
+      FANSI_W_FILL(buff, ' ', extra_spaces);
+    } else {
+      FANSI_read_next(&state, i, arg);
+    }
+    if(!cur_chr) break;
+  }
+  *state_p = state;
+  return 1;
+}
+
+SEXP FANSI_tabs_as_spaces(
+  SEXP vec, SEXP tab_stops, struct FANSI_buff * buff,  SEXP warn,
+  SEXP term_cap, SEXP ctl
+) {
+  if(TYPEOF(vec) != STRSXP)
+    error("Argument 'vec' should be a character vector"); // nocov
+  R_xlen_t len = XLENGTH(vec);
+  tab_stop_max(tab_stops);   // validate
   int tabs_in_str = 0;
 
   SEXP res_sxp = vec;
@@ -106,83 +221,17 @@ SEXP FANSI_tabs_as_spaces(
       state = FANSI_state_init_full(
         vec, warn, term_cap, allowNA, keepNA, width, ctl, i
       );
+      PROTECT(state.tab->mem); ++prt;
     } else FANSI_state_reinit(&state, vec, i);
 
-    int tab_count = 0;
-
     SEXP chr = STRING_ELT(vec, i);
     if(chr == NA_STRING) continue;
-    source = CHAR(chr);
 
-    while(*source && (source = strchr(source, '\t'))) {
+    if(FANSI_tabs_as_spaces_one(&state, LENGTH(chr), tab_stops, buff, i)) {
       if(!tabs_in_str) {
         tabs_in_str = 1;
         REPROTECT(res_sxp = duplicate(vec), ipx);
       }
-      ++tab_count;
-      ++source;
-    }
-    if(tab_count) {
-      // Figure out possible size of buffer, allowing max_tab_stop for every
-      // tab, which should over-allocate but is faster
-
-      FANSI_check_chrsxp(chr, i);
-      int new_buff_size = (int)LENGTH(chr);
-      int tab_extra = max_tab_stop - 1;
-
-      for(int k = 0; k < tab_count; ++k) {
-        if(new_buff_size > (FANSI_lim.lim_int.max - tab_extra))
-          error(
-            "%s%s",
-            "Converting tabs to spaces will cause string to be longer than ",
-            "allowed INT_MAX."
-          );
-        new_buff_size += tab_extra;
-      }
-      // Note: this does not use the measure - write approach; we just
-      // overallocate knowing the upper bound of tab space usage.
-      FANSI_size_buff0(buff, new_buff_size);
-
-      char cur_chr;
-
-      int last_byte = state.pos.x;
-      unsigned int settings = state.settings;  // backup copy of settings
-      int tab_acc_width, tab_stop;
-      tab_acc_width = tab_stop = 0;
-
-      while(1) {
-        cur_chr = state.string[state.pos.x];
-
-        int extra_spaces = 0;
-
-        if(cur_chr == '\t') {
-          extra_spaces =
-            tab_width(state, tab_stops_i, len_stops, &tab_acc_width, &tab_stop);
-        } else if (cur_chr == '\n') {
-          FANSI_reset_width(&state);
-          tab_acc_width = 0;
-          tab_stop = 0;
-        }
-        // Write string
-        if(cur_chr == '\t' || !cur_chr) {
-          int write_bytes = state.pos.x - last_byte;
-          FANSI_W_MCOPY(buff, state.string + last_byte, write_bytes);
-
-          // consume tab and advance, temporarily suppressing warning
-          state.settings &= ~WARN_MASK;
-          FANSI_read_next(&state, i, arg);
-          state.settings = settings;
-          cur_chr = state.string[state.pos.x];
-          state = FANSI_inc_width(state, extra_spaces, i);
-          last_byte = state.pos.x;
-
-          // actually write the extra spaces
-          FANSI_W_FILL(buff, ' ', extra_spaces);
-        } else {
-          FANSI_read_next(&state, i, arg);
-        }
-        if(!cur_chr) break;
-      }
       // Write the CHARSXP
 
       cetype_t chr_type = CE_NATIVE;
@@ -58,6 +58,12 @@ static int sgr_has_style_html(struct FANSI_sgr sgr) {
   // generate mask first time around.
   return (sgr.style & STL_MASK2) || sgr.color.x || sgr.bgcol.x;
 }
+// Whether the state's format shows in HTML
+
+static int state_has_html(struct FANSI_state * state) {
+  struct FANSI_format fmt = FANSI_state_fmt(state);
+  return sgr_has_style_html(fmt.sgr) || FANSI_url_active(fmt.url);
+}
 static int sgr_comp_html(
   struct FANSI_sgr target, struct FANSI_sgr current
 ) {
@@ -261,16 +267,23 @@ static int W_state_as_html(
 
   // Not all basic styles are html styles (e.g. invert), so sgr only changes
   // on invert when current or previous also has a color style
-  int has_cur_sgr = sgr_has_style_html(state.fmt.sgr);
-  int has_prev_sgr = sgr_has_style_html(state_prev.fmt.sgr);
-  int sgr_change = sgr_comp_html(state.fmt.sgr, state_prev.fmt.sgr);
+  struct FANSI_format fmt = FANSI_state_fmt(&state);
+  struct FANSI_format fmt_prev = FANSI_state_fmt(&state_prev);
+  // Same format id in the same table is the same format.  URLs without ids
+  // never compare equal, so we still need to compare those.
+  int same_fmt =
+    state.tab == state_prev.tab && state.fmt_id == state_prev.fmt_id;
 
-  int has_cur_url = FANSI_url_active(state.fmt.url);
-  int has_prev_url = FANSI_url_active(state_prev.fmt.url);
-  int url_change = FANSI_url_comp(state.fmt.url, state_prev.fmt.url);
+  int has_cur_sgr = sgr_has_style_html(fmt.sgr);
+  int has_prev_sgr = sgr_has_style_html(fmt_prev.sgr);
+  int sgr_change = !same_fmt && sgr_comp_html(fmt.sgr, fmt_prev.sgr);
+
+  int has_cur_url = FANSI_url_active(fmt.url);
+  int has_prev_url = FANSI_url_active(fmt_prev.url);
+  int url_change = FANSI_url_comp(fmt.url, fmt_prev.url);
 
   const char * err_msg = oe_sgr_html_err;
-  struct FANSI_sgr sgr = state.fmt.sgr;
+  struct FANSI_sgr sgr = fmt.sgr;
 
   // FANSI_W_COPY requires variables len, i, and err_msg
   if(sgr_change || url_change) {
@@ -281,7 +294,7 @@ static int W_state_as_html(
     if(has_cur_url) {
       // users responsibility to escape html special chars
       FANSI_W_COPY(buff, "<a href='");
-      FANSI_W_MCOPY(buff, URL_STRING(state.fmt.url), URL_LEN(state.fmt.url));
+      FANSI_W_MCOPY(buff, URL_STRING(fmt.url), URL_LEN(fmt.url));
       FANSI_W_COPY(buff, "'>");
     }
     if(has_cur_sgr) {
@@ -357,25 +370,27 @@ SEXP FANSI_esc_to_html(
   struct FANSI_buff buff;
   FANSI_INIT_BUFF(&buff);
 
-  SEXP ctl = PROTECT(ScalarInteger(1));  // "all"
+  int prt = 0;
+  SEXP ctl = PROTECT(ScalarInteger(1)); ++prt;  // "all"
   int do_carry = STRING_ELT(carry, 0) != NA_STRING;
   int any_na = 0;
-  struct FANSI_state state_carry = FANSI_carry_init(carry, warn, term_cap, ctl);
-  UNPROTECT(1);
+  struct FANSI_state state_carry =
+    FANSI_carry_init(carry, warn, term_cap, ctl);
+  PROTECT(state_carry.tab->mem); ++prt;
 
   R_xlen_t x_len = XLENGTH(x);
   struct FANSI_state state, state_prev, state_init;
-  SEXP empty = PROTECT(mkString(""));
+  SEXP empty = PROTECT(mkString("")); ++prt;
   state = FANSI_state_init(empty, warn, term_cap, (R_xlen_t) 0);
-  UNPROTECT(1);
+  PROTECT(state.tab->mem); ++prt;
 
   state_prev = state_init = state;
-  state_prev.fmt = state_carry.fmt;
+  FANSI_state_copy_fmt(&state_prev, &state_carry);
 
   SEXP res = x;
   // Reserve spot on protection stack
   PROTECT_INDEX ipx;
-  PROTECT_WITH_INDEX(res, &ipx);
+  PROTECT_WITH_INDEX(res, &ipx); ++prt;
 
   for(R_xlen_t i = 0; i < x_len; ++i) {
     FANSI_interrupt(i);
@@ -397,6 +412,7 @@ SEXP FANSI_esc_to_html(
     else state = state_init;
 
     state.string = string;
+    state.len = LENGTH(chrsxp);
     struct FANSI_state state_start = state;
     FANSI_reset_pos(&state_start);
     state.status &= ~STAT_WARNED;
@@ -407,8 +423,7 @@ SEXP FANSI_esc_to_html(
     // Some ESCs may not produce any HTML, and some strings may gain HTML from
     // an ESC from a prior element even if they have no ESCs.
     int has_esc = 0;
-    int has_state =
-      sgr_has_style_html(state.fmt.sgr) || FANSI_url_active(state.fmt.url);
+    int has_state = state_has_html(&state);
     int trail_span, trail_a;
     trail_span = trail_a = 0;
     int html_spec_warned =
@@ -439,8 +454,7 @@ SEXP FANSI_esc_to_html(
       // Leftover from prior element (only if can't be merged with new)
 
       if(
-        *string && *string != 0x1b &&
-        (sgr_has_style_html(state.fmt.sgr) || FANSI_url_active(state.fmt.url))
+        *string && *string != 0x1b && state_has_html(&state)
       ) {
         // dirty hack, state_prev sgr_prev is not exaclty right at beginning
         W_state_as_html(&buff, state, state_prev, color_classes, i);
@@ -449,8 +463,9 @@ SEXP FANSI_esc_to_html(
       // New in this element
       while(1) {
         const char * string_prev = string;
-        trail_span = sgr_has_style_html(state_prev.fmt.sgr);
-        trail_a = FANSI_url_active(state_prev.fmt.url);
+        struct FANSI_format fmt_prev = FANSI_state_fmt(&state_prev);
+        trail_span = sgr_has_style_html(fmt_prev.sgr);
+        trail_a = FANSI_url_active(fmt_prev.url);
         string = find_esc_or_warn(string, &html_spec_warned, i, arg);
 
         if(!string) string = state.string + bytes_init;
@@ -472,8 +487,7 @@ SEXP FANSI_esc_to_html(
             W_state_as_html(&buff, state, state_prev, color_classes, i);
 
           state_prev = state;
-          has_state |= sgr_has_style_html(state.fmt.sgr) ||
-            FANSI_url_active(state.fmt.url);
+          has_state |= state_has_html(&state);
           if(!*string) break; // nothing after state, so done
         } else break;
       }
@@ -491,7 +505,7 @@ SEXP FANSI_esc_to_html(
     }
   }
   FANSI_release_buff(&buff, 1);
-  UNPROTECT(1);
+  UNPROTECT(prt);
   return res;
 }
 /*
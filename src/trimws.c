@@ -62,6 +62,7 @@ SEXP FANSI_trimws(
       state = FANSI_state_init_full(
         x, warn, term_cap, allowNA, keepNA, type, ctl, (R_xlen_t) 0
       );
+      PROTECT(state.tab->mem); ++prt;
     } else FANSI_state_reinit(&state, x, i);
     state_lead = state_trail = state_last = state;
 
@@ -153,8 +154,9 @@ SEXP FANSI_trimws(
 
         // Any leading SGR
         if(string_start) {
-          FANSI_W_sgr(&buff, state_lead.fmt.sgr, norm_i, 1, i);
-          FANSI_W_url(&buff, state_lead.fmt.url, i);
+          struct FANSI_format fmt_lead = FANSI_state_fmt(&state_lead);
+          FANSI_W_sgr(&buff, fmt_lead.sgr, norm_i, 1, i);
+          FANSI_W_url(&buff, fmt_lead.url, i);
         }
         // Body of string
         FANSI_W_normalize_or_copy(
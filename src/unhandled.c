@@ -49,6 +49,7 @@ SEXP FANSI_unhandled_esc(SEXP x, SEXP term_cap) {
   int err_count = 0;
   int break_early = 0;
   struct FANSI_state state;
+  int prt_tab = 0;  // format table, if any
   const char * arg = "x";
 
   for(R_xlen_t i = 0; i < x_len; ++i) {
@@ -58,6 +59,7 @@ SEXP FANSI_unhandled_esc(SEXP x, SEXP term_cap) {
       state = FANSI_state_init_full(
         x, no_warn, term_cap, allowNA, keepNA, width, ctl_all, i
       );
+      PROTECT(state.tab->mem); ++prt_tab;
       // Read one escape at a time
       state.settings |= SET_ESCONE;
     } else FANSI_state_reinit(&state, x, i);
@@ -174,6 +176,6 @@ SEXP FANSI_unhandled_esc(SEXP x, SEXP term_cap) {
   SET_VECTOR_ELT(res_fin, 3, res_err_code);
   SET_VECTOR_ELT(res_fin, 4, res_translated);
   SET_VECTOR_ELT(res_fin, 5, res_string);
-  UNPROTECT(12);
+  UNPROTECT(12 + prt_tab);
   return res_fin;
 }
@@ -108,29 +108,28 @@ int FANSI_find_ctl(
 ) {
   int pos = state->pos.x;
   while(state->string[state->pos.x]) {
-    pos = state->pos.x += FANSI_seek_ctl(state->string + state->pos.x);
+    pos = state->pos.x += FANSI_seek_ctl(
+      state->string + state->pos.x, state->len - state->pos.x
+    );
     FANSI_read_next(state, i, arg);
     // Known control read
     if(state->status & CTL_MASK) break;
   }
   return pos;
 }
-static int maybe_ctl(const char x) {
-  // Controls range from 0000 0001 (0x01) to 0001 1111 (0x1F), plus 0x7F;
-  // We don't treat C1 (C1, not C0) controls as specials, apparently
-  return x && (!(x & (~0x1F)) || x == 0x7F);
-}
 /*
  * Searches for start of next possible control character, if there is one,
  * and returns the offset from the current point.
+ *
+ * Controls range from 0000 0001 (0x01) to 0001 1111 (0x1F), plus 0x7F; We
+ * don't treat C1 (C1, not C0) controls as specials, apparently.  See scan.c.
  */
 
-int FANSI_seek_ctl(const char * x) {
-  const char * x0 = x;
-  while(*x && !maybe_ctl(*x)) x++;
-  if(x - x0 > FANSI_lim.lim_int.max)
+int FANSI_seek_ctl(const char * x, int len) {
+  intmax_t off = FANSI_scan_noctl(x, len);
+  if(off > FANSI_lim.lim_int.max)
     error("Internal error: sought past INT_MAX, should not happen.");  // nocov
-  return (x - x0);
+  return (int) off;
 }
 /*
  * Compresses the ctl vector into a single integer by encoding each value of
@@ -343,7 +342,7 @@ void FANSI_print_sgr(struct FANSI_sgr s) {
 }
 void FANSI_print_state(struct FANSI_state x) {
   Rprintf("- State -------\n");
-  FANSI_print_sgr(x.fmt.sgr);
+  FANSI_print_sgr(FANSI_state_fmt(&x).sgr);
   Rprintf(
     "  pos: byte %d width %d\n",
     x.pos.x, x.pos.w
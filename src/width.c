@@ -59,6 +59,7 @@
  * authorization of the copyright holder.
  */
 
+#include <string.h>  // memset, memcmp
 #include "fansi.h"
 
 /*
@@ -621,12 +622,85 @@ static int in_range_table(int cp, const unicode_range_t *table, int count) {
     return 0;
 }
 
+/*
+ * Multi-stage lookup table
+ *
+ * The range tables above are the source of truth, but binary searching them for
+ * every non-ASCII character is slow.  On load we expand them into a two stage
+ * table: code points are split into blocks of 256, `width_index` maps each
+ * block to one of the distinct blocks in `width_blocks`, which store the widths
+ * of each code point in the block packed as 2 bit values.  Most blocks are
+ * uniformly width 1, 0, or 2, so few distinct blocks exist (108 as of Unicode
+ * 17.0.0).
+ */
+#define CP_MAX 0x10FFFF
+#define WIDTH_BLOCK_BITS 8
+#define WIDTH_BLOCK_SIZE (1 << WIDTH_BLOCK_BITS)
+#define WIDTH_BLOCK_BYTES (WIDTH_BLOCK_SIZE / 4)
+#define WIDTH_BLOCK_COUNT ((CP_MAX + 1) >> WIDTH_BLOCK_BITS)
+#define WIDTH_BLOCK_MAX 256  // must fit in width_index element type
+
+static unsigned char width_index[WIDTH_BLOCK_COUNT];
+static unsigned char width_blocks[WIDTH_BLOCK_MAX][WIDTH_BLOCK_BYTES];
+
+// Paint `width` for the parts of the sorted `table` ranges that overlap the
+// block starting at `blk_start`, advancing `*k` past ranges that end in it.
+static void paint_block(
+  unsigned char * widths, int blk_start, const unicode_range_t *table,
+  int count, int * k, int width
+) {
+  int blk_end = blk_start + WIDTH_BLOCK_SIZE - 1;
+  for(; *k < count && table[*k].start <= blk_end; ++(*k)) {
+    int start = table[*k].start > blk_start ? table[*k].start : blk_start;
+    int end = table[*k].end < blk_end ? table[*k].end : blk_end;
+    for(int cp = start; cp <= end; ++cp) widths[cp - blk_start] = width;
+    // Range continues into next block
+    if(table[*k].end > blk_end) break;
+  }
+}
+void FANSI_width_init(void) {
+  unsigned char widths[WIDTH_BLOCK_SIZE];
+  unsigned char packed[WIDTH_BLOCK_BYTES];
+  int k0 = 0, k2 = 0, blocks = 0;
+
+  for(int b = 0; b < WIDTH_BLOCK_COUNT; ++b) {
+    int blk_start = b << WIDTH_BLOCK_BITS;
+    memset(widths, 1, sizeof(widths));
+    // Width 0 takes precedence, as in the binary search version
+    paint_block(widths, blk_start, width_2_ranges, WIDTH_2_COUNT, &k2, 2);
+    paint_block(widths, blk_start, width_0_ranges, WIDTH_0_COUNT, &k0, 0);
+
+    memset(packed, 0, sizeof(packed));
+    for(int j = 0; j < WIDTH_BLOCK_SIZE; ++j)
+      packed[j >> 2] |= (unsigned char)(widths[j] << ((j & 3) << 1));
+
+    int u;
+    for(u = 0; u < blocks; ++u)
+      if(!memcmp(width_blocks[u], packed, sizeof(packed))) break;
+    if(u == blocks) {
+      if(blocks == WIDTH_BLOCK_MAX)
+        error("Internal Error: too many distinct width blocks.");  // nocov
+      memcpy(width_blocks[blocks++], packed, sizeof(packed));
+    }
+    width_index[b] = (unsigned char) u;
+  }
+}
 /* Get display width for a Unicode codepoint */
 int FANSI_unicode_width(int cp) {
     /* Fast path for printable ASCII */
     if (cp >= 0x20 && cp < 0x7F)
         return 1;
+    /* Not in the range tables */
+    if (cp < 0 || cp > CP_MAX)
+        return 1;
 
+    unsigned char packed =
+      width_blocks[width_index[cp >> WIDTH_BLOCK_BITS]]
+        [(cp & (WIDTH_BLOCK_SIZE - 1)) >> 2];
+    return (packed >> ((cp & 3) << 1)) & 3;
+}
+/* Reference implementation using the range tables directly */
+static int unicode_width_ranges(int cp) {
     /* Check zero-width characters */
     if (in_range_table(cp, width_0_ranges, WIDTH_0_COUNT))
         return 0;
@@ -638,6 +712,25 @@ int FANSI_unicode_width(int cp) {
     /* Default to width 1 */
     return 1;
 }
+/*
+ * Compare the lookup table against the range tables for every code point (and
+ * some invalid ones either side).
+ *
+ * @return integer vector of code points for which they disagree.
+ */
+SEXP FANSI_width_table_check(void) {
+  int lo = -256, hi = CP_MAX + 256, bad = 0;
+  for(int cp = lo; cp <= hi; ++cp)
+    bad += FANSI_unicode_width(cp) != unicode_width_ranges(cp);
+
+  SEXP res = PROTECT(allocVector(INTSXP, bad));
+  int j = 0;
+  for(int cp = lo; cp <= hi; ++cp)
+    if(FANSI_unicode_width(cp) != unicode_width_ranges(cp))
+      INTEGER(res)[j++] = cp;
+  UNPROTECT(1);
+  return res;
+}
 SEXP FANSI_unicode_version(void) {
     return mkString(UNICODE_VERSION);
 }
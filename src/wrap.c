@@ -16,6 +16,9 @@
  */
 
 #include "fansi.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 /*
  * Data related to prefix / initial
@@ -51,6 +54,7 @@ static struct FANSI_prefix_dat make_pre(
   struct FANSI_state state = FANSI_state_init_full(
     x, warn, term_cap, allowNA, keepNA, width, ctl, 0
   );
+  PROTECT(state.tab->mem); prt++;
   FANSI_read_all(&state, 0, arg);
 
   UNPROTECT(prt);
@@ -109,6 +113,81 @@ static struct FANSI_prefix_dat drop_pre_indent(struct FANSI_prefix_dat dat) {
   return dat;
 }
 
+/*
+ * Rendered Bridges and Closes
+ *
+ * Other than its content and padding, a line is made of the bridge from the
+ * state at the previous boundary (blank with `terminate`) to the state at the
+ * start of the line, the prefix and indent (rendered once per call, see
+ * `pad_pre`), and the close of the state at the end of the line.  Bridges and
+ * closes only depend on the formats involved, of which there are usually few
+ * in a call, so we keep them rendered in a direct mapped cache keyed on format
+ * ids.  `writeline` can then size the line up front and copy each part in,
+ * instead of generating all of it twice in the measure/write passes.
+ *
+ * Parts longer than WRAP_PART_MAX are not cached, and lines with them are
+ * written with the measure/write passes.  The cache must be zeroed before use.
+ */
+#define WRAP_PART_BITS 5
+#define WRAP_PART_SIZE (1U << WRAP_PART_BITS)
+#define WRAP_PART_MAX 88
+
+struct wrap_part {
+  struct FANSI_fmt_tab * tab_a, * tab_b;
+  unsigned int id_a, id_b;
+  int set;
+  int bytes;          // -1 if too long to cache
+  char string[WRAP_PART_MAX];
+};
+struct wrap_cache {
+  struct wrap_part bridge[WRAP_PART_SIZE];
+  struct wrap_part close[WRAP_PART_SIZE];
+};
+/*
+ * Look up or render the bridge from `a` to `b`, or the close of `a` if `b` is
+ * NULL.
+ *
+ * @param len bytes that precede the part in the line, so that overflow errors
+ *   are the same as they would be in the measure pass.
+ * @return the part, or NULL if it is too long to cache.
+ */
+static const struct wrap_part * wrap_part(
+  struct wrap_cache * cache, struct FANSI_buff * buff,
+  struct FANSI_state a, struct FANSI_state * b, int len, R_xlen_t i
+) {
+  struct FANSI_fmt_tab * tab_b = b ? b->tab : NULL;
+  unsigned int id_b = b ? b->fmt_id : 0;
+  unsigned int h = ((a.fmt_id * 0x9E3779B1U) ^ id_b) * 0x85EBCA6BU;
+  struct wrap_part * part =
+    (b ? cache->bridge : cache->close) + (h >> (32 - WRAP_PART_BITS));
+
+  if(
+    !part->set || part->id_a != a.fmt_id || part->id_b != id_b ||
+    part->tab_a != a.tab || part->tab_b != tab_b
+  ) {
+    *part = (struct wrap_part) {
+      .tab_a=a.tab, .tab_b=tab_b, .id_a=a.fmt_id, .id_b=id_b, .set=1
+    };
+    const char * err_msg = "Writing line";
+    for(int k = 0; k < 2; ++k) {
+      if(!k) {
+        FANSI_reset_buff(buff);
+        buff->len = len;
+      } else {
+        part->bytes = buff->len - len;
+        if(part->bytes > WRAP_PART_MAX) {
+          part->bytes = -1;
+          break;
+        }
+        FANSI_size_buff0(buff, part->bytes);
+      }
+      if(b) FANSI_W_bridge(buff, a, *b, 0, i, err_msg);
+      else FANSI_W_close(buff, FANSI_state_fmt(&a), 0, i);
+    }
+    if(part->bytes > 0) memcpy(part->string, buff->buff0, part->bytes);
+  }
+  return part->bytes < 0 ? NULL : part;
+}
 /*
  * Write a line
  *
@@ -118,6 +197,8 @@ static struct FANSI_prefix_dat drop_pre_indent(struct FANSI_prefix_dat dat) {
  *   happens as a second pass.  In the future we might decide to do the
  *   normalization in the first pass so an external call to normalize_state is
  *   unnecessary.
+ * @param cache rendered bridges and closes (see `wrap_cache`), or NULL to
+ *   generate them for each line.
  */
 
 static SEXP writeline(
@@ -127,7 +208,8 @@ static SEXP writeline(
   struct FANSI_prefix_dat pre_dat,
   int tar_width, const char * pad_chr,
   R_xlen_t i,
-  int normalize, int terminate
+  int normalize, int terminate,
+  struct wrap_cache * cache
 ) {
   // turn off C level normalize for now since it is incomplete and we just do it
   // again at the R level.
@@ -153,7 +235,7 @@ static SEXP writeline(
     pre_dat = drop_pre_indent(pre_dat);
     // Also, don't open a state that will get immediately closed
     if(!target_pad && terminate) {
-      state_start.fmt = state_bound.fmt = (struct FANSI_format) {0};
+      state_start.fmt_id = state_bound.fmt_id = 0;
   } }
   // state_bound.pos.x 1 past what we need, so this should include room
   // for NULL terminator
@@ -170,34 +252,69 @@ static SEXP writeline(
   if(state_bound.pos.x < state_start.pos.x)
     error("Internal Error: negative line width.");  // nocov
 
-  // Measure/Write loop (see src/write.c).  Very similar code in substr.c
-  const char * err_msg = "Writing line";
-  for(int k = 0; k < 2; ++k) {
-    if(!k) FANSI_reset_buff(buff);
-    else   FANSI_size_buff(buff);
-
-    FANSI_W_bridge(buff, state_last_bound, state_start, normalize, i, err_msg);
-
-    // Apply indent/exdent prefix/initial
-    if(pre_dat.bytes) {
-      err_msg = "Adding prefix characters";
-      FANSI_W_MCOPY(buff, pre_dat.string, pre_dat.bytes);
+  // Size the line from the cached parts if we can, falling back to the
+  // measure/write passes if not, or if the line would overflow so that the
+  // error is the same.
+  const struct wrap_part * bridge = NULL, * close = NULL;
+  const char * string = state_start.string + state_start.pos.x;
+  int bytes = state_bound.pos.x - state_start.pos.x;
+  intmax_t len = 0;
+  if(cache) {
+    bridge = wrap_part(cache, buff, state_last_bound, &state_start, 0, i);
+    if(bridge) {
+      len = (intmax_t) bridge->bytes + pre_dat.bytes + bytes + target_pad;
+      if(len > FANSI_lim.lim_int.max) bridge = NULL;
+      else if(terminate) {
+        close = wrap_part(cache, buff, state_bound, NULL, (int) len, i);
+        if(close) len += close->bytes;
+        if(!close || len > FANSI_lim.lim_int.max) bridge = NULL;
+  } } }
+  if(bridge) {
+    FANSI_size_buff0(buff, (int) len);
+    char * w = buff->buff;
+    memcpy(w, bridge->string, bridge->bytes);
+    w += bridge->bytes;
+    memcpy(w, pre_dat.string, pre_dat.bytes);
+    w += pre_dat.bytes;
+    memcpy(w, string, bytes);
+    w += bytes;
+    memset(w, *pad_chr, target_pad);
+    w += target_pad;
+    if(close) {
+      memcpy(w, close->string, close->bytes);
+      w += close->bytes;
     }
-    // Actual string, remember state_bound.pos.x is one past what we need
-    // We could use _normalize_or_copy, but right now doing it at R level as
-    // doing it here requires a bit of tweaking.
-    const char * string = state_start.string + state_start.pos.x;
-    int bytes = state_bound.pos.x - state_start.pos.x;
-    FANSI_W_MCOPY(buff, string, bytes);
-
-    // Add padding if needed
-    err_msg = "Adding padding";
-    int to_pad = target_pad;
-    FANSI_W_FILL(buff, *pad_chr, to_pad);
-
-    // And turn off CSI styles if needed
-    if(terminate) FANSI_W_close(buff, state_bound.fmt, normalize, i);
-  }
+    *w = 0;
+    buff->buff = w;
+  } else {
+    // Measure/Write loop (see src/write.c).  Very similar code in substr.c
+    const char * err_msg = "Writing line";
+    for(int k = 0; k < 2; ++k) {
+      if(!k) FANSI_reset_buff(buff);
+      else   FANSI_size_buff(buff);
+
+      FANSI_W_bridge(
+        buff, state_last_bound, state_start, normalize, i, err_msg
+      );
+      // Apply indent/exdent prefix/initial
+      if(pre_dat.bytes) {
+        err_msg = "Adding prefix characters";
+        FANSI_W_MCOPY(buff, pre_dat.string, pre_dat.bytes);
+      }
+      // Actual string, remember state_bound.pos.x is one past what we need
+      // We could use _normalize_or_copy, but right now doing it at R level as
+      // doing it here requires a bit of tweaking.
+      FANSI_W_MCOPY(buff, string, bytes);
+
+      // Add padding if needed
+      err_msg = "Adding padding";
+      int to_pad = target_pad;
+      FANSI_W_FILL(buff, *pad_chr, to_pad);
+
+      // And turn off CSI styles if needed
+      if(terminate)
+        FANSI_W_close(buff, FANSI_state_fmt(&state_bound), normalize, i);
+  } }
   // Now create the charsxp and append to the list, start by determining
   // what encoding to use.
   cetype_t chr_type = CE_NATIVE;
@@ -205,6 +322,299 @@ static SEXP writeline(
     chr_type = CE_UTF8;
   return FANSI_mkChar(*buff, chr_type, i);
 }
+/*
+ * Wrapping Elements in Parallel
+ *
+ * Without carry each element is wrapped independently of the others, so with
+ * `threads > 1` we work out where the lines break for batches of elements in
+ * parallel.  Workers only record the arguments `writeline` will be called with
+ * in a per thread buffer, and the lines are written on the main thread as the R
+ * API is not thread safe.
+ *
+ * Only elements that pass `FANSI_read_plain` are planned by the workers.
+ * Other elements, as well as those whose lines don't fit in what is left of the
+ * buffer or that would produce an error, are wrapped on the main thread as
+ * usual when their turn comes, so that errors and warnings are signaled in the
+ * same order as without threads.  Spaces are stripped from the planned elements
+ * on the main thread as the batch is set up (see `wrap_proc`), which cannot
+ * signal anything for them, and the result is copied to `mem` as it must
+ * outlive the processing of the next element.
+ */
+#define WRAP_BATCH      64  // elements per thread per batch
+#define WRAP_LINES    4096  // lines per thread per batch
+
+struct wrap_line {
+  struct FANSI_state bound, start, last_bound;
+  int width_tar;
+  int para_start;
+};
+struct wrap_plan {
+  struct wrap_line * lines;
+  int n;          // lines recorded
+  int alloc;      // lines available
+  int fail;       // could not be planned, wrap on main thread
+  int grow;       // on main thread, grow `lines` as needed
+  SEXP mem;       // with `grow`, holds `lines`, must be protected at `ipx`
+  PROTECT_INDEX ipx;
+};
+struct wrap_batch {
+  const char ** string;       // elements, NULL if they can't be planned
+  int * len;                  // bytes in each element
+  SEXP mem;                   // processed elements
+  PROTECT_INDEX ipx;
+  struct wrap_plan * plan;    // one per element
+  struct wrap_line * lines;   // WRAP_LINES per thread
+  int * used;                 // lines used by each thread
+  R_xlen_t start, end;        // elements in batch
+};
+/*
+ * Double the lines available in `plan`, keeping those recorded.
+ *
+ * Memory is from R rather than `R_alloc` so it does not get in the way of
+ * releasing the buffer lines are written to.
+ */
+static void plan_grow(struct wrap_plan * plan) {
+  if(plan->alloc > FANSI_lim.lim_int.max / 2)
+    error("Internal Error: too many lines to record.");  // nocov
+  int alloc = plan->alloc ? plan->alloc * 2 : 64;
+  SEXP mem = PROTECT(
+    allocVector(RAWSXP, (R_xlen_t) alloc * sizeof(struct wrap_line))
+  );
+  struct wrap_line * lines = (struct wrap_line *) RAW(mem);
+  if(plan->n) memcpy(lines, plan->lines, plan->n * sizeof(*lines));
+  REPROTECT(plan->mem = mem, plan->ipx);
+  UNPROTECT(1);
+  plan->lines = lines;
+  plan->alloc = alloc;
+}
+/*
+ * Bytes in run of printable ASCII other than space at `state`, up to `max`.
+ */
+static int word_run(const struct FANSI_state * state, int max) {
+  const char * x = state->string + state->pos.x;
+  int bytes = FANSI_scan_print_state(state, max);
+  const char * space = memchr(x, ' ', bytes);
+  return space ? (int)(space - x) : bytes;
+}
+/*
+ * Advance state over `bytes` printable ASCII as `FANSI_read_next` would.
+ */
+static void word_skip(struct FANSI_state * state, int bytes) {
+  state->status &= STAT_WARNED;
+  state->pos.x += bytes;
+  state->pos.w += bytes;
+}
+/*
+ * Balanced Wrapping
+ *
+ * With `balance`, each paragraph is broken so as to minimize the sum of the
+ * squares of the width left over on each line other than the last (minimum
+ * raggedness), instead of filling each line as much as possible.
+ *
+ * The words of the element are measured ahead of wrapping with the same reader
+ * `strwrap` uses, and the breaks are chosen with a dynamic program.  As the
+ * cost of a line satisfies the quadrangle inequality, the best start of the
+ * line ending at each word is non-decreasing in the word, so candidates can be
+ * kept in a queue in which each is best over a range of words, found by binary
+ * search when it is added.  The first line of a paragraph has its own width so
+ * its start is considered separately.
+ *
+ * `strwrap` then wraps as usual except that each line that starts on a planned
+ * word breaks at the first boundary past that line's planned width rather than
+ * past the full width.  The output is thus always a valid greedy wrap, and
+ * formats are carried across lines as usual.  Paragraphs that can't be laid out
+ * without words overflowing the width are wrapped greedily.
+ */
+struct wrap_word {
+  int x, x_end;     // bytes at start (incl. leading controls), and past end
+  int s, e;         // widths at start and end
+  int para;         // whether first word in paragraph
+  int brk;          // width to break at if the word starts a line, or -1
+};
+struct wrap_bal {
+  struct wrap_word * words;
+  double * cost;    // best cost of lines up to each word
+  int * from;       // start of the last line in `cost`
+  int * q_cand, * q_start;
+  int n, alloc;
+  int k;            // word `strwrap` is at
+  SEXP buff;        // memory for the above
+  PROTECT_INDEX ipx;
+};
+/*
+ * Double the words available in `bal`, keeping those recorded.
+ *
+ * Memory is from R rather than `R_alloc` so it does not get in the way of
+ * releasing the buffers used to write lines.
+ */
+static void bal_grow(struct wrap_bal * bal) {
+  if(bal->alloc > FANSI_lim.lim_int.max / 2)
+    error("Internal Error: too many words to balance.");  // nocov
+  int alloc = bal->alloc ? bal->alloc * 2 : 256;
+  SEXP buff = PROTECT(
+    allocVector(
+      RAWSXP,
+      (R_xlen_t) alloc *
+        (sizeof(*bal->cost) + sizeof(*bal->words) + 3 * sizeof(int))
+  ) );
+  // Largest alignment first
+  double * cost = (double *) RAW(buff);
+  struct wrap_word * words = (struct wrap_word *) (cost + alloc);
+  if(bal->n) memcpy(words, bal->words, bal->n * sizeof(*words));
+  bal->cost = cost;
+  bal->words = words;
+  bal->from = (int *) (words + alloc);
+  bal->q_cand = bal->from + alloc;
+  bal->q_start = bal->q_cand + alloc;
+  bal->alloc = alloc;
+  REPROTECT(bal->buff = buff, bal->ipx);
+  UNPROTECT(1);
+}
+/*
+ * Cost of the lines up to word `j` if the last one starts at word `i`, for the
+ * paragraph starting at word `a`.
+ */
+static double bal_cost(
+  struct wrap_bal * bal, int a, int i, int j, int width_1, int width_2
+) {
+  int width = i == a ? width_1 : width_2;
+  int w = bal->words[j - 1].e - bal->words[i].s;
+  if(w > width) return R_PosInf;
+  double gap = width - w;
+  return bal->cost[i] + gap * gap;
+}
+/*
+ * Choose the breaks for the paragraph with words `a` to `b - 1`, recording
+ * them in `brk`.  The last line is free so long as it fits.
+ */
+static void bal_para(
+  struct wrap_bal * bal, int a, int b, int width_1, int width_2
+) {
+  int * q_cand = bal->q_cand, * q_start = bal->q_start;
+  int head = 0, tail = 0;
+  bal->cost[a] = 0;
+
+  for(int j = a + 1; j < b; ++j) {
+    // Line starting at `j - 1` becomes a candidate, from the first word at
+    // which it is no worse than the last one queued.
+    int c = j - 1;
+    if(c > a) {
+      while(
+        tail > head && q_start[tail - 1] >= j &&
+        bal_cost(bal, a, c, q_start[tail - 1], width_1, width_2) <=
+        bal_cost(bal, a, q_cand[tail - 1], q_start[tail - 1], width_1, width_2)
+      )
+        --tail;
+      int lo = j, hi = b;
+      if(tail > head) {
+        if(q_start[tail - 1] > lo) lo = q_start[tail - 1];
+        while(lo < hi) {
+          int mid = lo + (hi - lo) / 2;
+          if(
+            bal_cost(bal, a, c, mid, width_1, width_2) <=
+            bal_cost(bal, a, q_cand[tail - 1], mid, width_1, width_2)
+          )
+            hi = mid;
+          else lo = mid + 1;
+      } }
+      if(lo < b) {
+        q_cand[tail] = c;
+        q_start[tail++] = lo;
+    } }
+    while(tail - head > 1 && q_start[head + 1] <= j) ++head;
+
+    double best = bal_cost(bal, a, a, j, width_1, width_2);
+    int from = a;
+    if(tail > head) {
+      double cost = bal_cost(bal, a, q_cand[head], j, width_1, width_2);
+      if(cost < best) {
+        best = cost;
+        from = q_cand[head];
+    } }
+    bal->cost[j] = best;
+    bal->from[j] = from;
+  }
+  // Last line, which can only start where it fits
+  double best = R_PosInf;
+  int from = -1;
+  for(int i = b - 1; i >= a; --i) {
+    if(bal->words[b - 1].e - bal->words[i].s > (i == a ? width_1 : width_2))
+      break;
+    if(bal->cost[i] < best) {
+      best = bal->cost[i];
+      from = i;
+  } }
+  if(from < 0 || !R_FINITE(best)) return;
+
+  for(int j = from; j > a; j = bal->from[j]) {
+    int i = bal->from[j];
+    int w = bal->words[j - 1].e - bal->words[i].s;
+    if(w > 0) bal->words[i].brk = w;
+  }
+}
+/*
+ * Measure the words in `state` and plan the breaks of each paragraph.
+ *
+ * Warnings and errors are left to `strwrap`, which reads the same string
+ * afterwards, so elements that would error are left unplanned.
+ */
+static void bal_plan(
+  struct wrap_bal * bal, struct FANSI_state state, R_xlen_t index,
+  int width_1, int width_2
+) {
+  const char * arg = "x";
+  state.settings &= ~WARN_MASK;
+  bal->n = bal->k = 0;
+  int in_word = 0, para = 1;
+
+  while(1) {
+    char chr = state.string[state.pos.x];
+    if(!chr || chr == ' ' || chr == '\t' || chr == '\n') {
+      in_word = 0;
+      if(!chr) break;
+      if(chr == '\n') para = 1;
+      FANSI_read_next(&state, index, arg);
+      if(FANSI_GET_ERR(state.status) >= ERR_BAD_UTF8) break;
+      continue;
+    }
+    if(!in_word) {
+      // Room for one more cost than words
+      if(bal->n + 1 >= bal->alloc) bal_grow(bal);
+      bal->words[bal->n++] = (struct wrap_word) {
+        .x=state.pos.x, .s=state.pos.w, .para=para, .brk=-1
+      };
+      in_word = 1;
+      para = 0;
+    }
+    // Printable ASCII other than space is read without side effects
+    const char * word = state.string + state.pos.x;
+    int skip = 0;
+    while(word[skip] > ' ' && word[skip] < 0x7f) ++skip;
+    if(skip) word_skip(&state, skip);
+    else FANSI_read_next(&state, index, arg);
+    if(FANSI_GET_ERR(state.status) >= ERR_BAD_UTF8) break;
+    bal->words[bal->n - 1].x_end = state.pos.x;
+    bal->words[bal->n - 1].e = state.pos.w;
+  }
+  if(state.string[state.pos.x]) bal->n = 0;
+  for(int a = 0, b = 1; a < bal->n; a = b++) {
+    while(b < bal->n && !bal->words[b].para) ++b;
+    bal_para(bal, a, b, width_1, width_2);
+  }
+}
+/*
+ * Width to break the line starting at byte `x` at.
+ */
+static int bal_width(struct wrap_bal * bal, int x, int width) {
+  struct wrap_word * words = bal->words;
+  while(bal->k < bal->n && words[bal->k].x_end <= x) ++bal->k;
+  if(
+    bal->k < bal->n && words[bal->k].x <= x &&
+    words[bal->k].brk >= 0 && words[bal->k].brk <= width
+  )
+    return words[bal->k].brk;
+  return width;
+}
 /*
  * All input strings are expected to be in UTF8 compatible format (i.e. either
  * encoded in UTF8, or contain only bytes in 0-127).  That way we know we can
@@ -221,6 +631,14 @@ static SEXP writeline(
  *   depending whether we're at the very first line of the external input or not
  * @param strict whether to hard wrap at width or not (not is what strwrap does
  *   by default)
+ * @param plan where to record the break points of the lines for `write_plan`
+ *   to write them, NULL in `first_only` mode where the line is written and
+ *   returned.  Unless `plan->grow` is set this does not use R (see
+ *   `wrap_batch`), in which case it is only for strings that pass
+ *   `FANSI_read_plain`, and not in `carry` mode.
+ * @param idx if not NULL, an index of `x` with words recorded, used to step
+ *   over words that fit in the line without reading them.
+ * @param bal if not NULL, balance the line widths (see `wrap_bal`).
  */
 
 static SEXP strwrap(
@@ -237,26 +655,25 @@ static SEXP strwrap(
   int carry,
   struct FANSI_state state,
   struct FANSI_state * state_carry,
-  int terminate
+  int terminate,
+  struct wrap_plan * plan,
+  struct FANSI_index * idx,
+  struct wrap_bal * bal,
+  struct wrap_cache * cache
 ) {
   const char * arg = "x";
   int width_1 = FANSI_ADD_INT(width, -pre_first.width);
   int width_2 = FANSI_ADD_INT(width, -pre_next.width);
 
   int width_tar = width_1;
+  int width_brk = width_tar;  // break at boundary past this (see `wrap_bal`)
 
   if(width < 1 && wrap_always)
     error("Internal Error: invalid width."); // nocov
   if(wrap_always && (width_1 < 0 || width_2 < 0))
     error("Internal Error: incompatible width/indent/prefix."); // nocov
 
-  // Use LISTSXP so we don't have to do a two pass process to determine how many
-  // items we're going to have, unless we're in first only in which case we know
-  // we only need one element per and don't actually use these
-
   int prt = 0;
-  SEXP char_list_start, char_list;
-  char_list_start = char_list = PROTECT(list1(R_NilValue)); ++prt;
 
   int prev_boundary = 0;    // tracks if previous char was a boundary
   int has_boundary = 0;     // tracks if at least one boundary in a line
@@ -269,12 +686,18 @@ static SEXP strwrap(
   int last_start = 0;
   int new_line = 1;
 
+  // Words from the index, which assume no format carried in
+  const struct FANSI_index_word * word = NULL, * word_0 = NULL,
+    * word_n = NULL;
+  if(idx && !carry) {
+    int n_word;
+    word = word_0 = FANSI_index_words(idx, index, &state, &n_word);
+    word_n = word + n_word;
+  }
   // Need to keep track of where word boundaries start and end due to
   // possibility for multiple elements between words
-  if(carry) {
-    state.fmt.sgr = state_carry->fmt.sgr;
-    state.fmt.url = state_carry->fmt.url;
-  }
+  if(carry) FANSI_state_copy_fmt(&state, state_carry);
+  if(bal) bal_plan(bal, state, index, width_1, width_2);
   struct FANSI_state state_start, state_bound, state_prev, state_tmp,
     state_last_bound;
   state_tmp = state_start = state_last_bound = state;
@@ -288,8 +711,7 @@ static SEXP strwrap(
 
   state_bound = state_prev = state_start;
 
-  R_xlen_t size = 0;
-  SEXP res_sxp;
+  SEXP res_sxp = R_NilValue;
 
   while(1) {
     if(new_line) {
@@ -317,6 +739,36 @@ static SEXP strwrap(
       has_boundary = 0;
       state_bound.pos.w = 0;
       state = state_prev = state_start = state_bound;
+      width_brk =
+        bal ? bal_width(bal, state_start.pos.x, width_tar) : width_tar;
+    }
+    // Jump over word characters that are clear of the target width.  Each
+    // would go through the `else` branch at the end of the loop without
+    // changing anything but `state` and `state_prev`, and printable ASCII is
+    // read without side effects (see `FANSI_read_next`).  With an index whole
+    // words can be jumped to their last element in the same way.  Lines
+    // restart at an earlier word boundary so the words may be revisited.
+    int jump = 0;
+    if(word) {
+      while(word > word_0 && word[-1].x >= state.pos.x) --word;
+      while(word < word_n && word->x < state.pos.x) ++word;
+      if(
+        word < word_n && word->x == state.pos.x &&
+        word->last_w - word->w < width_tar - state.pos.w
+      ) {
+        FANSI_index_word(idx, word, &state);
+        state_prev = state;
+        FANSI_read_next(&state, index, arg);
+        prev_boundary = 0;
+        jump = 1;
+    } }
+    int skip = jump ?
+      0 : word_run(&state, width_tar - state.pos.w);
+    if(skip) {
+      if(skip > 1) word_skip(&state, skip - 1);
+      state_prev = state;
+      word_skip(&state, 1);
+      prev_boundary = 0;
     }
     struct FANSI_state state_next;
     int end = !state.string[state.pos.x];
@@ -365,7 +817,8 @@ static SEXP strwrap(
       prev_boundary = 0;
     }
 
-    // Write the line if
+    // Write the line if (balanced lines only break early at boundaries)
+    int width_cut = has_boundary ? width_brk : width_tar;
     if(
       // 1. At end of string
       end ||
@@ -375,9 +828,9 @@ static SEXP strwrap(
       //    there is a boundary or we're willing to hard break
       (
         (
-          state.pos.w > width_tar ||
+          state.pos.w > width_cut ||
           (
-            state.pos.w == width_tar &&
+            state.pos.w == width_cut &&
             state_next.pos.w > state.pos.w  // check zero width for next
         ) ) &&
         (has_boundary || wrap_always)
@@ -401,6 +854,11 @@ static SEXP strwrap(
         state_bound = state;
       }
       if(!first_line && last_start >= state_start.pos.x) {
+        if(plan && !plan->grow) {
+          // Leave it to the main thread to signal the error
+          plan->fail = 1;
+          return R_NilValue;
+        }
         error(
           "%s%s",
           "Wrap error: trying to wrap to width narrower than ",
@@ -418,31 +876,38 @@ static SEXP strwrap(
       ) {
         FANSI_read_next(&state_bound, index, arg);
       }
-      // Write the string
-      res_sxp = PROTECT(
-        writeline(
-          state_bound, state_start, state_last_bound, buff,
-          para_start ? pre_first : pre_next,
-          width_tar, pad_chr, index, normalize, terminate
-        )
-      ); ++prt;
+      // Write the string, or record what to write it with
+      if(plan) {
+        if(plan->n >= plan->alloc) {
+          if(!plan->grow) {
+            plan->fail = 1;
+            return R_NilValue;
+          }
+          plan_grow(plan);
+        }
+        plan->lines[plan->n++] = (struct wrap_line) {
+          .bound=state_bound, .start=state_start, .last_bound=state_last_bound,
+          .width_tar=width_tar, .para_start=para_start
+        };
+      } else {
+        res_sxp = PROTECT(
+          writeline(
+            state_bound, state_start, state_last_bound, buff,
+            para_start ? pre_first : pre_next,
+            width_tar, pad_chr, index, normalize, terminate, cache
+          )
+        ); ++prt;
+      }
       first_line = 0;
       last_start = state_start.pos.x;
       if(!terminate) state_last_bound = state_bound;
 
       // first_only for `strtrim`
-      if(!first_only) {
-        SETCDR(char_list, list1(res_sxp));
-        char_list = CDR(char_list);
-        UNPROTECT(1); --prt;
-      } else {
+      if(first_only) {
         // Need end state if in strtrim mode and we wish to carry
         if(carry) FANSI_read_all(&state, index, arg);
         break;
       }
-
-      // overflow should be impossible here since string is at most int long
-      ++size;
       if(end) break;
 
       // Next line will be the beginning of a paragraph
@@ -466,43 +931,226 @@ static SEXP strwrap(
       state = state_next;
     }
   }
-  // Convert to string and return; this is a little inefficient for the
-  // `first_only` mode as ideally we would just return a CHARSXP, but for now we
-  // are just trying to keep it simple
-
-  SEXP res;
+  if(state_carry) FANSI_state_copy_fmt(state_carry, &state);
+  UNPROTECT(prt);
+  return res_sxp;
+}
+/*
+ * Write out the lines recorded by `strwrap` in `plan`
+ *
+ * Equivalent to `strwrap` for the same element, see there for parameters.
+ */
+static SEXP write_plan(
+  struct wrap_plan plan,
+  struct FANSI_prefix_dat pre_first,
+  struct FANSI_prefix_dat pre_next,
+  struct FANSI_buff * buff,
+  const char * pad_chr,
+  R_xlen_t index,
+  int normalize,
+  int terminate,
+  struct wrap_cache * cache
+) {
+  SEXP res = PROTECT(allocVector(STRSXP, plan.n));
+  for(int k = 0; k < plan.n; ++k) {
+    struct wrap_line * line = plan.lines + k;
+    SET_STRING_ELT(
+      res, k,
+      writeline(
+        line->bound, line->start, line->last_bound, buff,
+        line->para_start ? pre_first : pre_next,
+        line->width_tar, pad_chr, index, normalize, terminate, cache
+    ) );
+  }
+  UNPROTECT(1);
+  return res;
+}
 
-  if(!first_only) {
-    res = PROTECT(allocVector(STRSXP, size)); ++prt;
-    char_list = char_list_start;
-    for(R_xlen_t i = 0; i < size; ++i) {
-      char_list = CDR(char_list); // first element is NULL
-      if(char_list == R_NilValue)
-        error("Internal Error: wrapped element count mismatch");  // nocov
-      SET_STRING_ELT(res, i, CAR(char_list));
+/*
+ * Processing Elements While Wrapping
+ *
+ * Rather than stripping spaces and expanding tabs for the whole vector ahead
+ * of wrapping, which creates a CHARSXP for every element that changes, each
+ * element is processed just before it is wrapped into buffers re-used across
+ * elements.  The buffers are sized once for the largest element so they are
+ * never re-allocated, as they sit below `buff` on the `R_alloc` stack.
+ *
+ * This is still a read of the element to strip spaces and another to expand
+ * tabs ahead of the read to wrap it.  The buffers can be re-used for the next
+ * element even with `carry` as the format table keeps its own copy of URLs
+ * (see state.c).
+ */
+struct wrap_proc {
+  int strip, tabs;                  // whether to strip spaces / expand tabs
+  SEXP tab_stops;
+  struct FANSI_state state_strip, state_tabs;
+  struct FANSI_buff buff_strip, buff_tabs;
+};
+/*
+ * Strip spaces and expand tabs in element `i` of `x`
+ *
+ * Equivalent to `FANSI_process` followed by `FANSI_tabs_as_spaces`.
+ *
+ * @param bytes set to the length of the processed string.
+ * @return the processed string, valid until the next element is processed.
+ */
+static const char * process_elt(
+  struct wrap_proc * proc, SEXP x, R_xlen_t i, int * bytes
+) {
+  SEXP chr = STRING_ELT(x, i);
+  int len = *bytes = LENGTH(chr);
+  if(chr == NA_STRING) return CHAR(chr);
+  struct FANSI_buff * buff = NULL;  // buffer with the processed string, if any
+
+  if(proc->strip) {
+    FANSI_state_reinit(&proc->state_strip, x, i);
+    if(FANSI_process_one(proc->state_strip, len, &proc->buff_strip, i)) {
+      buff = &proc->buff_strip;
+      len = (int)(buff->buff - buff->buff0);
+  } }
+  if(proc->tabs) {
+    FANSI_state_reinit(&proc->state_tabs, x, i);
+    if(buff) {
+      proc->state_tabs.string = buff->buff0;
+      proc->state_tabs.len = len;
     }
-    if(CDR(char_list) != R_NilValue)
-      error("Internal Error: wrapped element count mismatch 2");  // nocov
-  } else {
-    // recall there is an extra open PROTECT in first_only mode
-    res = res_sxp;
+    if(
+      FANSI_tabs_as_spaces_one(
+        &proc->state_tabs, len, proc->tab_stops, &proc->buff_tabs, i
+    ) ) {
+      buff = &proc->buff_tabs;
+      len = (int)(buff->buff - buff->buff0);
+  } }
+  if(!buff) return CHAR(chr);
+  *bytes = len;
+  return buff->buff0;
+}
+/*
+ * Size the buffers and initialize the states `process_elt` uses.
+ *
+ * `proc` should be set up as in `FANSI_strwrap_ext` beforehand.
+ *
+ * @return a list holding the format tables of the states, which the caller
+ *   must PROTECT for as long as it uses `proc`.
+ */
+static SEXP wrap_proc_init(
+  struct wrap_proc * proc, SEXP x, int strip, int tabs,
+  SEXP warn, SEXP term_cap, SEXP ctl
+) {
+  int size_strip = 0, size_tabs = 0;
+  for(R_xlen_t i = 0; i < XLENGTH(x); ++i) {
+    FANSI_interrupt(i);
+    SEXP chr = STRING_ELT(x, i);
+    if(chr == NA_STRING) continue;
+    if(LENGTH(chr) > size_strip) size_strip = LENGTH(chr);
+    if(tabs) {
+      int size = FANSI_tabs_size(CHAR(chr), LENGTH(chr), proc->tab_stops);
+      if(size > size_tabs) size_tabs = size;
+  } }
+  SEXP mem = PROTECT(allocVector(VECSXP, 2));
+  SEXP R_true = PROTECT(ScalarLogical(1));
+  SEXP R_zero = PROTECT(ScalarInteger(0));
+  SEXP R_one = PROTECT(ScalarInteger(1));
+  if(strip) {
+    proc->strip = 1;
+    proc->state_strip = FANSI_state_init_full(
+      x, R_zero, term_cap, R_true, R_true, R_zero, ctl, 0
+    );
+    SET_VECTOR_ELT(mem, 0, proc->state_strip.tab->mem);
+    FANSI_size_buff0(&proc->buff_strip, size_strip);
   }
-
-  UNPROTECT(prt);
-  state_carry->fmt.sgr = state.fmt.sgr;
-  state_carry->fmt.url = state.fmt.url;
-  return res;
+  if(size_tabs) {
+    proc->tabs = 1;
+    proc->state_tabs = FANSI_state_init_full(
+      x, warn, term_cap, R_true, R_true, R_one, ctl, 0
+    );
+    SET_VECTOR_ELT(mem, 1, proc->state_tabs.tab->mem);
+    FANSI_size_buff0(&proc->buff_tabs, size_tabs);
+  }
+  UNPROTECT(4);
+  return mem;
 }
+/*
+ * Leading strings for the first line of the input, the first line of each
+ * paragraph, and all other lines.
+ */
+struct wrap_pre {
+  struct FANSI_prefix_dat ini_first, pre_first, pre_next;
+};
+static struct wrap_pre wrap_pre(
+  SEXP prefix, SEXP initial, SEXP indent, SEXP exdent,
+  SEXP warn, SEXP term_cap, SEXP ctl
+) {
+  // Prepare the leading strings; could turn out to be wasteful if we don't
+  // need them all; there are three possible combinations: 1) first line of the
+  // entire input with indent, 2) first line of paragraph with prefix and
+  // indent, 3) other lines with prefix and exdent.
+
+  struct FANSI_prefix_dat pre_dat_raw, ini_dat_raw;
+  struct wrap_pre pre;
 
+  int indent_int = asInteger(indent);
+  int exdent_int = asInteger(exdent);
+
+  if(indent_int < 0 || exdent_int < 0)
+    error("Internal Error: illegal indent/exdent values.");  // nocov
+
+  pre_dat_raw = make_pre(prefix, warn, term_cap, ctl, "prefix");
+
+  if(prefix != initial) {
+    ini_dat_raw = make_pre(initial, warn, term_cap, ctl, "initial");
+  } else ini_dat_raw = pre_dat_raw;
+
+  pre.ini_first = pad_pre(ini_dat_raw, indent_int);
+
+  if(initial != prefix) {
+    pre.pre_first = pad_pre(pre_dat_raw, indent_int);
+  } else pre.pre_first = pre.ini_first;
+
+  if(indent_int != exdent_int) {
+    pre.pre_next = pad_pre(pre_dat_raw, exdent_int);
+  } else pre.pre_next = pre.pre_first;
+
+  return pre;
+}
+/*
+ * Check that widths are feasible, although really only relevant if in strict
+ * mode
+ *
+ * @return whether they are not, in which case `wrap_pre_error` should be
+ *   called once any errors or warnings that precede it have been signaled.
+ */
+static int wrap_pre_check(struct wrap_pre pre, int width, int wrap_always) {
+  return
+    wrap_always && (
+      pre.ini_first.width >= width ||
+      pre.pre_first.width >= width ||
+      pre.pre_next.width >= width
+    );
+}
+static void wrap_pre_error(void) {
+  error(
+    "%s%s",
+    "Width error: sum of `indent` and `initial` width or sum of `exdent` ",
+    "and `prefix` width must be less than `width - 1` when in `wrap.always`."
+  );
+}
 /*
  * All integer inputs are expected to be positive, which should be enforced by
  * the R interface checks.
  *
+ * @param x character vector, or an index of one (see index.c).
  * @param strict whether to force a hard cut in-word when a full word violates
  *   the width limit on its own
- * @param first_only whether we only want the first line of a wrapped element,
- *   this is to support strtrim. If this is true then the return value becomes a
- *   character vector (STRSXP) rather than a VECSXP
+ * @param first_only whether we only want the first line of a wrapped element.
+ *   If this is true then the return value becomes a character vector (STRSXP)
+ *   rather than a VECSXP.  `strtrim_ctl` uses `FANSI_strtrim_ext` instead,
+ *   which produces the same result without going through `strwrap`.
+ * @param balance whether to balance line widths within each paragraph (see
+ *   `wrap_bal`), which is ignored in `first_only` mode.
+ * @param carry_out whether to attach the state at the end of the last element
+ *   as a "carry" attribute when `carry` is in use, so that a caller wrapping
+ *   input in chunks can carry it into the next chunk.
  */
 
 SEXP FANSI_strwrap_ext(
@@ -515,8 +1163,13 @@ SEXP FANSI_strwrap_ext(
   SEXP warn, SEXP term_cap,
   SEXP first_only,
   SEXP ctl, SEXP norm, SEXP carry,
-  SEXP terminate
+  SEXP terminate, SEXP threads, SEXP balance, SEXP carry_out
 ) {
+  // Parsed string index may be provided in lieu of `x` (see index.c)
+  struct FANSI_index index;
+  struct FANSI_index * idx = FANSI_index_get(&index, x);
+  if(idx) x = idx->x;
+
   FANSI_val_args(x, norm, carry);
   // FANSI_state_init does validations too
   if(
@@ -529,7 +1182,10 @@ SEXP FANSI_strwrap_ext(
     TYPEOF(tabs_as_spaces) != LGLSXP ||
     TYPEOF(tab_stops) != INTSXP ||
     TYPEOF(first_only) != LGLSXP ||
-    TYPEOF(terminate) != LGLSXP
+    TYPEOF(terminate) != LGLSXP ||
+    TYPEOF(threads) != INTSXP ||
+    TYPEOF(balance) != LGLSXP ||
+    TYPEOF(carry_out) != LGLSXP
   )
     error("Internal Error: arg type error 1; contact maintainer.");  // nocov
 
@@ -544,36 +1200,9 @@ SEXP FANSI_strwrap_ext(
       "printable ASCII character."
     );
 
-  // Prepare the leading strings; could turn out to be wasteful if we don't
-  // need them all; there are three possible combinations: 1) first line of the
-  // entire input with indent, 2) first line of paragraph with prefix and
-  // indent, 3) other lines with prefix and exdent.
-
-  struct FANSI_prefix_dat pre_dat_raw, ini_dat_raw,
-    ini_first_dat, pre_first_dat, pre_next_dat;
-
-  int indent_int = asInteger(indent);
-  int exdent_int = asInteger(exdent);
   int first_only_int = asInteger(first_only);
-
-  if(indent_int < 0 || exdent_int < 0)
-    error("Internal Error: illegal indent/exdent values.");  // nocov
-
-  pre_dat_raw = make_pre(prefix, warn, term_cap, ctl, "prefix");
-
-  if(prefix != initial) {
-    ini_dat_raw = make_pre(initial, warn, term_cap, ctl, "initial");
-  } else ini_dat_raw = pre_dat_raw;
-
-  ini_first_dat = pad_pre(ini_dat_raw, indent_int);
-
-  if(initial != prefix) {
-    pre_first_dat = pad_pre(pre_dat_raw, indent_int);
-  } else pre_first_dat = ini_first_dat;
-
-  if(indent_int != exdent_int) {
-    pre_next_dat = pad_pre(pre_dat_raw, exdent_int);
-  } else pre_next_dat = pre_first_dat;
+  struct wrap_pre pre =
+    wrap_pre(prefix, initial, indent, exdent, warn, term_cap, ctl);
 
   // Set up the buffer, this will be created in FANSI_strwrap, but we want a
   // handle for it here so we can re-use.
@@ -581,16 +1210,57 @@ SEXP FANSI_strwrap_ext(
   struct FANSI_buff buff;
   FANSI_INIT_BUFF(&buff);
 
+  // Threads only used without carry or balance, and limited to what OpenMP
+  // would use by default.
+  int do_carry = STRING_ELT(carry, 0) != NA_STRING;
+  int balance_int = asLogical(balance) && !first_only_int;
+  int n_thread = 1;
+#ifdef _OPENMP
+  if(!first_only_int && !do_carry && !balance_int) {
+    n_thread = asInteger(threads);
+    if(n_thread > omp_get_max_threads()) n_thread = omp_get_max_threads();
+  }
+#endif
+  SEXP R_true = PROTECT(ScalarLogical(1)); ++prt;
+  SEXP R_one = PROTECT(ScalarInteger(1)); ++prt;
+  R_xlen_t i, x_len = XLENGTH(x);
+
   // Strip whitespaces as needed; `strwrap` doesn't seem to do this with prefix
   // and initial, so we don't either
   int strip_spaces_int = asInteger(strip_spaces);
-  if(strip_spaces_int) {
-    x = PROTECT(FANSI_process(x, term_cap, ctl, &buff)); ++prt;
+  int tabs_int = asInteger(tabs_as_spaces);
+  struct wrap_proc proc = {.tab_stops = tab_stops};
+  FANSI_INIT_BUFF(&proc.buff_strip);
+  FANSI_INIT_BUFF(&proc.buff_tabs);
+  struct wrap_bal bal = {.buff = R_NilValue};
+  PROTECT_WITH_INDEX(bal.buff, &bal.ipx); ++prt;
+
+  if(x_len && (strip_spaces_int || tabs_int)) {
+    // Elements are processed as they are wrapped, see `wrap_proc`
+    PROTECT(
+      wrap_proc_init(
+        &proc, x, strip_spaces_int, tabs_int, warn, term_cap, ctl
+    ) ); ++prt;
+  }
+  // If the widths are not feasible, first signal what processing `x` would
+  // have, in the same order as when `x` was processed ahead of wrapping:
+  // spaces stripped from all elements, then tabs expanded in all.
+  int width_int = asInteger(width);
+  int wrap_always_int = asInteger(wrap_always);
+  int pre_fail = wrap_pre_check(pre, width_int, wrap_always_int);
+  if(pre_fail && (proc.strip || proc.tabs)) {
+    int tabs = proc.tabs;
+    for(int k = !proc.strip; k <= tabs; ++k) {
+      proc.tabs = k;
+      for(i = 0; i < x_len; ++i) {
+        int len;
+        FANSI_interrupt(i);
+        process_elt(&proc, x, i, &len);
+    } }
+    proc.tabs = tabs;
   }
   // and tabs
-  if(asInteger(tabs_as_spaces)) {
-    x = PROTECT(FANSI_tabs_as_spaces(x, tab_stops, &buff, warn, term_cap, ctl));
-    ++prt;
+  if(tabs_int) {
     prefix = PROTECT(
       FANSI_tabs_as_spaces(prefix, tab_stops, &buff, warn, term_cap, ctl)
     ); ++prt;
@@ -598,34 +1268,17 @@ SEXP FANSI_strwrap_ext(
       FANSI_tabs_as_spaces(initial, tab_stops, &buff, warn, term_cap, ctl)
     ); ++prt;
   }
-
-  // Check that widths are feasible, although really only relevant if in strict
-  // mode
-  int width_int = asInteger(width);
-  int wrap_always_int = asInteger(wrap_always);
-
-  if(
-    wrap_always_int && (
-      ini_first_dat.width >= width_int ||
-      pre_first_dat.width >= width_int ||
-      pre_next_dat.width >= width_int
-    )
-  )
-    error(
-      "%s%s",
-      "Width error: sum of `indent` and `initial` width or sum of `exdent` ",
-      "and `prefix` width must be less than `width - 1` when in `wrap.always`."
-    );
+  if(pre_fail) wrap_pre_error();
 
   // Prep for carry
-  int do_carry = STRING_ELT(carry, 0) != NA_STRING;
   int any_na = 0;
-  struct FANSI_state state_carry = FANSI_carry_init(carry, warn, term_cap, ctl);
+  struct FANSI_state state_carry =
+    FANSI_carry_init(carry, warn, term_cap, ctl);
+  PROTECT(state_carry.tab->mem); ++prt;
 
   // Could be a little faster avoiding this allocation if it turns out nothing
   // needs to be wrapped and we're in simplify=TRUE, but that seems like a lot
   // of work for a rare event
-  R_xlen_t i, x_len = XLENGTH(x);
   SEXP res;
 
   if(first_only_int) {
@@ -634,9 +1287,36 @@ SEXP FANSI_strwrap_ext(
   } else {
     res = PROTECT(allocVector(VECSXP, x_len)); ++prt;
   }
-  SEXP R_true = PROTECT(ScalarLogical(1)); ++prt;
-  SEXP R_one = PROTECT(ScalarInteger(1)); ++prt;
   struct FANSI_state state;
+  // Break points of the lines in the current element, written out once it is
+  // wrapped (see `write_plan`)
+  struct wrap_plan plan = {.grow = 1, .mem = R_NilValue};
+  PROTECT_WITH_INDEX(plan.mem, &plan.ipx); ++prt;
+  // Batch memory is from R rather than `R_alloc` so it does not get in the way
+  // of releasing `buff`.
+  struct wrap_batch batch = {.mem = R_NilValue};
+  R_xlen_t batch_n = (R_xlen_t) n_thread * WRAP_BATCH;
+  if(n_thread > 1) {
+    PROTECT_WITH_INDEX(batch.mem, &batch.ipx); ++prt;
+    SEXP batch_sxp = PROTECT(
+      allocVector(
+        RAWSXP,
+        batch_n *
+          (sizeof(*batch.string) + sizeof(*batch.plan) + sizeof(int)) +
+        (R_xlen_t) n_thread * (WRAP_LINES * sizeof(*batch.lines) + sizeof(int))
+    ) ); ++prt;
+    // Largest alignment first
+    batch.lines = (struct wrap_line *) RAW(batch_sxp);
+    batch.plan = (struct wrap_plan *) (batch.lines + n_thread * WRAP_LINES);
+    batch.string = (const char **) (batch.plan + batch_n);
+    batch.used = (int *) (batch.string + batch_n);
+    batch.len = batch.used + n_thread;
+  }
+  // Rendered bridges and closes, also from R (see `wrap_cache`)
+  SEXP cache_sxp = PROTECT(allocVector(RAWSXP, sizeof(struct wrap_cache)));
+  ++prt;
+  struct wrap_cache * cache = (struct wrap_cache *) RAW(cache_sxp);
+  memset(cache, 0, sizeof(*cache));
 
   // Wrap each element
   for(i = 0; i < x_len; ++i) {
@@ -644,9 +1324,91 @@ SEXP FANSI_strwrap_ext(
       state = FANSI_state_init_full(
         x, warn, term_cap, R_true, R_true, R_one, ctl, i
       );
+      PROTECT(state.tab->mem); ++prt;
     } else FANSI_state_reinit(&state, x, i);
 
     FANSI_interrupt(i);
+    if(n_thread > 1 && i == batch.end) {
+      // Plan next batch of elements in parallel, see `wrap_batch`
+      batch.start = i;
+      batch.end = x_len - i > batch_n ? i + batch_n : x_len;
+      size_t mem_size = 0;
+      for(R_xlen_t j = batch.start; j < batch.end; ++j) {
+        SEXP chr = STRING_ELT(x, j);
+        cetype_t type = getCharCE(chr);
+        int plain =
+          (type == CE_NATIVE || type == CE_UTF8) &&
+          LENGTH(chr) <= FANSI_lim.lim_int.max &&
+          FANSI_read_plain(CHAR(chr), LENGTH(chr));
+        batch.string[j - batch.start] = plain ? CHAR(chr) : NULL;
+        batch.len[j - batch.start] = LENGTH(chr);
+        if(plain) mem_size += (size_t) LENGTH(chr) + 1;
+      }
+      if(proc.strip || proc.tabs) {
+        // Stripping spaces does not lengthen plain elements, and they have no
+        // tabs to expand.
+        if(batch.mem == R_NilValue || mem_size > (size_t) XLENGTH(batch.mem))
+          REPROTECT(
+            batch.mem = allocVector(RAWSXP, (R_xlen_t) mem_size), batch.ipx
+          );
+        char * mem = (char *) RAW(batch.mem);
+        for(R_xlen_t j = batch.start; j < batch.end; ++j) {
+          R_xlen_t k = j - batch.start;
+          if(!batch.string[k]) continue;
+          const char * string = process_elt(&proc, x, j, batch.len + k);
+          if(string != batch.string[k]) {
+            if(
+              (size_t) (mem - (char *) RAW(batch.mem)) + batch.len[k] + 1 >
+              (size_t) XLENGTH(batch.mem)
+            )
+              error("Internal Error: processed element too long.");  // nocov
+            memcpy(mem, string, batch.len[k]);
+            mem[batch.len[k]] = 0;
+            batch.string[k] = mem;
+            mem += batch.len[k] + 1;
+      } } }
+      for(int t = 0; t < n_thread; ++t) batch.used[t] = 0;
+      int terminate_int = asLogical(terminate);
+      struct FANSI_state state_tpl = state;
+
+#ifdef _OPENMP
+      #pragma omp parallel for num_threads(n_thread) schedule(dynamic, 4)
+#endif
+      for(R_xlen_t j = batch.start; j < batch.end; ++j) {
+        struct wrap_plan * plan = batch.plan + j - batch.start;
+        const char * string = batch.string[j - batch.start];
+        plan->fail = 1;
+        int len = batch.len[j - batch.start];
+        if(!string) continue;
+
+        int t = 0;
+#ifdef _OPENMP
+        t = omp_get_thread_num();
+#endif
+        *plan = (struct wrap_plan) {
+          .lines = batch.lines + t * WRAP_LINES + batch.used[t],
+          .alloc = WRAP_LINES - batch.used[t]
+        };
+        struct FANSI_state state_j = state_tpl;
+        state_j.string = string;
+        state_j.len = len;
+        FANSI_reset_state(&state_j);
+        strwrap(
+          width_int, j ? pre.pre_first : pre.ini_first, pre.pre_next,
+          wrap_always_int, NULL, pad, strip_spaces_int, first_only_int, j,
+          normalize, do_carry, state_j, NULL, terminate_int, plan, NULL, NULL,
+          NULL
+        );
+        if(!plan->fail) batch.used[t] += plan->n;
+      }
+    }
+    // Elements in the batch were processed as it was set up
+    if(n_thread > 1 && batch.string[i - batch.start]) {
+      state.string = batch.string[i - batch.start];
+      state.len = batch.len[i - batch.start];
+    } else if(proc.strip || proc.tabs)
+      state.string = process_elt(&proc, x, i, &state.len);
+
     // strtrim treats NA as NA, but strwrap treats it as the string "NA"
     if(
       first_only_int && (
@@ -658,23 +1420,45 @@ SEXP FANSI_strwrap_ext(
       continue;
     }
     // Implicitly treat NAs like the string 'NA' as the base version does
-    SEXP str_i = PROTECT(
-      strwrap(
-        width_int,
-        i ? pre_first_dat : ini_first_dat,
-        pre_next_dat,
-        wrap_always_int,
-        &buff,
-        CHAR(asChar(pad_end)),
-        strip_spaces_int,
-        first_only_int,
-        i,
-        normalize,
-        do_carry,
-        state,
-        &state_carry,
-        asLogical(terminate)
-    ) );
+    SEXP str_i;
+    if(n_thread > 1 && !batch.plan[i - batch.start].fail) {
+      str_i = PROTECT(
+        write_plan(
+          batch.plan[i - batch.start],
+          i ? pre.pre_first : pre.ini_first, pre.pre_next,
+          &buff, pad, i, normalize, asLogical(terminate), cache
+      ) );
+    } else {
+      plan.n = 0;
+      str_i = PROTECT(
+        strwrap(
+          width_int,
+          i ? pre.pre_first : pre.ini_first,
+          pre.pre_next,
+          wrap_always_int,
+          &buff,
+          pad,
+          strip_spaces_int,
+          first_only_int,
+          i,
+          normalize,
+          do_carry,
+          state,
+          &state_carry,
+          asLogical(terminate),
+          first_only_int ? NULL : &plan,
+          idx,
+          balance_int ? &bal : NULL,
+          cache
+      ) );
+      if(!first_only_int) {
+        UNPROTECT(1);
+        str_i = PROTECT(
+          write_plan(
+            plan, i ? pre.pre_first : pre.ini_first, pre.pre_next,
+            &buff, pad, i, normalize, asLogical(terminate), cache
+        ) );
+    } }
     if(first_only_int) {
       SET_STRING_ELT(res, i, str_i);
     } else {
@@ -682,7 +1466,321 @@ SEXP FANSI_strwrap_ext(
     }
     UNPROTECT(1);
   }
+  if(do_carry && asLogical(carry_out)) {
+    FANSI_state_as_chr(&buff, state_carry, 0, 0);
+    SEXP carry_end = PROTECT(FANSI_mkChar(buff, CE_NATIVE, 0)); ++prt;
+    setAttrib(res, install("carry"), ScalarString(carry_end));
+  }
+  FANSI_release_buff(&buff, 1);
+  FANSI_release_buff(&proc.buff_tabs, 1);
+  FANSI_release_buff(&proc.buff_strip, 1);
+  UNPROTECT(prt);
+  return res;
+}
+/*
+ * Trim an element to `width`
+ *
+ * Produces the same string as the first line `strwrap` would in `first_only`
+ * mode with `wrap_always`, and no prefix, padding, or space stripping, but
+ * reads only as far as `width`.  Runs of printable ASCII clear of `width` are
+ * skipped over in one step, and the rest is read an element at a time as the
+ * treatment of trailing zero width elements depends on whether the line has a
+ * boundary and on the last element before the cut.
+ *
+ * @param state the state to start from, with any carried format applied, and
+ *   which is updated to the end of the trimmed string.
+ * @return the trimmed string as a CHARSXP.
+ */
+static SEXP strtrim(
+  int width, struct FANSI_state * state, struct FANSI_buff * buff,
+  R_xlen_t i, int terminate
+) {
+  const char * arg = "x";
+  struct FANSI_state state_start, state_prev, state_next, state_tmp;
+  struct FANSI_state state_last = *state;
+  if(terminate) FANSI_reset_state(&state_last);
+
+  // Consume any leading specials (to be re-output)
+  state_tmp = state_start = *state;
+  FANSI_read_next(&state_tmp, i, arg);
+  if(state_tmp.status & STAT_SPECIAL) state_start = state_tmp;
+  else state_start.status |= state_tmp.status & STAT_WARNED;
+  while(state_start.string[state_start.pos.x] == 0x1b) {
+    state_tmp = state_start;
+    FANSI_read_next(&state_tmp, i, arg);
+    if(!(state_tmp.status & STAT_SPECIAL)) {
+      state_start.status |= state_tmp.status & STAT_WARNED;
+      break;
+    }
+    state_start = state_tmp;
+  }
+  state_start.pos.w = 0;
+  *state = state_prev = state_start;
+
+  int has_boundary = 0, end;
+  while(1) {
+    int skip = width > state->pos.w ?
+      FANSI_scan_print_state(state, width - state->pos.w) : 0;
+    if(skip) {
+      if(memchr(state->string + state->pos.x, ' ', skip)) has_boundary = 1;
+      if(skip > 1) word_skip(state, skip - 1);
+      state_prev = *state;
+      word_skip(state, 1);
+    }
+    char chr = state->string[state->pos.x];
+    end = !chr;
+    if(chr == ' ' || chr == '\t' || chr == '\n') has_boundary = 1;
+
+    state_next = *state;
+    if(!end) FANSI_read_next(&state_next, i, arg);
+    if(state_next.status & STAT_WARNED) state->status |= STAT_WARNED;
+    if(
+      end || state->pos.w > width ||
+      (state->pos.w == width && state_next.pos.w > state->pos.w)
+    )
+      break;
+    state_prev = *state;
+    *state = state_next;
+  }
+  // Drop overshooting wide characters and trailing specials as `strwrap` does
+  int strip_trail = (state->status & STAT_SPECIAL) && (!end || terminate);
+  if(!has_boundary) {
+    if(
+      state->pos.w > width || (state->pos.w == width && strip_trail)
+    )
+      *state = state_prev;
+  } else if(end && strip_trail) *state = state_prev;
+
+  struct FANSI_prefix_dat pre = {.string = ""};
+  return writeline(
+    *state, state_start, state_last, buff, pre, width, "", i, 0, terminate,
+    NULL
+  );
+}
+/*
+ * Trim each element to `width` (`strtrim_ctl`)
+ *
+ * Equivalent to `FANSI_strwrap_ext` in `first_only` mode with `wrap_always`,
+ * but reads each element only up to `width` (see `strtrim`).  With `carry` the
+ * rest of each element is read for the state to carry to the next one, which
+ * as in `FANSI_strwrap_ext` warns about anything past the trim point.
+ */
+SEXP FANSI_strtrim_ext(
+  SEXP x, SEXP width,
+  SEXP tabs_as_spaces, SEXP tab_stops,
+  SEXP warn, SEXP term_cap,
+  SEXP ctl, SEXP norm, SEXP carry,
+  SEXP terminate
+) {
+  FANSI_val_args(x, norm, carry);
+  if(
+    TYPEOF(width) != INTSXP ||
+    TYPEOF(tabs_as_spaces) != LGLSXP ||
+    TYPEOF(tab_stops) != INTSXP ||
+    TYPEOF(terminate) != LGLSXP
+  )
+    error("Internal Error: arg type error 1; contact maintainer.");  // nocov
+
+  int width_int = asInteger(width);
+  if(width_int == NA_INTEGER)
+    error("Internal Error: invalid width.");  // nocov
+  int terminate_int = asLogical(terminate);
+  int do_carry = STRING_ELT(carry, 0) != NA_STRING;
+  int prt = 0;
+
+  struct FANSI_buff buff;
+  FANSI_INIT_BUFF(&buff);
+
+  SEXP R_true = PROTECT(ScalarLogical(1)); ++prt;
+  SEXP R_one = PROTECT(ScalarInteger(1)); ++prt;
+  R_xlen_t x_len = XLENGTH(x);
+
+  // Tabs are expanded in each element just before it is trimmed
+  struct wrap_proc proc = {.tab_stops = tab_stops};
+  FANSI_INIT_BUFF(&proc.buff_strip);
+  FANSI_INIT_BUFF(&proc.buff_tabs);
+  if(x_len && asInteger(tabs_as_spaces)) {
+    PROTECT(wrap_proc_init(&proc, x, 0, 1, warn, term_cap, ctl)); ++prt;
+  }
+  // As in `FANSI_strwrap_ext`, a width with no room for a character is an
+  // error signaled after anything expanding tabs would signal.
+  if(width_int < 1) {
+    for(R_xlen_t i = 0; i < x_len && proc.tabs; ++i) {
+      int len;
+      FANSI_interrupt(i);
+      process_elt(&proc, x, i, &len);
+    }
+    wrap_pre_error();
+  }
+  struct FANSI_state state_carry =
+    FANSI_carry_init(carry, warn, term_cap, ctl);
+  PROTECT(state_carry.tab->mem); ++prt;
+  struct FANSI_state state;
+  SEXP res = PROTECT(allocVector(STRSXP, x_len)); ++prt;
+  int any_na = 0;
+
+  for(R_xlen_t i = 0; i < x_len; ++i) {
+    if(!i) {
+      state = FANSI_state_init_full(
+        x, warn, term_cap, R_true, R_true, R_one, ctl, i
+      );
+      PROTECT(state.tab->mem); ++prt;
+    } else FANSI_state_reinit(&state, x, i);
+    if(proc.tabs) state.string = process_elt(&proc, x, i, &state.len);
+
+    FANSI_interrupt(i);
+    // strtrim treats NA as NA, but strwrap treats it as the string "NA"
+    if(STRING_ELT(x, i) == NA_STRING || (do_carry && any_na)) {
+      any_na = 1;
+      SET_STRING_ELT(res, i, NA_STRING);
+      continue;
+    }
+    if(do_carry) FANSI_state_copy_fmt(&state, &state_carry);
+    SET_STRING_ELT(
+      res, i, strtrim(width_int, &state, &buff, i, terminate_int)
+    );
+    if(do_carry) {
+      FANSI_read_all(&state, i, "x");
+      FANSI_state_copy_fmt(&state_carry, &state);
+  } }
+  FANSI_release_buff(&buff, 1);
+  FANSI_release_buff(&proc.buff_tabs, 1);
+  FANSI_release_buff(&proc.buff_strip, 1);
+  UNPROTECT(prt);
+  return res;
+}
+/*
+ * Where Each Element Would be Wrapped
+ *
+ * Wraps as `FANSI_strwrap_ext` does with `strip_spaces` and `tabs_as_spaces`
+ * FALSE, no padding, and `terminate` TRUE, but instead of writing the lines
+ * records where they are in the input.  For each element returns an integer
+ * matrix with a row for each line and columns for the 1-based start and stop
+ * bytes of the line, its display width, and the id of the format active at
+ * its start.  The "formats" attribute of the result holds the sequences that
+ * open each format, the first (id 0) being the empty string and the others
+ * in order of first use.
+ *
+ * Lines are not written so neither `writeline` nor the buffers it uses are
+ * involved.  Spaces can't be stripped and tabs can't be expanded as positions
+ * would then not refer to the input.  `x` may be an index with words recorded
+ * (see index.c), in which case re-wrapping at different widths does not
+ * re-read the words that fit on the lines.
+ */
+SEXP FANSI_wrap_breaks_ext(
+  SEXP x, SEXP width,
+  SEXP indent, SEXP exdent,
+  SEXP prefix, SEXP initial,
+  SEXP wrap_always,
+  SEXP warn, SEXP term_cap,
+  SEXP ctl, SEXP carry
+) {
+  struct FANSI_index index;
+  struct FANSI_index * idx = FANSI_index_get(&index, x);
+  if(idx) x = idx->x;
+
+  if(TYPEOF(x) != STRSXP)
+    error("Argument `x` must be character.");     // nocov
+  if(TYPEOF(carry) != STRSXP || XLENGTH(carry) != 1L)
+    error("Argument `carry` must be scalar character.");         // nocov
+  if(
+    TYPEOF(width) != INTSXP ||
+    TYPEOF(indent) != INTSXP || TYPEOF(exdent) != INTSXP ||
+    TYPEOF(prefix) != STRSXP || TYPEOF(initial) != STRSXP ||
+    TYPEOF(wrap_always) != LGLSXP
+  )
+    error("Internal Error: arg type error 1; contact maintainer.");  // nocov
+
+  int prt = 0;
+  struct wrap_pre pre =
+    wrap_pre(prefix, initial, indent, exdent, warn, term_cap, ctl);
+  int width_int = asInteger(width);
+  int wrap_always_int = asInteger(wrap_always);
+  if(wrap_pre_check(pre, width_int, wrap_always_int)) wrap_pre_error();
+
+  int do_carry = STRING_ELT(carry, 0) != NA_STRING;
+  struct FANSI_state state_carry =
+    FANSI_carry_init(carry, warn, term_cap, ctl);
+  PROTECT(state_carry.tab->mem); ++prt;
+
+  SEXP R_true = PROTECT(ScalarLogical(1)); ++prt;
+  SEXP R_one = PROTECT(ScalarInteger(1)); ++prt;
+  SEXP col_names = PROTECT(allocVector(STRSXP, 4)); ++prt;
+  SET_STRING_ELT(col_names, 0, mkChar("start"));
+  SET_STRING_ELT(col_names, 1, mkChar("stop"));
+  SET_STRING_ELT(col_names, 2, mkChar("width"));
+  SET_STRING_ELT(col_names, 3, mkChar("format"));
+  SEXP dim_names = PROTECT(allocVector(VECSXP, 2)); ++prt;
+  SET_VECTOR_ELT(dim_names, 1, col_names);
+
+  R_xlen_t x_len = XLENGTH(x);
+  SEXP res = PROTECT(allocVector(VECSXP, x_len)); ++prt;
+  struct wrap_plan plan = {.grow = 1, .mem = R_NilValue};
+  PROTECT_WITH_INDEX(plan.mem, &plan.ipx); ++prt;
+  struct FANSI_state state;
+
+  for(R_xlen_t i = 0; i < x_len; ++i) {
+    if(!i) {
+      state = FANSI_state_init_full(
+        x, warn, term_cap, R_true, R_true, R_one, ctl, i
+      );
+      PROTECT(state.tab->mem); ++prt;
+    } else FANSI_state_reinit(&state, x, i);
+    FANSI_interrupt(i);
+
+    // NAs are wrapped as the string "NA", as with `strwrap`
+    plan.n = 0;
+    strwrap(
+      width_int, i ? pre.pre_first : pre.ini_first, pre.pre_next,
+      wrap_always_int, NULL, "", 0, 0, i, 0, do_carry, state, &state_carry,
+      1, &plan, idx, NULL, NULL
+    );
+    SEXP lines = PROTECT(allocMatrix(INTSXP, plan.n, 4));
+    int * start = INTEGER(lines), * stop = start + plan.n,
+      * line_width = stop + plan.n, * fmt = line_width + plan.n;
+    for(int k = 0; k < plan.n; ++k) {
+      struct wrap_line * line = plan.lines + k;
+      start[k] = line->start.pos.x + 1;
+      stop[k] = line->bound.pos.x;
+      line_width[k] = line->bound.pos.w - line->start.pos.w;
+      fmt[k] = (int) line->start.fmt_id;
+    }
+    setAttrib(lines, R_DimNamesSymbol, dim_names);
+    SET_VECTOR_ELT(res, i, lines);
+    UNPROTECT(1);
+  }
+  // Number formats in order of first use so that ids do not depend on what
+  // else was added to the table (e.g. an index skips formats inside words)
+  unsigned int tab_n = x_len ? state.tab->n : 1;
+  int * map = (int *) R_alloc(tab_n, sizeof(int));
+  unsigned int * ids = (unsigned int *) R_alloc(tab_n, sizeof(unsigned int));
+  for(unsigned int id = 1; id < tab_n; ++id) map[id] = -1;
+  map[0] = 0;
+  ids[0] = 0;
+  int fmt_n = 1;
+  for(R_xlen_t i = 0; i < x_len; ++i) {
+    SEXP lines = VECTOR_ELT(res, i);
+    int n = (int) (XLENGTH(lines) / 4);
+    int * fmt = INTEGER(lines) + 3 * n;
+    for(int k = 0; k < n; ++k) {
+      if(map[fmt[k]] < 0) {
+        map[fmt[k]] = fmt_n;
+        ids[fmt_n++] = (unsigned int) fmt[k];
+      }
+      fmt[k] = map[fmt[k]];
+  } }
+  // Sequences that open each format, all line states share the table
+  SEXP formats = PROTECT(allocVector(STRSXP, fmt_n)); ++prt;
+  struct FANSI_buff buff;
+  FANSI_INIT_BUFF(&buff);
+  SET_STRING_ELT(formats, 0, R_BlankString);
+  for(int id = 1; id < fmt_n; ++id) {
+    state.fmt_id = ids[id];
+    FANSI_state_as_chr(&buff, state, 0, 0);
+    SET_STRING_ELT(formats, id, FANSI_mkChar(buff, CE_NATIVE, 0));
+  }
   FANSI_release_buff(&buff, 1);
+  setAttrib(res, install("formats"), formats);
   UNPROTECT(prt);
   return res;
 }